@@ -0,0 +1,90 @@
+--==============================================================================
+-- File: benchmark.lua
+--
+-- Description: Frame rate and per-stage timings of the grab/convert path,
+--              measured against the synthetic or replay source so that no
+--              Kinect is needed.
+--
+--              make kinect-benchmark
+--              or, from Lua: kinect.benchmark{frames=600, fps=0}
+--==============================================================================
+
+local pixels = 480*640
+
+local function percentile(samples, p)
+   local sorted = {}
+   for i,v in ipairs(samples) do sorted[i] = v end
+   table.sort(sorted)
+   return sorted[math.max(1, math.ceil(p*#sorted))] or 0
+end
+
+local grabs = {
+   {name='grabRGB',   size={3,480,640}, streams={'rgb'}},
+   {name='grabDepth', size={1,480,640}, streams={'depth'}},
+   {name='grabRGBD',  size={4,480,640}, streams={'rgb','depth'}},
+}
+
+local stages = {'wait','swap','convert'}
+
+function kinect.benchmark(...)
+   local _,id,source,file,fps,frames = dok.unpack(
+      {...},
+      'kinect.benchmark',
+      [[time the grab functions for Float and Double tensors,
+         report frames/s, ns/pixel and p50/p99 latency per stage]],
+      {arg='id', type='number', help='id of the device', default=0},
+      {arg='source', type='string', help='synthetic | replay', default='synthetic'},
+      {arg='file', type='string', help='raw RGB/depth frames for the replay source'},
+      {arg='fps', type='number', help='rate of the source, 0 for as fast as possible',
+       default=0},
+      {arg='frames', type='number', help='frames timed per grab function', default=300})
+   kinect.initDevice{id=id, source=source, file=file, fps=fps}
+   print('conversion kernel: '..libkinect.kernel())
+
+   local results = {}
+   for _,Tensor in ipairs{torch.FloatTensor, torch.DoubleTensor} do
+      for _,grab in ipairs(grabs) do
+         local tensor = Tensor(unpack(grab.size))
+         local tname = tensor:type()
+         local fn = tensor.libkinect[grab.name]
+         -- warm up the rings and the caches
+         for i = 1,10 do fn(tensor, id) end
+
+         local samples = {total={}}
+         for _,stream in ipairs(grab.streams) do
+            for _,stage in ipairs(stages) do samples[stream..'.'..stage] = {} end
+         end
+         local convert = 0
+         local start = sys.clock()
+         for i = 1,frames do
+            local t = sys.clock()
+            fn(tensor, id)
+            samples.total[i] = (sys.clock() - t)*1e9
+            local timings = libkinect.timings(id)
+            for _,stream in ipairs(grab.streams) do
+               for _,stage in ipairs(stages) do
+                  samples[stream..'.'..stage][i] = timings[stream][stage]
+               end
+               convert = convert + timings[stream].convert
+            end
+         end
+         local elapsed = sys.clock() - start
+
+         local result = {type=tname, grab=grab.name,
+                         fps=frames/elapsed,
+                         nsPerPixel=convert/frames/pixels,
+                         stages={}}
+         print(string.format('%-18s %-9s %8.1f frames/s %7.2f ns/pixel (convert)',
+                             tname, grab.name, result.fps, result.nsPerPixel))
+         for name,values in pairs(samples) do
+            local stage = {p50=percentile(values, 0.5), p99=percentile(values, 0.99)}
+            result.stages[name] = stage
+            print(string.format('    %-14s p50 %10.1f us  p99 %10.1f us',
+                                name, stage.p50/1e3, stage.p99/1e3))
+         end
+         table.insert(results, result)
+      end
+   end
+   kinect.stop()
+   return results
+end
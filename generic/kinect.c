@@ -18,48 +18,482 @@
 #include <luaT.h>
 #include <TH.h>
 
+#if defined(TH_REAL_IS_BYTE) || defined(TH_REAL_IS_SHORT)
+/* integer maps hold raw values: rgb bytes, raw depth or millimeters */
+#define KINECT_INTEGER
+#endif
+#ifdef TH_REAL_IS_BYTE
+#define KINECT_REAL_MAX UCHAR_MAX
+#elif defined(TH_REAL_IS_SHORT)
+#define KINECT_REAL_MAX SHRT_MAX
+#endif
+
+#ifdef KINECT_INTEGER
+/* their geometry (meters, rays) stays in float */
+typedef float libkinect_(meter);
+#else
+typedef real libkinect_(meter);
+#endif
 
 //===========================================================
 // generic functions
 
-/*******************
- grab the rgb frame
-*******************/
+/* mean of n values, rounded for the integer maps */
+static real libkinect_(mean) (accreal sum, int n) {
+#ifdef KINECT_INTEGER
+  return (sum + n/2) / n;
+#else
+  return sum / n;
+#endif
+}
+
+/* a byte does not hold a depth reading */
+static void libkinect_(check_depth) (lua_State *L, const char *name) {
+#ifdef TH_REAL_IS_BYTE
+  luaL_error(L, "<libkinect.%s> depth does not fit a ByteTensor, use a ShortTensor", name);
+#else
+  (void)L; (void)name;
+#endif
+}
+
+/*****************************************************************
+ where the values of a map are: channel c of row y, column x is
+ data[c*sc + y*sh + x*sw], for CxHxW and HxWxC maps of any strides
+*****************************************************************/
+typedef struct {
+  real *data;
+  long sc, sh, sw;
+  int h, w;
+} libkinect_(view);
+
+static libkinect_(view) libkinect_(view_of) (THTensor *tensor, int hwc) {
+  libkinect_(view) view;
+  int d = tensor->nDimension;
+  view.data = THTensor_(data)(tensor);
+  if (hwc) {
+    view.h = tensor->size[d-3]; view.w = tensor->size[d-2];
+    view.sh = tensor->stride[d-3]; view.sw = tensor->stride[d-2]; view.sc = tensor->stride[d-1];
+  } else {
+    view.h = tensor->size[d-2]; view.w = tensor->size[d-1];
+    view.sh = tensor->stride[d-2]; view.sw = tensor->stride[d-1]; view.sc = d > 2 ? tensor->stride[d-3] : 0;
+  }
+  return view;
+}
+
+/*****************************************************************
+ view of a depth map: its last two sizes pick the scale, any other
+ tensor of 480*640 elements is 480x640, in the order of elements
+*****************************************************************/
+static libkinect_(view) libkinect_(depth_view_of) (THTensor *tensor) {
+  int d = tensor->nDimension;
+  long n = THTensor_(nElement)(tensor);
+  if (d >= 2 && scale_factor(tensor->size[d-2], tensor->size[d-1]) && n == tensor->size[d-2]*tensor->size[d-1])
+    return libkinect_(view_of)(tensor, 0);
+  THArgCheck(n == 640*480 && (d == 1 || THTensor_(isContiguous)(tensor)), 1,
+             "Depth buffer: 480x640 Tensor expected (or 240x320, 120x160, 60x80)");
+  libkinect_(view) view;
+  view.data = THTensor_(data)(tensor);
+  view.h = 480; view.w = 640;
+  view.sw = d == 1 ? tensor->stride[0] : 1;
+  view.sh = 640*view.sw;
+  view.sc = 0;
+  return view;
+}
+
+/* each rgb byte as a map value, for the interleaved and strided maps */
+static real libkinect_(rgb_values)[256];
+
+/*******************************************************************
+ average each fxf block of a RGB frame into the 3 (480/f)x(640/f)
+ planes of a map
+*******************************************************************/
+static void libkinect_(scale_rgb) (libkinect_(view) *view, unsigned char *rgb, int f) {
+  int w = 640/f, h = 480/f;
+  long sc = view->sc, sw = view->sw;
+  uint32_t sums[640*3];
+#ifndef KINECT_INTEGER
+  real scale = 1 / (real)(255*f*f);
+#endif
+  int x, y, dx, dy;
+  for (y = 0; y < h; y++) {
+    memset(sums, 0, w*3*sizeof(uint32_t));
+    for (dy = 0; dy < f; dy++) {
+      unsigned char *pixel = rgb + (y*f + dy)*640*3;
+      uint32_t *sum = sums;
+      for (x = 0; x < w; x++, sum += 3)
+        for (dx = 0; dx < f; dx++, pixel += 3) {
+          sum[0] += pixel[0];
+          sum[1] += pixel[1];
+          sum[2] += pixel[2];
+        }
+    }
+    real *r = view->data + y*view->sh, *g = r + sc, *b = g + sc;
+    for (x = 0; x < w; x++) {
+#ifdef KINECT_INTEGER
+      r[x*sw] = libkinect_(mean)(sums[3*x], f*f);
+      g[x*sw] = libkinect_(mean)(sums[3*x+1], f*f);
+      b[x*sw] = libkinect_(mean)(sums[3*x+2], f*f);
+#else
+      r[x*sw] = sums[3*x] * scale;
+      g[x*sw] = sums[3*x+1] * scale;
+      b[x*sw] = sums[3*x+2] * scale;
+#endif
+    }
+  }
+}
+
+/*******************************************************************
+ convert a RGB frame into the 3 channels of a map, averaged down if
+ HxW is 240x320, 120x160 or 60x80
+*******************************************************************/
+static void libkinect_(fill_rgb) (libkinect_(view) *view, unsigned char *rgb, kinect_config *config) {
+  uint64_t start = clock_ns();
+  real *data = view->data;
+  real *values = libkinect_(rgb_values);
+  long sc = view->sc, sh = view->sh, sw = view->sw;
+  long x, y;
+  int f = 480 / view->h;
+  if (f > 1) {
+    libkinect_(scale_rgb)(view, rgb, f);
+  } else if (sw == 1 && sh == 640) {
+    // contiguous planes: deinterleave the 3 channels in one pass
+    TH_CONCAT_2(kinect_rgb_planar_, Real)(rgb, data, data + sc, data + 2*sc, 480*640);
+  } else if (sw == 1) {
+    for (y = 0; y < 480; y++)
+      TH_CONCAT_2(kinect_rgb_planar_, Real)(rgb + y*640*3, data + y*sh, data + y*sh + sc, data + y*sh + 2*sc, 640);
+  } else if (sc == 1 && sw == 3 && sh == 640*3) {
+    // interleaved like the frame
+#ifdef TH_REAL_IS_BYTE
+    memcpy(data, rgb, 480*640*3);
+#else
+    long i;
+    for (i = 0; i < 480*640*3; i++)
+      data[i] = values[rgb[i]];
+#endif
+  } else {
+    for (y = 0; y < 480; y++) {
+      real *pixel = data + y*sh;
+      for (x = 0; x < 640; x++, pixel += sw, rgb += 3) {
+        pixel[0] = values[rgb[0]];
+        pixel[sc] = values[rgb[1]];
+        pixel[2*sc] = values[rgb[2]];
+      }
+    }
+  }
+  convert_done(config, 0, start);
+}
+
+/* x/z of each column and y/z of each row of the depth camera */
+static libkinect_(meter) libkinect_(rays_x)[640];
+static libkinect_(meter) libkinect_(rays_y)[480];
+
+/*****************************************************************
+ fill the depth tables of a config for its depth mode, once per
+ newdevice or openRecording: the grabs then do one lookup per pixel
+*****************************************************************/
+static void libkinect_(build_depth_tables) (kinect_config *config) {
+  real *table = config->depth_tables.Real;
+  libkinect_(meter) *meters = config->meter_tables.Real;
+  int raw, i;
+  for (raw = 0; raw <= D_MAXSIZE; raw++) {
+    meters[raw] = depth_meters(raw);
+#ifdef KINECT_INTEGER
+    // millimeters in meters mode, 0 past what the type holds
+    double mm = depth_meters(raw) * 1000;
+    if (config->depth_mode == KINECT_DEPTH_METERS)
+      table[raw] = mm < KINECT_REAL_MAX ? (real)(mm + 0.5) : 0;
+    else
+      table[raw] = raw < KINECT_REAL_MAX ? raw : KINECT_REAL_MAX;
+#else
+    if (config->depth_mode == KINECT_DEPTH_METERS)
+      table[raw] = meters[raw];
+    else
+      table[raw] = ((real)raw) / D_MAXSIZE;
+#endif
+  }
+  // the rays of a pinhole camera are separable
+  for (i = 0; i < 640; i++)
+    libkinect_(rays_x)[i] = (i - DEPTH_CX) / DEPTH_FX;
+  for (i = 0; i < 480; i++)
+    libkinect_(rays_y)[i] = (i - DEPTH_CY) / DEPTH_FY;
+}
+
+#ifndef KINECT_INTEGER
+/* meters of one row of depth, 0 where there is no reading */
+static void libkinect_(row_meters) (real *z, uint16_t *depth, kinect_config *config) {
+  int u;
+  if (config->depth_mode == KINECT_DEPTH_MM) {
+    for (u = 0; u < 640; u++)
+      z[u] = depth[u] * (real)0.001;
+  } else {
+    real *meters = config->meter_tables.Real;
+    for (u = 0; u < 640; u++)
+      z[u] = meters[depth[u] & D_MAXSIZE];
+  }
+}
+
+#endif
+
+/*********************************************************************
+ align a depth frame into the 480x640 depth plane of a RGBD map (the
+ view points at it): each pixel is projected into the rgb camera, the
+ nearest depth wins where several land, 0 where none does
+*********************************************************************/
+static void libkinect_(fill_registered) (libkinect_(view) *view, uint16_t *depth, kinect_config *config) {
+  uint64_t start = clock_ns();
+  float *ray = config->registration;
+  float *zbuffer = config->zbuffer;
+  real *table = config->depth_tables.Real;
+  libkinect_(meter) *meters = config->meter_tables.Real;
+  int mm = config->depth_mode == KINECT_DEPTH_MM;
+  real *plane = view->data;
+  long sh = view->sh, sw = view->sw;
+  long i, u, v;
+  for (v = 0; v < 480; v++)
+    for (u = 0; u < 640; u++)
+      plane[v*sh + u*sw] = 0;
+  for (i = 0; i < 480*640; i++)
+    zbuffer[i] = FLT_MAX;
+  for (i = 0; i < 480*640; i++, ray += 3) {
+    float z = mm ? depth[i] * 0.001f : meters[depth[i] & D_MAXSIZE];
+    if (z <= 0)
+      continue;
+    float Z = ray[2] * z + depth_to_rgb_T[2];
+    if (Z <= 0)
+      continue;
+    float inverse = 1 / Z;
+    int x = (int)(RGB_FX * (ray[0] * z + depth_to_rgb_T[0]) * inverse + RGB_CX + 0.5f);
+    int y = (int)(RGB_FY * (ray[1] * z + depth_to_rgb_T[1]) * inverse + RGB_CY + 0.5f);
+    if (x < 0 || x >= 640 || y < 0 || y >= 480)
+      continue;
+    long j = y*640 + x;
+    if (Z < zbuffer[j]) {
+      zbuffer[j] = Z;
+      plane[y*sh + x*sw] = mm ? depth[i] : table[depth[i] & D_MAXSIZE];
+    }
+  }
+  convert_done(config, 1, start);
+}
+
+#ifndef KINECT_INTEGER
+/************************************************************
+ project a depth frame into the X, Y, Z planes of a 3x480x640
+ contiguous map, (0,0,0) where there is no reading
+************************************************************/
+static void libkinect_(fill_points) (THTensor *tensor, uint16_t *depth, kinect_config *config) {
+  uint64_t start = clock_ns();
+  real *x = THTensor_(data)(tensor);
+  real *y = x + tensor->stride[0];
+  real *z = y + tensor->stride[0];
+  real *rays_x = libkinect_(rays_x);
+  int u, v;
+  for (v = 0; v < 480; v++) {
+    real ray_y = libkinect_(rays_y)[v];
+    // look the row up first, the multiplies then vectorize
+    libkinect_(row_meters)(z, depth, config);
+    for (u = 0; u < 640; u++) {
+      x[u] = z[u] * rays_x[u];
+      y[u] = z[u] * ray_y;
+    }
+    x += 640;
+    y += 640;
+    z += 640;
+    depth += 640;
+  }
+  convert_done(config, 1, start);
+}
+
+/**************************************************************
+ project the pixels with a reading of a depth frame into a Nx3
+ map, resized to the number of points which is returned
+**************************************************************/
+static long libkinect_(fill_points_compact) (THTensor *tensor, uint16_t *depth, kinect_config *config) {
+  uint64_t start = clock_ns();
+  real z[640];
+  real *rays_x = libkinect_(rays_x);
+  THTensor_(resize2d)(tensor, 480*640, 3);
+  real *points = THTensor_(data)(tensor);
+  long stride = tensor->stride[0], step = tensor->stride[1];
+  long n = 0;
+  int u, v;
+  for (v = 0; v < 480; v++) {
+    real ray_y = libkinect_(rays_y)[v];
+    libkinect_(row_meters)(z, depth, config);
+    for (u = 0; u < 640; u++) {
+      if (z[u] > 0) {
+        real *point = points + n*stride;
+        point[0] = z[u] * rays_x[u];
+        point[step] = z[u] * ray_y;
+        point[2*step] = z[u];
+        n++;
+      }
+    }
+    depth += 640;
+  }
+  // shrinking keeps the storage, the next frame does not reallocate
+  THTensor_(resize2d)(tensor, n, 3);
+  convert_done(config, 1, start);
+  return n;
+}
+#endif
+
+/* the value of depth pixels without reading */
+static real libkinect_(depth_invalid) (kinect_config *config) {
+  if (config->depth_mode == KINECT_DEPTH_MM)
+    return 0;
+  return config->depth_tables.Real[D_MAXSIZE];
+}
+
+/******************************************************************
+ average the pixels with a reading of each fxf block of a depth
+ frame into the (480/f)x(640/f) plane of a view
+******************************************************************/
+static void libkinect_(scale_depth) (libkinect_(view) *view, uint16_t *depth, kinect_config *config, int f) {
+  int w = 640/f, h = 480/f;
+  long sh = view->sh, sw = view->sw;
+  int mm = config->depth_mode == KINECT_DEPTH_MM;
+  real *table = config->depth_tables.Real;
+  libkinect_(meter) *meters = config->meter_tables.Real;
+  real invalid = libkinect_(depth_invalid)(config);
+  int x, y, dx, dy;
+  for (y = 0; y < h; y++)
+    for (x = 0; x < w; x++) {
+      uint16_t *block = depth + y*f*640 + x*f;
+      accreal sum = 0;
+      int n = 0;
+      for (dy = 0; dy < f; dy++, block += 640)
+        for (dx = 0; dx < f; dx++) {
+          uint16_t raw = block[dx];
+          if (mm ? raw > 0 : meters[raw & D_MAXSIZE] > 0) {
+            sum += mm ? raw : table[raw & D_MAXSIZE];
+            n++;
+          }
+        }
+      view->data[y*sh + x*sw] = n ? libkinect_(mean)(sum, n) : invalid;
+    }
+}
+
+/*******************************************************************
+ which values of a converted depth plane have no reading, the same
+ pixels scale_depth skips: 0 in mm and meters, in raw the values
+ above the last disparity with meters, and 0 in registered maps
+*******************************************************************/
+typedef struct libkinect_(holes) {
+  int zero;   /* 0 is no reading */
+  int above;  /* the values above max are no reading */
+  real max;
+  real hole;  /* what a block without a reading becomes */
+} libkinect_(holes);
+
+static libkinect_(holes) libkinect_(depth_holes) (kinect_config *config, int registered) {
+  libkinect_(holes) holes = {1, 0, 0, registered ? 0 : libkinect_(depth_invalid)(config)};
+  if (config->depth_mode == KINECT_DEPTH_RAW) {
+    int raw;
+    holes.zero = registered;
+    holes.above = 1;
+    for (raw = 0; raw <= D_MAXSIZE; raw++)
+      if (config->meter_tables.Real[raw] > 0 && config->depth_tables.Real[raw] > holes.max)
+        holes.max = config->depth_tables.Real[raw];
+  }
+  return holes;
+}
+
+/**********************************************************************
+ average each ratioxratio block of a contiguous plane into a wxh one,
+ skipping the values without a reading if holes
+**********************************************************************/
+static void libkinect_(shrink_plane) (real *dst, real *src, int w, int h, int ratio, libkinect_(holes) *holes) {
+  int x, y, dx, dy;
+  long stride = (long)w * ratio;
+  for (y = 0; y < h; y++)
+    for (x = 0; x < w; x++) {
+      real *block = src + y*ratio*stride + x*ratio;
+      accreal sum = 0;
+      int n = 0;
+      for (dy = 0; dy < ratio; dy++, block += stride)
+        for (dx = 0; dx < ratio; dx++)
+          if (!holes || !((holes->zero && block[dx] == 0) || (holes->above && block[dx] > holes->max))) {
+            sum += block[dx];
+            n++;
+          }
+      *dst++ = n ? libkinect_(mean)(sum, n) : holes->hole;
+    }
+}
+
+/*****************************************************************
+ convert a depth frame into the 480x640 plane of a view, or a
+ 240x320, 120x160 or 60x80 one averaging the pixels with a reading
+*****************************************************************/
+static void libkinect_(fill_depth) (libkinect_(view) *view, uint16_t *depth, kinect_config *config) {
+  uint64_t start = clock_ns();
+  int f = 480 / view->h;
+  long sw = view->sw;
+  long x, y;
+  if (f > 1) {
+    libkinect_(scale_depth)(view, depth, config, f);
+  } else if (config->depth_mode == KINECT_DEPTH_MM) {
+    for (y = 0; y < 480; y++, depth += 640) {
+      real *row = view->data + y*view->sh;
+      for (x = 0; x < 640; x++)
+        row[x*sw] = depth[x];
+    }
+  } else {
+    real *table = config->depth_tables.Real;
+    for (y = 0; y < 480; y++, depth += 640) {
+      real *row = view->data + y*view->sh;
+      for (x = 0; x < 640; x++)
+        row[x*sw] = table[depth[x] & D_MAXSIZE];
+    }
+  }
+  convert_done(config, 1, start);
+}
+
+/****************************************************************
+ grab the rgb frame, into a 3xHxW map or a HxWx3 (channels last)
+ one, of any strides
+****************************************************************/
 static int libkinect_(grab_rgb) (lua_State *L) {
   // Get Tensor's Info
   THTensor * tensor = luaT_checkudata(L, 1, torch_(Tensor_id));
-  THTensor *contigTensor = THTensor_(newContiguous)(tensor);
   // Get device ID
   int index = 0;
   if (lua_isnumber(L, 2)) index = lua_tonumber(L, 2);
+  // Get the timeout in ms, wait as long as it takes by default
+  int timeout = -1;
+  if (lua_isnumber(L, 3)) timeout = lua_tonumber(L, 3);
+
+  THArgCheck(index >= 0 && index < MAX_KINECTS, 2, "invalid Kinect ID");
+  THArgCheck(tensor->nDimension == 3 , 1, "RBG buffer: 3x480x640 or 480x640x3 Tensor expected (or 240x320, 120x160, 60x80)");
+  int hwc = tensor->size[0] != 3;
+  libkinect_(view) view = libkinect_(view_of)(tensor, hwc);
+  THArgCheck(tensor->size[hwc ? 2 : 0] == 3 && scale_factor(view.h, view.w) , 1,
+             "RBG buffer: 3x480x640 or 480x640x3 Tensor expected (or 240x320, 120x160, 60x80)");
 
-  THArgCheck(tensor->nDimension == 3 , 1, "RBG buffer: 3x480x640 Tensor expected");
-  THArgCheck(tensor->size[0] == 3 , 1, "RBG buffer: 3x480x640 Tensor expected");
-  THArgCheck(tensor->size[1] == 480 , 1, "RBG buffer: 3x480x640 Tensor expected");
-  THArgCheck(tensor->size[2] == 640 , 1, "RBG buffer: 3x480x640 Tensor expected");
+  if (configs[index].depth_only)
+    luaL_error(L, "<libkinect.grabRGB> Kinect ID #%d only streams depth", index);
+  if (workers[index])
+    luaL_error(L, "<libkinect.grabRGB> Kinect ID #%d converts into registered maps, use swapMaps", index);
 
   unsigned int timestamp;
   unsigned char *data = 0;
-  if (freenect_sync_get_video((void**)&data, &timestamp, index, FREENECT_VIDEO_RGB))
+  freenect_sync_frame_info info;
+  int ret = freenect_sync_get_video_timeout((void**)&data, &timestamp, index, FREENECT_VIDEO_RGB, timeout, &info);
+  if (ret < 0)
     luaL_error(L, "<libkinect.grabRGB> Error Kinect not connected?");
-
-  int z;
-  for (z=0;z<3;z++){
-    unsigned char *sourcep = data+z;
-    THTensor *tslice = THTensor_(newSelect)(contigTensor,0,z);
-    // copy
-    TH_TENSOR_APPLY(real, tslice,
-        	    *tslice_data = ((real)(*sourcep)) / 255;
-        	    sourcep = sourcep + 3;
-        	    );
-    THTensor_(free)(tslice);
+  if (ret > 0) {
+    // no frame yet
+    lua_pushnil(L);
+    lua_pushboolean(L, 0);
+    return 2;
   }
 
-  THTensor_(free)(contigTensor);
-  // return the timestamp
+  libkinect_(fill_rgb)(&view, data, &configs[index]);
+  // return the timestamp, if the frame is new and its age
   lua_pushnumber(L, timestamp);
+  lua_pushboolean(L, info.is_new);
+  lua_pushnumber(L, info.age);
 
-  return 1;
+  return 3;
 }
 
 /*******************
@@ -68,89 +502,898 @@ static int libkinect_(grab_rgb) (lua_State *L) {
 static int libkinect_(grab_depth) (lua_State *L) {
   // Get Tensor's Info
   THTensor * tensor = luaT_checkudata(L, 1, torch_(Tensor_id));
-  THTensor *contigTensor = THTensor_(newContiguous)(tensor);
   // Get device ID
   int index = 0;
   if (lua_isnumber(L, 2)) index = lua_tonumber(L, 2);
+  // Get the timeout in ms, wait as long as it takes by default
+  int timeout = -1;
+  if (lua_isnumber(L, 3)) timeout = lua_tonumber(L, 3);
 
-  THArgCheck(THTensor_(nElement)(tensor) == 640*480 , 1, "Depth buffer: 480x640 Tensor expected");
+  THArgCheck(index >= 0 && index < MAX_KINECTS, 2, "invalid Kinect ID");
+  libkinect_(view) view = libkinect_(depth_view_of)(tensor);
 
-  unsigned int timestamp;
-  unsigned char *data = 0;
-  if (freenect_sync_get_video((void**)&data, &timestamp, index, FREENECT_VIDEO_RGB))
-    luaL_error(L, "<libkinect.depth> Error Kinect not connected?");
+  libkinect_(check_depth)(L, "grabDepth");
+  if (workers[index])
+    luaL_error(L, "<libkinect.grabDepth> Kinect ID #%d converts into registered maps, use swapMaps", index);
 
+  unsigned int timestamp;
   // copy depth channel
   uint16_t *depth = 0;
-  if (freenect_sync_get_depth((void**)&depth, &timestamp, index, DFORMAT))
+  freenect_sync_frame_info info;
+  int ret = freenect_sync_get_depth_timeout((void**)&depth, &timestamp, index, configs[index].depth_format, timeout, &info);
+  if (ret < 0)
     luaL_error(L, "<libkinect.grabDepth> Error Kinect not connected?");
+  if (ret > 0) {
+    // no frame yet
+    lua_pushnil(L);
+    lua_pushboolean(L, 0);
+    return 2;
+  }
   // copy
-  TH_TENSOR_APPLY(real, contigTensor,
-                  *contigTensor_data = ((real)(*depth)) / D_MAXSIZE;
-                  depth++;
-                  );
-  THTensor_(free)(contigTensor);
+  depth = filtered_depth(index, depth, info.is_new);
+  libkinect_(fill_depth)(&view, depth, &configs[index]);
 
-  // return the timestamp
+  // return the timestamp, if the frame is new and its age
   lua_pushnumber(L, timestamp);
+  lua_pushboolean(L, info.is_new);
+  lua_pushnumber(L, info.age);
 
-  return 1;
+  return 3;
 }
 
-/****************************************************
- grab the rgb frame and the depth into a RGBD map
-****************************************************/
+/****************************************************************
+ grab the rgb frame and the depth into a 4xHxW RGBD map or a HxWx4
+ (channels last) one, of any strides
+****************************************************************/
 static int libkinect_(grab_rgbd) (lua_State *L) {
   // Get Tensor's Info
   THTensor * tensor = luaT_checkudata(L, 1, torch_(Tensor_id));
-  THTensor *contigTensor = THTensor_(newContiguous)(tensor);
   // Get device ID
   int index = 0;
   if (lua_isnumber(L, 2)) index = lua_tonumber(L, 2);
+  // Get the timeout in ms, shared by both streams
+  int timeout = -1;
+  if (lua_isnumber(L, 3)) timeout = lua_tonumber(L, 3);
+  // Pair the frames by timestamp, closest pair unless a max skew is given
+  int pair = lua_toboolean(L, 4);
+  int64_t maxSkew = -1;
+  if (lua_isnumber(L, 5)) maxSkew = lua_tonumber(L, 5);
 
-  THArgCheck(tensor->nDimension == 3 , 1, "RBGD buffer: 4x480x640 Tensor expected");
-  THArgCheck(tensor->size[0] == 4 , 1, "RBGD buffer: 4x480x640 Tensor expected");
-  THArgCheck(tensor->size[1] == 480 , 1, "RBGD buffer: 4x480x640 Tensor expected");
-  THArgCheck(tensor->size[2] == 640 , 1, "RBGD buffer: 4x480x640 Tensor expected");
+  THArgCheck(index >= 0 && index < MAX_KINECTS, 2, "invalid Kinect ID");
+  THArgCheck(tensor->nDimension == 3 , 1, "RBGD buffer: 4x480x640 or 480x640x4 Tensor expected (or 240x320, 120x160, 60x80)");
+  int hwc = tensor->size[0] != 4;
+  libkinect_(view) view = libkinect_(view_of)(tensor, hwc);
+  THArgCheck(tensor->size[hwc ? 2 : 0] == 4 && scale_factor(view.h, view.w) , 1,
+             "RBGD buffer: 4x480x640 or 480x640x4 Tensor expected (or 240x320, 120x160, 60x80)");
+  THArgCheck(!configs[index].registered || view.h == 480 , 1,
+             "RBGD buffer: registered maps are 4x480x640 or 480x640x4");
+
+  libkinect_(check_depth)(L, "grabRGBD");
+  if (configs[index].depth_only)
+    luaL_error(L, "<libkinect.grabRGBD> Kinect ID #%d only streams depth", index);
+  if (workers[index])
+    luaL_error(L, "<libkinect.grabRGBD> Kinect ID #%d converts into registered maps, use swapMaps", index);
 
   unsigned int timestampRGB,timestampD;
-  // copy the rgb channels
+  freenect_sync_frame_info infoRGB, infoD;
+  uint64_t start = clock_ns();
   unsigned char *rgb = 0;
-  if (freenect_sync_get_video((void**)&rgb, &timestampRGB, index, FREENECT_VIDEO_RGB))
+  uint16_t *depth = 0;
+  int ret;
+  if (pair)
+    ret = freenect_sync_get_pair((void**)&rgb, &timestampRGB, (void**)&depth, &timestampD, index,
+                                 FREENECT_VIDEO_RGB, configs[index].depth_format, maxSkew, timeout, &infoRGB, &infoD);
+  else {
+    // both frames are taken before any is converted, depth first: the rgb wait gets what is left of
+    // the timeout, and a stream without a frame yet leaves the map as it was
+    ret = freenect_sync_get_depth_timeout((void**)&depth, &timestampD, index, configs[index].depth_format, timeout, &infoD);
+    if (ret == 0) {
+      if (timeout > 0) {
+        timeout -= (clock_ns() - start) / 1000000;
+        if (timeout < 0) timeout = 0;
+      }
+      ret = freenect_sync_get_video_timeout((void**)&rgb, &timestampRGB, index, FREENECT_VIDEO_RGB, timeout, &infoRGB);
+    }
+  }
+  if (ret < 0)
     luaL_error(L, "<libkinect.grabRGBD> Error Kinect not connected?");
-  int z;
-  for (z=0;z<3;z++){
-    unsigned char *sourcep = rgb+z;
-    THTensor *tslice = THTensor_(newSelect)(contigTensor,0,z);
-    // copy
-    TH_TENSOR_APPLY(real, tslice,
-        	    *tslice_data = ((real)(*sourcep)) / 255;
-        	    sourcep = sourcep + 3;
-        	    );
-    THTensor_(free)(tslice);
+  if (ret > 0) {
+    // no frame yet
+    lua_pushnil(L);
+    lua_pushboolean(L, 0);
+    return 2;
   }
 
-  // copy depth channel
+  // copy the rgb channels, then the depth one
+  libkinect_(fill_rgb)(&view, rgb, &configs[index]);
+  view.data += 3*view.sc;
+  depth = filtered_depth(index, depth, infoD.is_new);
+  if (configs[index].registered)
+    libkinect_(fill_registered)(&view, depth, &configs[index]);
+  else
+    libkinect_(fill_depth)(&view, depth, &configs[index]);
+
+  // return the timestamps, if the frames are new and their ages
+  lua_pushnumber(L, timestampRGB);
+  lua_pushnumber(L, timestampD);
+  lua_pushboolean(L, infoRGB.is_new);
+  lua_pushboolean(L, infoD.is_new);
+  lua_pushnumber(L, infoRGB.age);
+  lua_pushnumber(L, infoD.age);
+
+  return 6;
+}
+
+/*****************************************************************
+ convert the pixels of a rectangle of the frames into a 480x640
+ RGBD view
+*****************************************************************/
+static void libkinect_(fill_region) (libkinect_(view) *view, unsigned char *rgb, uint16_t *depth, kinect_config *config,
+                                     const kinect_change_region *region) {
+  real *values = libkinect_(rgb_values);
+  real *table = config->depth_tables.Real;
+  int mm = config->depth_mode == KINECT_DEPTH_MM;
+  long sc = view->sc, sw = view->sw;
+  long x, y;
+  for (y = region->y; y < region->y + region->h; y++) {
+    real *pixel = view->data + y*view->sh + region->x*sw;
+    unsigned char *src = rgb + (y*640 + region->x)*3;
+    uint16_t *raw = depth + y*640 + region->x;
+    if (sw == 1) {
+      TH_CONCAT_2(kinect_rgb_planar_, Real)(src, pixel, pixel + sc, pixel + 2*sc, region->w);
+    } else {
+      for (x = 0; x < region->w; x++, src += 3) {
+        pixel[x*sw] = values[src[0]];
+        pixel[x*sw + sc] = values[src[1]];
+        pixel[x*sw + 2*sc] = values[src[2]];
+      }
+    }
+    pixel += 3*sc;
+    if (mm)
+      for (x = 0; x < region->w; x++)
+        pixel[x*sw] = raw[x];
+    else
+      for (x = 0; x < region->w; x++)
+        pixel[x*sw] = table[raw[x] & D_MAXSIZE];
+  }
+}
+
+/**********************************************************************
+ grab the rgb frame and the depth into a 4x480x640 RGBD map or a
+ 480x640x4 one, converting only the tiles that changed since the last
+ call with the same map (see setchanges), all of them if full is true.
+ Returns the number of changed regions and a Nx4 DoubleTensor of them:
+ x, y (from 1), width, height
+**********************************************************************/
+static void libkinect_(free_storage) (void *storage) {
+  THStorage_(free)((THStorage *)storage);
+}
+
+static int libkinect_(grab_rgbd_changes) (lua_State *L) {
+  THTensor * tensor = luaT_checkudata(L, 1, torch_(Tensor_id));
+  int index = 0;
+  if (lua_isnumber(L, 2)) index = lua_tonumber(L, 2);
+  int timeout = -1;
+  if (lua_isnumber(L, 3)) timeout = lua_tonumber(L, 3);
+  int full = lua_toboolean(L, 5);
+
+  THArgCheck(index >= 0 && index < MAX_KINECTS, 2, "invalid Kinect ID");
+  THArgCheck(tensor->nDimension == 3 , 1, "RBGD buffer: 4x480x640 or 480x640x4 Tensor expected");
+  int hwc = tensor->size[0] != 4;
+  libkinect_(view) view = libkinect_(view_of)(tensor, hwc);
+  THArgCheck(tensor->size[hwc ? 2 : 0] == 4 && view.h == 480 && view.w == 640, 1,
+             "RBGD buffer: 4x480x640 or 480x640x4 Tensor expected");
+
+  libkinect_(check_depth)(L, "grabRGBDChanges");
+  kinect_change *change = configs[index].change;
+  if (!change)
+    luaL_error(L, "<libkinect.grabRGBDChanges> Kinect ID #%d has no change detection, see setchanges", index);
+  if (configs[index].depth_only)
+    luaL_error(L, "<libkinect.grabRGBDChanges> Kinect ID #%d only streams depth", index);
+  if (configs[index].registered)
+    luaL_error(L, "<libkinect.grabRGBDChanges> Kinect ID #%d converts into registered maps", index);
+  if (workers[index])
+    luaL_error(L, "<libkinect.grabRGBDChanges> Kinect ID #%d converts into registered maps, use swapMaps", index);
+
+  unsigned int timestampRGB,timestampD;
+  freenect_sync_frame_info infoRGB, infoD;
+  uint64_t start = clock_ns();
+  unsigned char *rgb = 0;
   uint16_t *depth = 0;
-  if (freenect_sync_get_depth((void**)&depth, &timestampD, index, DFORMAT))
-    luaL_error(L, "<libkinect.grabRGBD> Error Kinect not connected?");
-  THTensor *tslice = THTensor_(newSelect)(contigTensor,0,3);
-  // copy
-  TH_TENSOR_APPLY(real, tslice,
-                  *tslice_data = ((real)(*depth)) / D_MAXSIZE;
-                  depth++;
-                  );
-  THTensor_(free)(tslice);
+  int ret = freenect_sync_get_video_timeout((void**)&rgb, &timestampRGB, index, FREENECT_VIDEO_RGB, timeout, &infoRGB);
+  if (ret < 0)
+    luaL_error(L, "<libkinect.grabRGBDChanges> Error Kinect not connected?");
+  if (ret > 0) {
+    // no frame yet
+    lua_pushnil(L);
+    return 1;
+  }
+  if (timeout > 0) {
+    timeout -= (clock_ns() - start) / 1000000;
+    if (timeout < 0) timeout = 0;
+  }
+  ret = freenect_sync_get_depth_timeout((void**)&depth, &timestampD, index, configs[index].depth_format, timeout, &infoD);
+  if (ret < 0)
+    luaL_error(L, "<libkinect.grabRGBDChanges> Error Kinect not connected?");
+  if (ret > 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  depth = filtered_depth(index, depth, infoD.is_new);
 
-  THTensor_(free)(contigTensor);
+  // another map than last time has none of the frame yet, the held storage can't be another one at its address
+  int stale = full || (void *)tensor->storage != configs[index].change_storage || view.data != configs[index].change_map;
+  if (stale)
+    kinect_change_reset(change);
+  const kinect_change_region *regions = NULL;
+  int n = 0, i;
+  if (stale || infoRGB.is_new || infoD.is_new) {
+    start = clock_ns();
+    kinect_change_detect(change, rgb, depth);
+    regions = kinect_change_regions(change, &n);
+    for (i = 0; i < n; i++)
+      libkinect_(fill_region)(&view, rgb, depth, &configs[index], &regions[i]);
+    convert_done(&configs[index], 0, start);
+    if ((void *)tensor->storage != configs[index].change_storage) {
+      forget_change_map(&configs[index]);
+      THStorage_(retain)(tensor->storage);
+      configs[index].change_storage = tensor->storage;
+      configs[index].free_change_storage = libkinect_(free_storage);
+    }
+    configs[index].change_map = view.data;
+  }
 
-  // return the timestamp
+  lua_pushnumber(L, n);
+  THDoubleTensor *rects = push_timestamps(L, 4, n, 4);
+  for (i = 0; i < n; i++) {
+    THDoubleTensor_set2d(rects, i, 0, regions[i].x + 1);
+    THDoubleTensor_set2d(rects, i, 1, regions[i].y + 1);
+    THDoubleTensor_set2d(rects, i, 2, regions[i].w);
+    THDoubleTensor_set2d(rects, i, 3, regions[i].h);
+  }
   lua_pushnumber(L, timestampRGB);
   lua_pushnumber(L, timestampD);
+  return 4;
+}
+
+/**************************************************************************
+ grab one frame into maps at several scales, reading the ring buffer once:
+ a table of contiguous 3xHxW (RGB), 1xHxW (depth) or 4xHxW (RGBD) maps,
+ HxW among 480x640, 240x320, 120x160 and 60x80. The finest map is filled
+ from the frame, each other one is averaged from the next finer map
+**************************************************************************/
+static int libkinect_(grab_pyramid) (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  // Get device ID
+  int index = 0;
+  if (lua_isnumber(L, 2)) index = lua_tonumber(L, 2);
+  // Get the timeout in ms, wait as long as it takes by default
+  int timeout = -1;
+  if (lua_isnumber(L, 3)) timeout = lua_tonumber(L, 3);
+
+  THArgCheck(index >= 0 && index < MAX_KINECTS, 2, "invalid Kinect ID");
+  int nlevels = lua_objlen(L, 1);
+  THArgCheck(nlevels >= 1 && nlevels <= 4 , 1, "pyramid: 1 to 4 maps expected");
+  THTensor *levels[4];
+  int factors[4];
+  int i, j, c;
+  for (i = 0; i < nlevels; i++) {
+    lua_rawgeti(L, 1, i+1);
+    levels[i] = luaT_checkudata(L, -1, torch_(Tensor_id));
+    lua_pop(L, 1);
+    THArgCheck(levels[i]->nDimension == 3 , 1, "pyramid: CxHxW maps expected");
+    THArgCheck(THTensor_(isContiguous)(levels[i]), 1, "pyramid: contiguous maps expected");
+    factors[i] = scale_factor(levels[i]->size[1], levels[i]->size[2]);
+    THArgCheck(factors[i] , 1, "pyramid: 480x640, 240x320, 120x160 or 60x80 maps expected");
+    THArgCheck(levels[i]->size[0] == levels[0]->size[0] , 1, "pyramid: maps of the same channels expected");
+  }
+  long channels = levels[0]->size[0];
+  THArgCheck(channels == 1 || channels == 3 || channels == 4 , 1, "pyramid: 1, 3 or 4 channels expected");
+  // finest first
+  for (i = 1; i < nlevels; i++)
+    for (j = i; j > 0 && factors[j] < factors[j-1]; j--) {
+      THTensor *level = levels[j]; levels[j] = levels[j-1]; levels[j-1] = level;
+      int factor = factors[j]; factors[j] = factors[j-1]; factors[j-1] = factor;
+    }
+  for (i = 1; i < nlevels; i++)
+    THArgCheck(factors[i] != factors[i-1] , 1, "pyramid: maps of distinct sizes expected");
 
+  int rgb = channels != 1;
+  int depth = channels != 3;
+  if (depth)
+    libkinect_(check_depth)(L, "grabPyramid");
+  if (rgb && configs[index].depth_only)
+    luaL_error(L, "<libkinect.grabPyramid> Kinect ID #%d only streams depth", index);
+  if (workers[index])
+    luaL_error(L, "<libkinect.grabPyramid> Kinect ID #%d converts into registered maps, use swapMaps", index);
+  if (rgb && depth && configs[index].registered)
+    THArgCheck(factors[0] == 1 , 1, "pyramid: registered RGBD pyramids need a 4x480x640 map");
+
+  // RGBD pyramids pair the frames by timestamp
+  unsigned int timestampRGB = 0, timestampD = 0;
+  unsigned char *rgbFrame = 0;
+  uint16_t *depthFrame = 0;
+  freenect_sync_frame_info infoRGB = {1, 0}, infoD = {1, 0};
+  int ret;
+  if (rgb && depth)
+    ret = freenect_sync_get_pair((void**)&rgbFrame, &timestampRGB, (void**)&depthFrame, &timestampD, index,
+                                 FREENECT_VIDEO_RGB, configs[index].depth_format, -1, timeout, &infoRGB, &infoD);
+  else if (rgb)
+    ret = freenect_sync_get_video_timeout((void**)&rgbFrame, &timestampRGB, index, FREENECT_VIDEO_RGB, timeout, &infoRGB);
+  else
+    ret = freenect_sync_get_depth_timeout((void**)&depthFrame, &timestampD, index, configs[index].depth_format, timeout, &infoD);
+  if (ret < 0)
+    luaL_error(L, "<libkinect.grabPyramid> Error Kinect not connected?");
+  if (ret > 0) {
+    // no frame yet
+    lua_pushnil(L);
+    lua_pushboolean(L, 0);
+    return 2;
+  }
+
+  // the finest map from the frame, timed with the others as one conversion
+  configs[index].batch_start = clock_ns();
+  libkinect_(view) view = libkinect_(view_of)(levels[0], 0);
+  if (rgb)
+    libkinect_(fill_rgb)(&view, rgbFrame, &configs[index]);
+  view.data += (channels-1)*view.sc;
+  if (depth)
+    depthFrame = filtered_depth(index, depthFrame, infoD.is_new);
+  if (depth && configs[index].registered && rgb)
+    libkinect_(fill_registered)(&view, depthFrame, &configs[index]);
+  else if (depth)
+    libkinect_(fill_depth)(&view, depthFrame, &configs[index]);
+
+  // the others from the next finer one
+  libkinect_(holes) holes = libkinect_(depth_holes)(&configs[index], depth && configs[index].registered && rgb);
+  for (i = 1; i < nlevels; i++) {
+    real *src = THTensor_(data)(levels[i-1]);
+    real *dst = THTensor_(data)(levels[i]);
+    for (c = 0; c < channels; c++)
+      libkinect_(shrink_plane)(dst + c*levels[i]->stride[0], src + c*levels[i-1]->stride[0],
+                               640/factors[i], 480/factors[i], factors[i]/factors[i-1],
+                               depth && c == channels-1 ? &holes : NULL);
+  }
+  uint64_t start = configs[index].batch_start;
+  configs[index].batch_start = 0;
+  convert_done(&configs[index], rgb ? 0 : 1, start);
+
+  // return the timestamps, if the frames are new and their ages
+  if (rgb && depth) {
+    lua_pushnumber(L, timestampRGB);
+    lua_pushnumber(L, timestampD);
+    lua_pushboolean(L, infoRGB.is_new);
+    lua_pushboolean(L, infoD.is_new);
+    lua_pushnumber(L, infoRGB.age);
+    lua_pushnumber(L, infoD.age);
+    return 6;
+  }
+  lua_pushnumber(L, rgb ? timestampRGB : timestampD);
+  lua_pushboolean(L, rgb ? infoRGB.is_new : infoD.is_new);
+  lua_pushnumber(L, rgb ? infoRGB.age : infoD.age);
+  return 3;
+}
+
+#ifndef KINECT_INTEGER
+/**************************************************************************
+ grab the depth frame as a point cloud in meters, in the depth camera
+ frame: a 3x480x640 map (X, Y, Z planes), or a Nx3 list of the pixels
+ with a reading if a 2D Tensor is given
+**************************************************************************/
+static int libkinect_(grab_point_cloud) (lua_State *L) {
+  // Get Tensor's Info
+  THTensor * tensor = luaT_checkudata(L, 1, torch_(Tensor_id));
+  // Get device ID
+  int index = 0;
+  if (lua_isnumber(L, 2)) index = lua_tonumber(L, 2);
+  // Get the timeout in ms, wait as long as it takes by default
+  int timeout = -1;
+  if (lua_isnumber(L, 3)) timeout = lua_tonumber(L, 3);
+
+  int compact = tensor->nDimension == 2;
+  THArgCheck(index >= 0 && index < MAX_KINECTS, 2, "invalid Kinect ID");
+  if (!compact) {
+    THArgCheck(tensor->nDimension == 3 , 1, "Point cloud: 3x480x640 or Nx3 Tensor expected");
+    THArgCheck(tensor->size[0] == 3 , 1, "Point cloud: 3x480x640 or Nx3 Tensor expected");
+    THArgCheck(tensor->size[1] == 480 , 1, "Point cloud: 3x480x640 or Nx3 Tensor expected");
+    THArgCheck(tensor->size[2] == 640 , 1, "Point cloud: 3x480x640 or Nx3 Tensor expected");
+    THArgCheck(THTensor_(isContiguous)(tensor), 1, "Point cloud: contiguous Tensor expected");
+  }
+
+  if (workers[index])
+    luaL_error(L, "<libkinect.grabPointCloud> Kinect ID #%d converts into registered maps, use swapMaps", index);
+
+  unsigned int timestamp;
+  uint16_t *depth = 0;
+  freenect_sync_frame_info info;
+  int ret = freenect_sync_get_depth_timeout((void**)&depth, &timestamp, index, configs[index].depth_format, timeout, &info);
+  if (ret < 0)
+    luaL_error(L, "<libkinect.grabPointCloud> Error Kinect not connected?");
+  if (ret > 0) {
+    // no frame yet
+    lua_pushnil(L);
+    lua_pushboolean(L, 0);
+    return 2;
+  }
+
+  long n = 480*640;
+  depth = filtered_depth(index, depth, info.is_new);
+  if (compact)
+    n = libkinect_(fill_points_compact)(tensor, depth, &configs[index]);
+  else
+    libkinect_(fill_points)(tensor, depth, &configs[index]);
+
+  // return the timestamp, if the frame is new, its age and the number of points
+  lua_pushnumber(L, timestamp);
+  lua_pushboolean(L, info.is_new);
+  lua_pushnumber(L, info.age);
+  lua_pushnumber(L, n);
+
+  return 4;
+}
+#endif
+
+/*******************************************************************
+ grab N consecutive rgb frames into a Nx3x480x640 map in one call
+*******************************************************************/
+static int libkinect_(grab_rgb_batch) (lua_State *L) {
+  // Get Tensor's Info
+  THTensor * tensor = luaT_checkudata(L, 1, torch_(Tensor_id));
+  // Get device ID
+  int index = 0;
+  if (lua_isnumber(L, 2)) index = lua_tonumber(L, 2);
+
+  THArgCheck(index >= 0 && index < MAX_KINECTS, 2, "invalid Kinect ID");
+  THArgCheck(tensor->nDimension == 4 , 1, "RBG batch: Nx3x480x640 Tensor expected");
+  THArgCheck(tensor->size[1] == 3 , 1, "RBG batch: Nx3x480x640 Tensor expected");
+  THArgCheck(tensor->size[2] == 480 , 1, "RBG batch: Nx3x480x640 Tensor expected");
+  THArgCheck(tensor->size[3] == 640 , 1, "RBG batch: Nx3x480x640 Tensor expected");
+  THArgCheck(THTensor_(isContiguous)(tensor), 1, "RBG batch: contiguous Tensor expected");
+
+  if (configs[index].depth_only)
+    luaL_error(L, "<libkinect.grabRGBBatch> Kinect ID #%d only streams depth", index);
+  if (workers[index])
+    luaL_error(L, "<libkinect.grabRGBBatch> Kinect ID #%d converts into registered maps, use swapMaps", index);
+
+  long n = tensor->size[0];
+  THDoubleTensor *timestamps = push_timestamps(L, 3, n, 1);
+  long i;
+  for (i = 0; i < n; i++) {
+    unsigned int timestamp;
+    unsigned char *data = 0;
+    if (freenect_sync_get_video_timeout((void**)&data, &timestamp, index, FREENECT_VIDEO_RGB, -1, NULL))
+      luaL_error(L, "<libkinect.grabRGBBatch> Error Kinect not connected?");
+    libkinect_(view) view = libkinect_(view_of)(tensor, 0);
+    view.data += i*tensor->stride[0];
+    libkinect_(fill_rgb)(&view, data, &configs[index]);
+    THDoubleTensor_set1d(timestamps, i, timestamp);
+  }
+
+  // return the timestamps
+  return 1;
+}
+
+/*********************************************************************
+ grab N consecutive depth frames into a Nx480x640 map in one call
+*********************************************************************/
+static int libkinect_(grab_depth_batch) (lua_State *L) {
+  // Get Tensor's Info
+  THTensor * tensor = luaT_checkudata(L, 1, torch_(Tensor_id));
+  // Get device ID
+  int index = 0;
+  if (lua_isnumber(L, 2)) index = lua_tonumber(L, 2);
+
+  THArgCheck(index >= 0 && index < MAX_KINECTS, 2, "invalid Kinect ID");
+  THArgCheck(tensor->nDimension >= 3 , 1, "Depth batch: Nx480x640 Tensor expected");
+  THArgCheck(THTensor_(nElement)(tensor) == tensor->size[0]*640*480 , 1, "Depth batch: Nx480x640 Tensor expected");
+
+  libkinect_(check_depth)(L, "grabDepthBatch");
+  if (workers[index])
+    luaL_error(L, "<libkinect.grabDepthBatch> Kinect ID #%d converts into registered maps, use swapMaps", index);
+
+  long n = tensor->size[0];
+  THDoubleTensor *timestamps = push_timestamps(L, 3, n, 1);
+  long i;
+  for (i = 0; i < n; i++) {
+    unsigned int timestamp;
+    uint16_t *depth = 0;
+    if (freenect_sync_get_depth_timeout((void**)&depth, &timestamp, index, configs[index].depth_format, -1, NULL))
+      luaL_error(L, "<libkinect.grabDepthBatch> Error Kinect not connected?");
+    libkinect_(view) view = libkinect_(view_of)(tensor, 0);
+    view.data += i*tensor->stride[0];
+    libkinect_(fill_depth)(&view, filtered_depth(index, depth, 1), &configs[index]);
+    THDoubleTensor_set1d(timestamps, i, timestamp);
+  }
+
+  // return the timestamps
+  return 1;
+}
+
+/***************************************************************************
+ grab N consecutive RGBD maps into a Nx4x480x640 map in one call
+***************************************************************************/
+static int libkinect_(grab_rgbd_batch) (lua_State *L) {
+  // Get Tensor's Info
+  THTensor * tensor = luaT_checkudata(L, 1, torch_(Tensor_id));
+  // Get device ID
+  int index = 0;
+  if (lua_isnumber(L, 2)) index = lua_tonumber(L, 2);
+  // Pair the frames by timestamp, closest pair unless a max skew is given
+  int pair = lua_toboolean(L, 4);
+  int64_t maxSkew = -1;
+  if (lua_isnumber(L, 5)) maxSkew = lua_tonumber(L, 5);
+
+  THArgCheck(index >= 0 && index < MAX_KINECTS, 2, "invalid Kinect ID");
+  THArgCheck(tensor->nDimension == 4 , 1, "RBGD batch: Nx4x480x640 Tensor expected");
+  THArgCheck(tensor->size[1] == 4 , 1, "RBGD batch: Nx4x480x640 Tensor expected");
+  THArgCheck(tensor->size[2] == 480 , 1, "RBGD batch: Nx4x480x640 Tensor expected");
+  THArgCheck(tensor->size[3] == 640 , 1, "RBGD batch: Nx4x480x640 Tensor expected");
+  THArgCheck(THTensor_(isContiguous)(tensor), 1, "RBGD batch: contiguous Tensor expected");
+
+  libkinect_(check_depth)(L, "grabRGBDBatch");
+  if (configs[index].depth_only)
+    luaL_error(L, "<libkinect.grabRGBDBatch> Kinect ID #%d only streams depth", index);
+  if (workers[index])
+    luaL_error(L, "<libkinect.grabRGBDBatch> Kinect ID #%d converts into registered maps, use swapMaps", index);
+
+  long n = tensor->size[0];
+  THDoubleTensor *timestamps = push_timestamps(L, 3, n, 2);
+  long i;
+  for (i = 0; i < n; i++) {
+    unsigned int timestampRGB, timestampD;
+    unsigned char *rgb = 0;
+    uint16_t *depth = 0;
+    int ret;
+    if (pair)
+      ret = freenect_sync_get_pair((void**)&rgb, &timestampRGB, (void**)&depth, &timestampD, index,
+                                   FREENECT_VIDEO_RGB, configs[index].depth_format, maxSkew, -1, NULL, NULL);
+    else
+      ret = freenect_sync_get_video_timeout((void**)&rgb, &timestampRGB, index, FREENECT_VIDEO_RGB, -1, NULL);
+    if (ret)
+      luaL_error(L, "<libkinect.grabRGBDBatch> Error Kinect not connected?");
+    libkinect_(view) view = libkinect_(view_of)(tensor, 0);
+    view.data += i*tensor->stride[0];
+    libkinect_(fill_rgb)(&view, rgb, &configs[index]);
+    // the depth frame comes while the rgb one is converted, the pair already holds it
+    if (!pair && freenect_sync_get_depth_timeout((void**)&depth, &timestampD, index, configs[index].depth_format, -1, NULL))
+      luaL_error(L, "<libkinect.grabRGBDBatch> Error Kinect not connected?");
+    view.data += 3*view.sc;
+    depth = filtered_depth(index, depth, 1);
+    if (configs[index].registered)
+      libkinect_(fill_registered)(&view, depth, &configs[index]);
+    else
+      libkinect_(fill_depth)(&view, depth, &configs[index]);
+    THDoubleTensor_set2d(timestamps, i, 0, timestampRGB);
+    THDoubleTensor_set2d(timestamps, i, 1, timestampD);
+  }
+
+  // return the Nx2 (rgb, depth) timestamps
+  return 1;
+}
+
+/* the grab of one device of a rig, on a thread of its own */
+typedef struct {
+  libkinect_(view) view;
+  int index;
+  int timeout;
+  int pair;
+  int64_t maxSkew;
+  int ret;                      /* of the frame waits: < 0 error, > 0 no frame in time */
+  unsigned int timestamps[2];   /* rgb, depth */
+  double published[2];          /* CLOCK_MONOTONIC seconds the frames were published at */
+  pthread_t thread;
+  bool threaded;                /* false if grabbed on the calling thread */
+} libkinect_(rig_grab);
+
+static void *libkinect_(grab_rig_device) (void *arg) {
+  libkinect_(rig_grab) *grab = arg;
+  int index = grab->index;
+  freenect_sync_frame_info infoRGB, infoD;
+  unsigned char *rgb = 0;
+  uint16_t *depth = 0;
+  if (grab->pair)
+    grab->ret = freenect_sync_get_pair((void**)&rgb, &grab->timestamps[0], (void**)&depth, &grab->timestamps[1], index,
+                                       FREENECT_VIDEO_RGB, configs[index].depth_format, grab->maxSkew, grab->timeout,
+                                       &infoRGB, &infoD);
+  else
+    grab->ret = freenect_sync_get_video_timeout((void**)&rgb, &grab->timestamps[0], index, FREENECT_VIDEO_RGB,
+                                                grab->timeout, &infoRGB);
+  if (grab->ret)
+    return NULL;
+  grab->published[0] = clock_ns() / 1e9 - infoRGB.age;
+  libkinect_(fill_rgb)(&grab->view, rgb, &configs[index]);
+  // the depth frame comes while the rgb one is converted, the pair already holds it
+  if (!grab->pair) {
+    grab->ret = freenect_sync_get_depth_timeout((void**)&depth, &grab->timestamps[1], index, configs[index].depth_format,
+                                                grab->timeout, &infoD);
+    if (grab->ret)
+      return NULL;
+  }
+  grab->published[1] = clock_ns() / 1e9 - infoD.age;
+  grab->view.data += 3*grab->view.sc;
+  depth = filtered_depth(index, depth, infoD.is_new);
+  if (configs[index].registered)
+    libkinect_(fill_registered)(&grab->view, depth, &configs[index]);
+  else
+    libkinect_(fill_depth)(&grab->view, depth, &configs[index]);
+  return NULL;
+}
+
+/*****************************************************************************
+ grab the RGBD maps of several devices at once into a Kx4xHxW (or KxHxWx4)
+ map: each device waits for and converts its frames on a thread of its own,
+ so a rig-wide frame costs about one frame period, not one per device
+*****************************************************************************/
+static int libkinect_(grab_rgbd_rig) (lua_State *L) {
+  // Get Tensor's Info
+  THTensor * tensor = luaT_checkudata(L, 1, torch_(Tensor_id));
+  // Get the device IDs
+  luaL_checktype(L, 2, LUA_TTABLE);
+  // Get the timeout in ms, shared by all the devices
+  int timeout = -1;
+  if (lua_isnumber(L, 3)) timeout = lua_tonumber(L, 3);
+  // Pair the frames of each device by timestamp, closest pair unless a max skew is given
+  int pair = lua_toboolean(L, 4);
+  int64_t maxSkew = -1;
+  if (lua_isnumber(L, 5)) maxSkew = lua_tonumber(L, 5);
+
+  int k = lua_objlen(L, 2);
+  THArgCheck(k > 0 && k <= MAX_KINECTS, 2, "a list of 1 to MAX_KINECTS Kinect IDs expected");
+  THArgCheck(tensor->nDimension == 4 && tensor->size[0] == k , 1,
+             "RBGD rig: Kx4x480x640 or Kx480x640x4 Tensor expected (or 240x320, 120x160, 60x80)");
+  int hwc = tensor->size[1] != 4;
+  libkinect_(view) view = libkinect_(view_of)(tensor, hwc);
+  THArgCheck(tensor->size[hwc ? 3 : 1] == 4 && scale_factor(view.h, view.w) , 1,
+             "RBGD rig: Kx4x480x640 or Kx480x640x4 Tensor expected (or 240x320, 120x160, 60x80)");
+  libkinect_(check_depth)(L, "grabRGBDRig");
+
+  libkinect_(rig_grab) grabs[MAX_KINECTS];
+  bool used[MAX_KINECTS] = {};
+  int i;
+  for (i = 0; i < k; i++) {
+    lua_rawgeti(L, 2, i+1);
+    int index = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    if (index < 0 || index >= MAX_KINECTS)
+      luaL_error(L, "<libkinect.grabRGBDRig> invalid Kinect ID #%d", index);
+    if (used[index])
+      luaL_error(L, "<libkinect.grabRGBDRig> Kinect ID #%d is listed twice", index);
+    used[index] = true;
+    if (configs[index].depth_only)
+      luaL_error(L, "<libkinect.grabRGBDRig> Kinect ID #%d only streams depth", index);
+    if (workers[index])
+      luaL_error(L, "<libkinect.grabRGBDRig> Kinect ID #%d converts into registered maps, use swapMaps", index);
+    if (configs[index].registered && view.h != 480)
+      luaL_error(L, "<libkinect.grabRGBDRig> Kinect ID #%d registers its depth, its maps are 480x640", index);
+    grabs[i].view = view;
+    grabs[i].view.data += i*tensor->stride[0];
+    grabs[i].index = index;
+    grabs[i].timeout = timeout;
+    grabs[i].pair = pair;
+    grabs[i].maxSkew = maxSkew;
+  }
+
+  // the first device is grabbed on this thread, while the others are on theirs
+  for (i = 1; i < k; i++)
+    grabs[i].threaded = !pthread_create(&grabs[i].thread, NULL, libkinect_(grab_rig_device), &grabs[i]);
+  for (i = 0; i < k; i++)
+    if (i == 0 || !grabs[i].threaded)
+      libkinect_(grab_rig_device)(&grabs[i]);
+  for (i = 1; i < k; i++)
+    if (grabs[i].threaded)
+      pthread_join(grabs[i].thread, NULL);
+
+  int late = 0;
+  for (i = 0; i < k; i++) {
+    if (grabs[i].ret < 0)
+      luaL_error(L, "<libkinect.grabRGBDRig> Error Kinect ID #%d not connected?", grabs[i].index);
+    late |= grabs[i].ret > 0;
+  }
+  if (late) {
+    // no frame yet on some device
+    lua_pushnil(L);
+    return 1;
+  }
+
+  // the Kx2 (rgb, depth) timestamps, and the largest skew between the devices in seconds
+  THDoubleTensor *timestamps = push_timestamps(L, 6, k, 2);
+  double first[2] = {DBL_MAX, DBL_MAX}, last[2] = {-DBL_MAX, -DBL_MAX};
+  int s;
+  for (i = 0; i < k; i++)
+    for (s = 0; s < 2; s++) {
+      THDoubleTensor_set2d(timestamps, i, s, grabs[i].timestamps[s]);
+      first[s] = grabs[i].published[s] < first[s] ? grabs[i].published[s] : first[s];
+      last[s] = grabs[i].published[s] > last[s] ? grabs[i].published[s] : last[s];
+    }
+  lua_pushnumber(L, last[0] - first[0] > last[1] - first[1] ? last[0] - first[0] : last[1] - first[1]);
   return 2;
 }
 
+/***************************************************************
+ a registered map: the worker writes into the data captured at
+ registration, in a storage it holds and Lua cannot resize
+***************************************************************/
+typedef struct libkinect_(registered) {
+  THTensor *tensor;    /* handed out by swapMaps, checked to still view data */
+  THStorage *storage;
+  real *data;          /* Cx480x640, contiguous */
+  long channels;
+  char flag;           /* the flags of the storage before registration */
+} libkinect_(registered);
+
+/*******************************************************************
+ fill a registered map, on the worker thread: no refcount is touched
+*******************************************************************/
+static void libkinect_(fill_map) (void *map, unsigned char *rgb, uint16_t *depth, int index) {
+  libkinect_(registered) *registered = map;
+  libkinect_(view) view = {registered->data, 480*640, 640, 1, 480, 640};
+  if (rgb) {
+    libkinect_(fill_rgb)(&view, rgb, &configs[index]);
+    view.data += 3*view.sc;
+  }
+  if (rgb && depth && configs[index].registered)
+    libkinect_(fill_registered)(&view, depth, &configs[index]);
+  else if (depth)
+    libkinect_(fill_depth)(&view, depth, &configs[index]);
+}
+
+/* nonzero if Lua moved the tensor of a registered map off the data the worker writes */
+static int libkinect_(map_moved) (void *map) {
+  libkinect_(registered) *registered = map;
+  THTensor *tensor = registered->tensor;
+  return tensor->storage != registered->storage || THTensor_(data)(tensor) != registered->data ||
+    tensor->nDimension != 3 || tensor->size[0] != registered->channels || tensor->size[1] != 480 ||
+    tensor->size[2] != 640 || !THTensor_(isContiguous)(tensor);
+}
+
+static void libkinect_(free_map) (void *map) {
+  libkinect_(registered) *registered = map;
+  if (registered->flag & TH_STORAGE_RESIZABLE)
+    THStorage_(setFlag)(registered->storage, TH_STORAGE_RESIZABLE);
+  THStorage_(free)(registered->storage);
+  THTensor_(free)(registered->tensor);
+  free(registered);
+}
+
+/* holds the tensor and its storage, which cannot be resized until the map is freed */
+static void *libkinect_(capture_map) (THTensor *tensor) {
+  libkinect_(registered) *registered = malloc(sizeof(libkinect_(registered)));
+  registered->tensor = tensor;
+  registered->storage = tensor->storage;
+  registered->data = THTensor_(data)(tensor);
+  registered->channels = tensor->size[0];
+  registered->flag = tensor->storage->flag;
+  THTensor_(retain)(tensor);
+  THStorage_(retain)(tensor->storage);
+  THStorage_(clearFlag)(tensor->storage, TH_STORAGE_RESIZABLE);
+  return registered;
+}
+
+/**************************************************************************
+ register two maps the frames are converted into on a worker thread,
+ 3x480x640 for RGB, 1x480x640 for depth or 4x480x640 for RGBD
+**************************************************************************/
+static int libkinect_(register_maps) (lua_State *L) {
+  // Get Tensors' Info
+  THTensor * front = luaT_checkudata(L, 1, torch_(Tensor_id));
+  THTensor * back = luaT_checkudata(L, 2, torch_(Tensor_id));
+  // Get device ID
+  int index = 0;
+  if (lua_isnumber(L, 3)) index = lua_tonumber(L, 3);
+
+  THArgCheck(index >= 0 && index < MAX_KINECTS, 3, "invalid Kinect ID");
+  THArgCheck(front->nDimension == 3 , 1, "maps: 3x480x640, 1x480x640 or 4x480x640 Tensor expected");
+  THArgCheck(front->size[0] == 1 || front->size[0] == 3 || front->size[0] == 4 , 1,
+             "maps: 3x480x640, 1x480x640 or 4x480x640 Tensor expected");
+  THArgCheck(front->size[1] == 480 , 1, "maps: 3x480x640, 1x480x640 or 4x480x640 Tensor expected");
+  THArgCheck(front->size[2] == 640 , 1, "maps: 3x480x640, 1x480x640 or 4x480x640 Tensor expected");
+  THArgCheck(back->nDimension == 3 && back->size[0] == front->size[0] &&
+             back->size[1] == 480 && back->size[2] == 640, 2, "maps: two Tensors of the same size expected");
+  THArgCheck(THTensor_(isContiguous)(front), 1, "maps: contiguous Tensor expected");
+  THArgCheck(THTensor_(isContiguous)(back), 2, "maps: contiguous Tensor expected");
+  THArgCheck(THTensor_(data)(front) != THTensor_(data)(back), 2, "maps: two distinct Tensors expected");
+
+  bool rgb = front->size[0] != 1;
+  bool depth = front->size[0] != 3;
+  if (depth)
+    libkinect_(check_depth)(L, "registerMaps");
+  if (workers[index])
+    luaL_error(L, "<libkinect.registerMaps> Kinect ID #%d already has registered maps", index);
+  if (rgb && configs[index].depth_only)
+    luaL_error(L, "<libkinect.registerMaps> Kinect ID #%d only streams depth", index);
+
+  // the worker holds them until unregisterMaps
+  start_worker(index, libkinect_(capture_map)(front), libkinect_(capture_map)(back), rgb, depth,
+               libkinect_(fill_map), libkinect_(map_moved), libkinect_(free_map));
+  return 0;
+}
+
+/****************************************************************
+ read rgb frame n (1 is the first) of a recording into a map, as
+ grabRGB would: straight from the mapping of the file
+****************************************************************/
+static int libkinect_(read_rgb) (lua_State *L) {
+  THTensor * tensor = luaT_checkudata(L, 1, torch_(Tensor_id));
+  kinect_reader *reader = check_reader(L, 2, "readRGB");
+  long n = luaL_checknumber(L, 3);
+
+  THArgCheck(tensor->nDimension == 3 , 1, "RBG buffer: 3x480x640 or 480x640x3 Tensor expected (or 240x320, 120x160, 60x80)");
+  int hwc = tensor->size[0] != 3;
+  libkinect_(view) view = libkinect_(view_of)(tensor, hwc);
+  THArgCheck(tensor->size[hwc ? 2 : 0] == 3 && scale_factor(view.h, view.w) , 1,
+             "RBG buffer: 3x480x640 or 480x640x3 Tensor expected (or 240x320, 120x160, 60x80)");
+
+  uint32_t timestamp;
+  double seconds;
+  unsigned char *rgb = (unsigned char *)reader_frame(L, reader, 0, n, "readRGB", &timestamp, &seconds);
+  libkinect_(fill_rgb)(&view, rgb, &reader->config);
+  // return the timestamp and the time into the recording
+  lua_pushnumber(L, timestamp);
+  lua_pushnumber(L, seconds);
+  return 2;
+}
+
+/***********************************************
+ read depth frame n of a recording into a map
+***********************************************/
+static int libkinect_(read_depth) (lua_State *L) {
+  THTensor * tensor = luaT_checkudata(L, 1, torch_(Tensor_id));
+  kinect_reader *reader = check_reader(L, 2, "readDepth");
+  long n = luaL_checknumber(L, 3);
+
+  libkinect_(view) view = libkinect_(depth_view_of)(tensor);
+  libkinect_(check_depth)(L, "readDepth");
+
+  uint32_t timestamp;
+  double seconds;
+  uint16_t *depth = (uint16_t *)reader_frame(L, reader, 1, n, "readDepth", &timestamp, &seconds);
+  libkinect_(fill_depth)(&view, depth, &reader->config);
+  lua_pushnumber(L, timestamp);
+  lua_pushnumber(L, seconds);
+  return 2;
+}
+
+/****************************************************************
+ read rgb frame n of a recording and the depth frame published
+ closest to it into a RGBD map
+****************************************************************/
+static int libkinect_(read_rgbd) (lua_State *L) {
+  THTensor * tensor = luaT_checkudata(L, 1, torch_(Tensor_id));
+  kinect_reader *reader = check_reader(L, 2, "readRGBD");
+  long n = luaL_checknumber(L, 3);
+  kinect_config *config = &reader->config;
+
+  THArgCheck(tensor->nDimension == 3 , 1, "RBGD buffer: 4x480x640 or 480x640x4 Tensor expected (or 240x320, 120x160, 60x80)");
+  int hwc = tensor->size[0] != 4;
+  libkinect_(view) view = libkinect_(view_of)(tensor, hwc);
+  THArgCheck(tensor->size[hwc ? 2 : 0] == 4 && scale_factor(view.h, view.w) , 1,
+             "RBGD buffer: 4x480x640 or 480x640x4 Tensor expected (or 240x320, 120x160, 60x80)");
+  THArgCheck(!config->registered || view.h == 480 , 1,
+             "RBGD buffer: registered maps are 4x480x640 or 480x640x4");
+  libkinect_(check_depth)(L, "readRGBD");
+
+  uint32_t timestampRGB, timestampD;
+  double seconds, secondsD;
+  unsigned char *rgb = (unsigned char *)reader_frame(L, reader, 0, n, "readRGBD", &timestampRGB, &seconds);
+  libkinect_(fill_rgb)(&view, rgb, config);
+  long d = kinect_playback_find(reader->playback, 1, seconds);
+  if (d < 0)
+    luaL_error(L, "<libkinect.readRGBD> the recording has no depth frame");
+  uint16_t *depth = (uint16_t *)reader_frame(L, reader, 1, d + 1, "readRGBD", &timestampD, &secondsD);
+  view.data += 3*view.sc;
+  if (config->registered)
+    libkinect_(fill_registered)(&view, depth, config);
+  else
+    libkinect_(fill_depth)(&view, depth, config);
+
+  // return the timestamps, the time into the recording and the depth frame used
+  lua_pushnumber(L, timestampRGB);
+  lua_pushnumber(L, timestampD);
+  lua_pushnumber(L, seconds);
+  lua_pushnumber(L, d + 1);
+  return 4;
+}
+
 //============================================================
 // Register functions in LUA
 //
@@ -159,13 +1402,35 @@ static const luaL_reg libkinect_(Main__) [] =
   {"grabRGB", libkinect_(grab_rgb)},
   {"grabDepth", libkinect_(grab_depth)},
   {"grabRGBD", libkinect_(grab_rgbd)},
+  {"grabRGBDChanges", libkinect_(grab_rgbd_changes)},
+#ifndef KINECT_INTEGER
+  {"grabPointCloud", libkinect_(grab_point_cloud)},
+#endif
+  {"grabPyramid", libkinect_(grab_pyramid)},
+  {"grabRGBBatch", libkinect_(grab_rgb_batch)},
+  {"grabDepthBatch", libkinect_(grab_depth_batch)},
+  {"grabRGBDBatch", libkinect_(grab_rgbd_batch)},
+  {"grabRGBDRig", libkinect_(grab_rgbd_rig)},
+  {"registerMaps", libkinect_(register_maps)},
+  {"readRGB", libkinect_(read_rgb)},
+  {"readDepth", libkinect_(read_depth)},
+  {"readRGBD", libkinect_(read_rgbd)},
   {NULL, NULL}  /* sentinel */
 };
 
 DLL_EXPORT int libkinect_(Main_init) (lua_State *L) {
+  int v;
+  for (v = 0; v < 256; v++)
+#ifdef KINECT_INTEGER
+    libkinect_(rgb_values)[v] = v;
+#else
+    libkinect_(rgb_values)[v] = ((real)v) / 255;
+#endif
   luaT_pushmetaclass(L, torch_(Tensor_id));
   luaT_registeratname(L, libkinect_(Main__), "libkinect");
   return 1;
 }
 
+#undef KINECT_INTEGER
+#undef KINECT_REAL_MAX
 #endif
@@ -49,16 +49,60 @@ _kinect.colors = {off=0,green=1,red=2,orange=3,
                   green_wink=4,
                   orange_wink_red=6}
 _kinect.current = nil -- current device in use
+_kinect.readers = setmetatable({}, {__mode='k'}) -- maps of each recording opened
+_kinect.rigs = {} -- Kx4xHxW maps of each set of devices grabbed together
 _kinect.grabbingColor = 6
 
+-- maps of the default tensor type, or of the one named (e.g. 'torch.ByteTensor')
+local function newMap(tensorType, ...)
+   if tensorType == nil then
+      return torch.Tensor(...)
+   end
+   local Tensor = torch[tensorType:match('^torch%.(%a+)$') or tensorType]
+   if Tensor == nil then
+      error("unknown tensor type "..tensorType)
+   end
+   return Tensor(...)
+end
+
 function kinect.initDevice(...)
-   local _,id = dok.unpack(
+   local _,id,streams,depth,registered,source,file,fps,rgbRing,depthRing,ownThread,cpu = dok.unpack(
       {...},
       'kinect.device',
       [[return the current device from frame grabbing]],
-      {arg='id', type='number', help='id of the device', default=0})
+      {arg='id', type='number', help='id of the device', default=0},
+      {arg='streams', type='string',
+       help='rgbd | depth, depth starts only the depth stream', default='rgbd'},
+      {arg='depth', type='string',
+       help=[[what depth maps hold: raw (disparity/2047) | meters | mm,
+              0 marks pixels without reading in meters and mm]], default='raw'},
+      {arg='registered', type='boolean',
+       help='align the depth of RGBD maps into the RGB frame', default=false},
+      {arg='source', type='string',
+       help='where frames come from: device | synthetic | replay | recording', default='device'},
+      {arg='file', type='string',
+       help='raw RGB/depth frames for the replay source, a kinect.record file for the recording one'},
+      {arg='fps', type='number',
+       help='rate of the synthetic/replay/recording source, 0 for as fast as possible', default=30},
+      {arg='rgbRing', type='table',
+       help='ring of the RGB stream: {slots=3, policy=latest | queue}'},
+      {arg='depthRing', type='table',
+       help='ring of the depth stream: {slots=3, policy=latest | queue}'},
+      {arg='ownThread', type='boolean',
+       help=[[a libfreenect context and event thread of its own,
+              the frames of several devices are then produced in parallel]],
+       default=false},
+      {arg='cpu', type='number', help='CPU the event thread is pinned to (Linux)'})
    if _kinect.devices[id] == nil then
-      _kinect.devices[id] = libkinect.newdevice(id)
+      libkinect.setsource(id, source, file, fps)
+      libkinect.setthreading(id, ownThread, cpu)
+      if rgbRing then
+         libkinect.setring(id, 'rgb', rgbRing.slots or 3, rgbRing.policy or 'latest')
+      end
+      if depthRing then
+         libkinect.setring(id, 'depth', depthRing.slots or 3, depthRing.policy or 'latest')
+      end
+      _kinect.devices[id] = libkinect.newdevice(id, streams, depth, registered)
       _kinect.tensors[id] = {}
       -- set the led to show it's working
       _kinect.colors[id] = kinect.led{color='green',id=id}
@@ -70,72 +114,385 @@ function kinect.initDevice(...)
 end
 
 function kinect.getRGB(...)
-   local _,id = dok.unpack(
+   local _,id,timeout,scale,tensorType,layout = dok.unpack(
       {...},
       'kinect.getRGB',
-      [[return the current RGB frame, and its timestamp]],
-      {arg='id', type='number', help='id of the device', default=_kinect.current})
+      [[return the current RGB frame, its timestamp, if it is new and its age (s)]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='timeout', type='number',
+       help='max wait in ms for a new frame, else the last one is returned again (0 = try)'},
+      {arg='scale', type='number',
+       help='downsampling factor: 1, 2, 4 or 8 (area average)', default=1},
+      {arg='type', type='string',
+       help='tensor type, torch.ByteTensor keeps the raw bytes (default: torch.Tensor)'},
+      {arg='layout', type='string',
+       help='chw (3xHxW) | hwc (HxWx3, channels last like the frame)', default='chw'})
    if id == nil then
       error("No Kinect ON, you need to initDevice first")
    end
    -- init tensor
-   if _kinect.tensors[id].rgb == nil then
-      _kinect.tensors[id].rgb = torch.Tensor(3,480,640)
+   local name = 'rgb'..scale..(tensorType or '')..layout
+   if _kinect.tensors[id][name] == nil then
+      if layout == 'hwc' then
+         _kinect.tensors[id][name] = newMap(tensorType,480/scale,640/scale,3)
+      else
+         _kinect.tensors[id][name] = newMap(tensorType,3,480/scale,640/scale)
+      end
    end
    -- set grabbing color to orange_wink_red
    if _kinect.colors[id] ~= _kinect.grabbingColor then
       _kinect.colors[id] = kinect.led{colorValue=_kinect.grabbingColor,id=id}
    end
-   local rgb = _kinect.tensors[id].rgb
+   local rgb = _kinect.tensors[id][name]
    -- c call
-   local timestamp = rgb.libkinect.grabRGB(rgb,id)
-   return rgb,timestamp
+   local timestamp,isNew,age = rgb.libkinect.grabRGB(rgb,id,timeout)
+   return rgb,timestamp,isNew,age
 end
 
 function kinect.getDepth(...)
-   local _,id = dok.unpack(
+   local _,id,timeout,scale,tensorType = dok.unpack(
       {...},
       'kinect.getDepth',
-      [[return Depth map, timestamp ]],
-      {arg='id', type='number', help='id of the device', default=_kinect.current})
+      [[return Depth map, timestamp, if it is new and its age (s)]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='timeout', type='number',
+       help='max wait in ms for a new frame, else the last one is returned again (0 = try)'},
+      {arg='scale', type='number',
+       help='downsampling factor: 1, 2, 4 or 8 (area average)', default=1},
+      {arg='type', type='string',
+       help='tensor type, torch.ShortTensor keeps the raw depth or mm (default: torch.Tensor)'})
    if id == nil then
       error("No Kinect ON, you need to initDevice first")
    end
    -- init tensor
-   if _kinect.tensors[id].depth == nil then
-      _kinect.tensors[id].depth = torch.Tensor(1,480,640)
+   local name = 'depth'..scale..(tensorType or '')
+   if _kinect.tensors[id][name] == nil then
+      _kinect.tensors[id][name] = newMap(tensorType,1,480/scale,640/scale)
    end
    -- set grabbing color to orange_wink_red
    if _kinect.colors[id] ~= _kinect.grabbingColor then
       _kinect.colors[id] = kinect.led{colorValue=_kinect.grabbingColor,id=id}
    end
-   local depth = _kinect.tensors[id].depth
+   local depth = _kinect.tensors[id][name]
    -- c call
-   local timestamp = depth.libkinect.grabDepth(depth,id)
-   return depth, timestamp
+   local timestamp,isNew,age = depth.libkinect.grabDepth(depth,id,timeout)
+   return depth, timestamp, isNew, age
 end
 
 function kinect.getRGBD(...)
-   local _,id = dok.unpack(
+   local _,id,timeout,pair,maxSkew,scale,tensorType,layout = dok.unpack(
       {...},
       'kinect.getRGBD',
-      [[return RGBD maps, timestampRGB, timestampDepth ]],
-      {arg='id', type='number', help='id of the device', default=_kinect.current})
+      [[return RGBD maps, timestampRGB, timestampDepth,
+         if both maps are new and the age (s) of the oldest]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='timeout', type='number',
+       help='max wait in ms for new frames, else the last ones are returned again (0 = try)'},
+      {arg='pair', type='boolean',
+       help='match the RGB and depth frames by timestamp among the ones queued in the rings',
+       default=false},
+      {arg='maxSkew', type='number',
+       help='with pair, largest timestamp difference accepted (default: the closest pair)'},
+      {arg='scale', type='number',
+       help='downsampling factor: 1, 2, 4 or 8 (area average)', default=1},
+      {arg='type', type='string',
+       help='tensor type, torch.ShortTensor keeps raw bytes and depth (default: torch.Tensor)'},
+      {arg='layout', type='string',
+       help='chw (4xHxW) | hwc (HxWx4, channels last)', default='chw'})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   -- init tensor
+   local name = 'rgbd'..scale..(tensorType or '')..layout
+   if _kinect.tensors[id][name] == nil then
+      if layout == 'hwc' then
+         _kinect.tensors[id][name] = newMap(tensorType,480/scale,640/scale,4)
+      else
+         _kinect.tensors[id][name] = newMap(tensorType,4,480/scale,640/scale)
+      end
+   end
+   -- set grabbing color to orange_wink_red
+   if _kinect.colors[id] ~= _kinect.grabbingColor then
+      _kinect.colors[id] = kinect.led{colorValue=_kinect.grabbingColor,id=id}
+   end
+   local rgbd = _kinect.tensors[id][name]
+   -- c call
+   local timestampRGB, timestampD, newRGB, newD, ageRGB, ageD =
+      rgbd.libkinect.grabRGBD(rgbd,id,timeout,pair,maxSkew)
+   if timestampRGB == nil then
+      return rgbd, nil, nil, false
+   end
+   return rgbd, timestampRGB, timestampD, newRGB and newD, math.max(ageRGB, ageD)
+end
+
+function kinect.getPyramid(...)
+   local _,id,maps,scales,timeout = dok.unpack(
+      {...},
+      'kinect.getPyramid',
+      [[grab one frame at several scales in one pass, return the maps (in the order
+         of scales) then the timestamp(s), if new and the age(s) as getRGB/getRGBD]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='maps', type='string', help='rgb | depth | rgbd', default='rgb'},
+      {arg='scales', type='table', help='downsampling factors among 1, 2, 4 and 8',
+       default={1,2,4}},
+      {arg='timeout', type='number',
+       help='max wait in ms for a new frame, else the last one is returned again (0 = try)'})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   local channels = ({rgb=3, depth=1, rgbd=4})[maps]
+   if channels == nil then
+      error("maps must be rgb, depth or rgbd")
+   end
+   -- init tensors
+   local levels = {}
+   for i,scale in ipairs(scales) do
+      local name = maps..scale
+      if _kinect.tensors[id][name] == nil then
+         _kinect.tensors[id][name] = torch.Tensor(channels,480/scale,640/scale)
+      end
+      levels[i] = _kinect.tensors[id][name]
+   end
+   -- set grabbing color to orange_wink_red
+   if _kinect.colors[id] ~= _kinect.grabbingColor then
+      _kinect.colors[id] = kinect.led{colorValue=_kinect.grabbingColor,id=id}
+   end
+   -- c call
+   return levels, levels[1].libkinect.grabPyramid(levels,id,timeout)
+end
+
+function kinect.getPointCloud(...)
+   local _,id,timeout,compact = dok.unpack(
+      {...},
+      'kinect.getPointCloud',
+      [[return the depth frame as a point cloud in meters (depth camera frame),
+         its timestamp, if it is new, its age (s) and the number of points]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='timeout', type='number',
+       help='max wait in ms for a new frame, else the last one is returned again (0 = try)'},
+      {arg='compact', type='boolean',
+       help='a Nx3 list of the pixels with a reading instead of a 3x480x640 map', default=false})
    if id == nil then
       error("No Kinect ON, you need to initDevice first")
    end
    -- init tensor
-   if _kinect.tensors[id].rgbd == nil then
-      _kinect.tensors[id].rgbd = torch.Tensor(4,480,640)
+   local name = compact and 'pointList' or 'points'
+   if _kinect.tensors[id][name] == nil then
+      _kinect.tensors[id][name] = compact and torch.Tensor(480*640,3) or torch.Tensor(3,480,640)
+   end
+   -- set grabbing color to orange_wink_red
+   if _kinect.colors[id] ~= _kinect.grabbingColor then
+      _kinect.colors[id] = kinect.led{colorValue=_kinect.grabbingColor,id=id}
    end
+   local points = _kinect.tensors[id][name]
+   -- c call
+   local timestamp,isNew,age,n = points.libkinect.grabPointCloud(points,id,timeout)
+   return points,timestamp,isNew,age,n
+end
+
+-- tensor of n maps for a batch grab: the given one, or one kept per device
+local function batchTensor(id, name, tensor, n, channels)
    -- set grabbing color to orange_wink_red
    if _kinect.colors[id] ~= _kinect.grabbingColor then
       _kinect.colors[id] = kinect.led{colorValue=_kinect.grabbingColor,id=id}
    end
-   local rgbd = _kinect.tensors[id].rgbd
+   if tensor then
+      return tensor
+   end
+   local batch = _kinect.tensors[id][name]
+   if batch == nil or batch:size(1) ~= n then
+      batch = torch.Tensor(n,channels,480,640)
+      _kinect.tensors[id][name] = batch
+   end
+   return batch
+end
+
+function kinect.getRGBBatch(...)
+   local _,n,id,tensor = dok.unpack(
+      {...},
+      'kinect.getRGBBatch',
+      [[grab n consecutive RGB frames in one call,
+         return the Nx3x480x640 maps and their timestamps]],
+      {arg='n', type='number', help='number of frames', req=true},
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='tensor', type='torch.Tensor', help='Nx3x480x640 contiguous maps to fill'})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   local rgb = batchTensor(id, 'rgbBatch', tensor, n, 3)
+   -- c call
+   return rgb, rgb.libkinect.grabRGBBatch(rgb,id)
+end
+
+function kinect.getDepthBatch(...)
+   local _,n,id,tensor = dok.unpack(
+      {...},
+      'kinect.getDepthBatch',
+      [[grab n consecutive Depth frames in one call,
+         return the Nx1x480x640 maps and their timestamps]],
+      {arg='n', type='number', help='number of frames', req=true},
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='tensor', type='torch.Tensor', help='Nx1x480x640 maps to fill'})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   local depth = batchTensor(id, 'depthBatch', tensor, n, 1)
+   -- c call
+   return depth, depth.libkinect.grabDepthBatch(depth,id)
+end
+
+function kinect.getRGBDBatch(...)
+   local _,n,id,tensor,pair,maxSkew = dok.unpack(
+      {...},
+      'kinect.getRGBDBatch',
+      [[grab n consecutive RGBD maps in one call,
+         return the Nx4x480x640 maps and the Nx2 (RGB, Depth) timestamps]],
+      {arg='n', type='number', help='number of frames', req=true},
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='tensor', type='torch.Tensor', help='Nx4x480x640 contiguous maps to fill'},
+      {arg='pair', type='boolean',
+       help='match the RGB and depth frames by timestamp, see getRGBD', default=false},
+      {arg='maxSkew', type='number',
+       help='with pair, largest timestamp difference accepted (default: the closest pair)'})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   local rgbd = batchTensor(id, 'rgbdBatch', tensor, n, 4)
+   -- c call
+   return rgbd, rgbd.libkinect.grabRGBDBatch(rgbd,id,nil,pair,maxSkew)
+end
+
+function kinect.getRGBDRig(...)
+   local _,ids,timeout,pair,maxSkew,scale,tensorType,layout = dok.unpack(
+      {...},
+      'kinect.getRGBDRig',
+      [[grab the RGBD maps of several devices at once, each on a thread of its own,
+         return the Kx4xHxW maps, the Kx2 (RGB, Depth) timestamps and the largest
+         skew (s) between the frames of the devices, from the times they were published]],
+      {arg='ids', type='table', help='ids of the devices, each initialized', req=true},
+      {arg='timeout', type='number', help='max wait in ms for the frames of every device'},
+      {arg='pair', type='boolean',
+       help='match the RGB and depth frames of each device by timestamp, see getRGBD',
+       default=false},
+      {arg='maxSkew', type='number',
+       help='with pair, largest timestamp difference accepted (default: the closest pair)'},
+      {arg='scale', type='number',
+       help='downsampling factor: 1, 2, 4 or 8 (area average)', default=1},
+      {arg='type', type='string', help='tensor type (default: torch.Tensor)'},
+      {arg='layout', type='string', help='chw (Kx4xHxW) | hwc (KxHxWx4)', default='chw'})
+   for _,id in ipairs(ids) do
+      if _kinect.devices[id] == nil then
+         error("Kinect "..id.." is not ON, you need to initDevice it first")
+      end
+   end
+   -- init tensor
+   local name = table.concat(ids, ',')..':'..scale..(tensorType or '')..layout
+   if _kinect.rigs[name] == nil then
+      if layout == 'hwc' then
+         _kinect.rigs[name] = newMap(tensorType,#ids,480/scale,640/scale,4)
+      else
+         _kinect.rigs[name] = newMap(tensorType,#ids,4,480/scale,640/scale)
+      end
+   end
+   local rgbd = _kinect.rigs[name]
    -- c call
-   local timestampRGB, timestampD = rgbd.libkinect.grabRGBD(rgbd,id)
-   return rgbd, timestampRGB, timestampD
+   local timestamps, skew = rgbd.libkinect.grabRGBDRig(rgbd,ids,timeout,pair,maxSkew)
+   return rgbd, timestamps, skew
+end
+
+function kinect.registerMaps(...)
+   local _,id,maps,tensors = dok.unpack(
+      {...},
+      'kinect.registerMaps',
+      [[convert frames on a worker thread as soon as they are published,
+         into two maps that swapMaps hands out in turn]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='maps', type='string', help='rgb | depth | rgbd', default='rgbd'},
+      {arg='tensors', type='table',
+       help='two contiguous Cx480x640 tensors of the same type, allocated if not given; '..
+          'their storages cannot be resized until unregisterMaps'})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   if tensors == nil then
+      local channels = ({rgb=3, depth=1, rgbd=4})[maps]
+      if channels == nil then
+         error("maps must be rgb, depth or rgbd")
+      end
+      tensors = {torch.Tensor(channels,480,640), torch.Tensor(channels,480,640)}
+   end
+   tensors[1].libkinect.registerMaps(tensors[1],tensors[2],id)
+   _kinect.tensors[id].maps = tensors
+   -- set grabbing color to orange_wink_red
+   if _kinect.colors[id] ~= _kinect.grabbingColor then
+      _kinect.colors[id] = kinect.led{colorValue=_kinect.grabbingColor,id=id}
+   end
+end
+
+function kinect.swapMaps(...)
+   local _,id,timeout = dok.unpack(
+      {...},
+      'kinect.swapMaps',
+      [[return the map converted last, its timestamps (RGB, Depth) and if it is new;
+         the map is not written until the next swapMaps]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='timeout', type='number',
+       help='max wait in ms for a new map, else the last one is returned again (0 = try)'})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   local map,timestampRGB,timestampD,isNew = libkinect.swapMaps(id,timeout)
+   return _kinect.tensors[id].maps[map],timestampRGB,timestampD,isNew
+end
+
+function kinect.unregisterMaps(...)
+   local _,id = dok.unpack(
+      {...},
+      'kinect.unregisterMaps',
+      [[stop the worker thread, the grab functions can be used again]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   libkinect.unregisterMaps(id)
+   _kinect.tensors[id].maps = nil
+end
+
+function kinect.leaseRGB(...)
+   local _,id = dok.unpack(
+      {...},
+      'kinect.leaseRGB',
+      [[return the raw RGB frame as a 480x640x3 ByteTensor, and its timestamp,
+         without copy: the tensor is valid until kinect.release]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   return libkinect.leaseRGB(id)
+end
+
+function kinect.leaseDepth(...)
+   local _,id = dok.unpack(
+      {...},
+      'kinect.leaseDepth',
+      [[return the raw 11-bit depth frame as a 480x640 ShortTensor, and its timestamp,
+         without copy: the tensor is valid until kinect.release]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   return libkinect.leaseDepth(id)
+end
+
+function kinect.release(...)
+   local _,tensor,id = dok.unpack(
+      {...},
+      'kinect.release',
+      [[give a frame from leaseRGB/leaseDepth back to the device, empties the tensor
+         and the other views of its storage]],
+      {arg='tensor', type='torch.Tensor', help='leased frame', req=true},
+      {arg='id', type='number', help='id of the device', default=_kinect.current})
+   libkinect.release(tensor, id)
 end
 
 function kinect.led(...)
@@ -179,10 +536,306 @@ function kinect.tilt(...)
    libkinect.tilt(angle,id)
 end
 
+function kinect.timings(...)
+   local _,id = dok.unpack(
+      {...},
+      'kinect.timings',
+      [[wait/swap/convert time of the last grab, per stream, in ns]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   return libkinect.timings(id)
+end
+
+function kinect.counters(...)
+   local _,id = dok.unpack(
+      {...},
+      'kinect.counters',
+      [[produced/delivered/dropped/queued frames per stream, the counters of kinect.stats]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   return libkinect.counters(id)
+end
+
+function kinect.setDepthFilter(...)
+   local _,id,mode,alpha,window,hold,jump = dok.unpack(
+      {...},
+      'kinect.setDepthFilter',
+      [[temporal filter of the depth frames, run in C once per new frame grabbed, before
+         getDepth/getRGBD/getPyramid/getPointCloud and the batches convert it. Frames the ring
+         drops before a grab never reach it, so alpha, window and hold count grabbed frames]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='mode', type='string',
+       help='ema (running average) | median (of the last window frames) | off', default='ema'},
+      {arg='alpha', type='number', help='ema: weight of the reading of each grabbed frame', default=0.3},
+      {arg='window', type='number', help='median: last grabbed frames, up to 9', default=5},
+      {arg='hold', type='number',
+       help='grabbed frames a pixel without reading keeps its last value (hole filling)', default=5},
+      {arg='jump', type='number',
+       help=[[ema: a reading this far from the average restarts it, in raw disparity or mm
+              (default: 12 raw, 75 mm)]]})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   libkinect.setfilter(id, mode, alpha, window, hold, jump)
+end
+
+function kinect.getDepthConfidence(...)
+   local _,id = dok.unpack(
+      {...},
+      'kinect.getDepthConfidence',
+      [[1x480x640 FloatTensor: per pixel share of the recent frames holding a reading
+         (0 to 1, over about 8 grabbed frames), kept by the depth filter]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   if _kinect.tensors[id].confidence == nil then
+      _kinect.tensors[id].confidence = torch.FloatTensor(1,480,640)
+   end
+   return libkinect.depthConfidence(id, _kinect.tensors[id].confidence)
+end
+
+function kinect.setChangeDetection(...)
+   local _,id,tile,rgb,depth = dok.unpack(
+      {...},
+      'kinect.setChangeDetection',
+      [[compare each frame with a reference, per tile, in C before getRGBDChanges
+         converts only the tiles that changed]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='tile', type='number',
+       help='side of the tiles in pixels: 8, 10, 16, 20, 32, 40, 80 or 160, 0 for off', default=32},
+      {arg='rgb', type='number',
+       help='a tile changes if its colors moved more than this per channel (0-255), on average',
+       default=8},
+      {arg='depth', type='number',
+       help=[[or if its depth moved more than this per pixel, on average, in raw disparity or mm
+              (default: 5 raw, 30 mm)]]})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   libkinect.setchanges(id, tile, rgb, depth)
+end
+
+function kinect.getRGBDChanges(...)
+   local _,id,timeout,tensorType,layout,full = dok.unpack(
+      {...},
+      'kinect.getRGBDChanges',
+      [[return the RGBD map, the number of changed regions, a Nx4 tensor of them
+         (x, y from 1, width, height), timestampRGB, timestampDepth. Only the changed
+         regions of the map are converted, nothing when the frames are not new]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='timeout', type='number',
+       help='max wait in ms for new frames, else no region changes (0 = try)'},
+      {arg='type', type='string',
+       help='tensor type, torch.ShortTensor keeps raw bytes and depth (default: torch.Tensor)'},
+      {arg='layout', type='string',
+       help='chw (4x480x640) | hwc (480x640x4, channels last)', default='chw'},
+      {arg='full', type='boolean',
+       help='convert the whole map, after writing into the one returned before', default=false})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   -- the same map every call: the regions that did not change are already in it
+   local name = 'changes'..(tensorType or '')..layout
+   if _kinect.tensors[id][name] == nil then
+      if layout == 'hwc' then
+         _kinect.tensors[id][name] = newMap(tensorType,480,640,4)
+      else
+         _kinect.tensors[id][name] = newMap(tensorType,4,480,640)
+      end
+      _kinect.tensors[id][name..'regions'] = torch.DoubleTensor()
+   end
+   local rgbd = _kinect.tensors[id][name]
+   local n, regions, timestampRGB, timestampD =
+      rgbd.libkinect.grabRGBDChanges(rgbd,id,timeout,_kinect.tensors[id][name..'regions'],full)
+   if n == nil then
+      return rgbd, 0
+   end
+   return rgbd, n, regions, timestampRGB, timestampD
+end
+
+function kinect.frameFd(...)
+   local _,id,stream = dok.unpack(
+      {...},
+      'kinect.frameFd',
+      [[file descriptor readable while new frames of a stream wait, for select/poll/epoll
+         loops (Linux); once readable, getRGB/getDepth/getRGBD{timeout=0} return them
+         without blocking. Do not read it, the grab calls clear it]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='stream', type='string', help='rgb | depth', default='depth'})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   return libkinect.frameFd(id, stream)
+end
+
+function kinect.stats(...)
+   local _,id,reset = dok.unpack(
+      {...},
+      'kinect.stats',
+      [[telemetry per stream (rgb, depth): frames produced/delivered/dropped and
+         histograms in ns (count, mean, max, p50, p99, log2 buckets) of the consumer
+         wait, of the latency from publication to delivery and of the conversion]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='reset', type='boolean', help='zero the stats once read', default=false})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   local stats = libkinect.stats(id)
+   if reset then
+      libkinect.resetStats(id)
+   end
+   return stats
+end
+
+function kinect.statsDump(...)
+   local _,period = dok.unpack(
+      {...},
+      'kinect.statsDump',
+      [[print the rates and p50/p99 times of every stream each period seconds]],
+      {arg='period', type='number', help='seconds between dumps, 0 to stop', default=5})
+   libkinect.statsDump(period)
+end
+
+function kinect.record(...)
+   local _,id,file,slots = dok.unpack(
+      {...},
+      'kinect.record',
+      [[record every frame into a file (raw RGB, losslessly coded depth, timestamp index),
+         written on a thread of its own while the grab functions go on]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current},
+      {arg='file', type='string', help='recording to create', req=true},
+      {arg='slots', type='number',
+       help='frames that can wait to be written, new ones are dropped beyond', default=16})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   libkinect.record(id, file, slots)
+end
+
+function kinect.stopRecording(...)
+   local _,id = dok.unpack(
+      {...},
+      'kinect.stopRecording',
+      [[write the frames waiting and the index, return the frames written/dropped per stream
+         and the bytes written]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   return libkinect.stopRecord(id)
+end
+
+function kinect.recordStats(...)
+   local _,id = dok.unpack(
+      {...},
+      'kinect.recordStats',
+      [[frames written/dropped per stream, bytes written and ns spent on the last frame,
+         nil when not recording]],
+      {arg='id', type='number', help='id of the device', default=_kinect.current})
+   if id == nil then
+      error("No Kinect ON, you need to initDevice first")
+   end
+   return libkinect.recordStats(id)
+end
+
+function kinect.openRecording(...)
+   local _,file,depth,registered = dok.unpack(
+      {...},
+      'kinect.openRecording',
+      [[map a kinect.record file for random access, frames are read with
+         kinect.readRGB/readDepth/readRGBD; the recording has :count('rgb' | 'depth'),
+         :duration(), :find(seconds, stream), :time(frame, stream) and :close()]],
+      {arg='file', type='string', help='recording to open', req=true},
+      {arg='depth', type='string',
+       help='raw | meters | mm, like initDevice, for this recording only', default='raw'},
+      {arg='registered', type='boolean',
+       help='align the depth of RGBD maps into the RGB frame', default=false})
+   local recording = libkinect.openRecording(file, depth, registered)
+   _kinect.readers[recording] = {}
+   return recording
+end
+
+-- the map name of a recording, made once
+local function readerMap(recording, name, tensorType, ...)
+   local maps = _kinect.readers[recording]
+   if maps[name] == nil then
+      maps[name] = newMap(tensorType, ...)
+   end
+   return maps[name]
+end
+
+function kinect.readRGB(...)
+   local _,recording,frame,scale,tensorType,layout = dok.unpack(
+      {...},
+      'kinect.readRGB',
+      [[return RGB frame n of a recording, its timestamp and its time (s) into the recording]],
+      {arg='recording', type='userdata', help='from kinect.openRecording', req=true},
+      {arg='frame', type='number', help='frame number, 1 is the first', req=true},
+      {arg='scale', type='number',
+       help='downsampling factor: 1, 2, 4 or 8 (area average)', default=1},
+      {arg='type', type='string', help='tensor type (default: torch.Tensor)'},
+      {arg='layout', type='string', help='chw | hwc', default='chw'})
+   local name = 'rgb'..scale..(tensorType or '')..layout
+   local rgb
+   if layout == 'hwc' then
+      rgb = readerMap(recording, name, tensorType, 480/scale, 640/scale, 3)
+   else
+      rgb = readerMap(recording, name, tensorType, 3, 480/scale, 640/scale)
+   end
+   local timestamp, seconds = rgb.libkinect.readRGB(rgb, recording, frame)
+   return rgb, timestamp, seconds
+end
+
+function kinect.readDepth(...)
+   local _,recording,frame,scale,tensorType = dok.unpack(
+      {...},
+      'kinect.readDepth',
+      [[return depth frame n of a recording, its timestamp and its time (s) into the recording]],
+      {arg='recording', type='userdata', help='from kinect.openRecording', req=true},
+      {arg='frame', type='number', help='frame number, 1 is the first', req=true},
+      {arg='scale', type='number',
+       help='downsampling factor: 1, 2, 4 or 8 (area average)', default=1},
+      {arg='type', type='string', help='tensor type (default: torch.Tensor)'})
+   local depth = readerMap(recording, 'depth'..scale..(tensorType or ''), tensorType,
+                           1, 480/scale, 640/scale)
+   local timestamp, seconds = depth.libkinect.readDepth(depth, recording, frame)
+   return depth, timestamp, seconds
+end
+
+function kinect.readRGBD(...)
+   local _,recording,frame,scale,tensorType,layout = dok.unpack(
+      {...},
+      'kinect.readRGBD',
+      [[return RGB frame n of a recording with the depth frame published closest to it,
+         timestampRGB, timestampDepth, the time (s) into the recording and the depth frame number]],
+      {arg='recording', type='userdata', help='from kinect.openRecording', req=true},
+      {arg='frame', type='number', help='RGB frame number, 1 is the first', req=true},
+      {arg='scale', type='number',
+       help='downsampling factor: 1, 2, 4 or 8 (area average)', default=1},
+      {arg='type', type='string', help='tensor type (default: torch.Tensor)'},
+      {arg='layout', type='string', help='chw | hwc', default='chw'})
+   local name = 'rgbd'..scale..(tensorType or '')..layout
+   local rgbd
+   if layout == 'hwc' then
+      rgbd = readerMap(recording, name, tensorType, 480/scale, 640/scale, 4)
+   else
+      rgbd = readerMap(recording, name, tensorType, 4, 480/scale, 640/scale)
+   end
+   local timestampRGB, timestampD, seconds, depthFrame = rgbd.libkinect.readRGBD(rgbd, recording, frame)
+   return rgbd, timestampRGB, timestampD, seconds, depthFrame
+end
+
 function kinect.stop()
    -- stop the thread
+   libkinect.statsDump(0)
    libkinect.stop()
    _kinect.devices = {}
+   _kinect.rigs = {}
    _kinect.current = nil
 end
 
@@ -217,5 +870,16 @@ function kinect.testme()
    collectgarbage()
 end
 
+------------------------------------------------------------
+-- Check the SIMD conversion kernels against the scalar code,
+-- no Kinect needed
+------------------------------------------------------------
+function kinect.testconvert()
+   local mismatches = libkinect.testconvert()
+   print('kernel in use: '..libkinect.kernel()..', mismatches: '..mismatches)
+   assert(mismatches == 0, 'conversion kernels differ from the scalar code')
+end
+
+torch.include('kinect', 'benchmark.lua')
 
 return kinect
\ No newline at end of file
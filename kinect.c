@@ -36,10 +36,19 @@
 #include <string.h>
 #include <assert.h>
 #include "libfreenect_sync.h"
+#include "kinect_convert.h"
+#include "kinect_record.h"
+#include "kinect_playback.h"
+#include "kinect_filter.h"
+#include "kinect_change.h"
 
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
 
 #include <math.h>
+#include <float.h>
 #define max(a,b) a < b ? b : a
 #define min(a,b) a > b ? b : a
 
@@ -49,6 +58,24 @@
 #define DFORMAT FREENECT_DEPTH_11BIT
 #define D_MAXSIZE 2047
 
+/* depth camera intrinsics, from Nicolas Burrus' calibration */
+#define DEPTH_FX 5.9421434211923247e+02
+#define DEPTH_FY 5.9104053696870778e+02
+#define DEPTH_CX 3.3930780975300314e+02
+#define DEPTH_CY 2.4273913761751615e+02
+
+/* rgb camera intrinsics and depth to rgb camera transform, same calibration */
+#define RGB_FX 5.2921508098293293e+02
+#define RGB_FY 5.2556393630057437e+02
+#define RGB_CX 3.2894272028759258e+02
+#define RGB_CY 2.6748068171871557e+02
+static const double depth_to_rgb_R[3][3] = {
+  { 9.9984628826577793e-01, 1.2635359098409581e-03, -1.7487233004436643e-02},
+  {-1.4779096108364480e-03, 9.9992385683542895e-01, -1.2251380107679535e-02},
+  { 1.7470421412464927e-02, 1.2275341476520762e-02,  9.9977202419716948e-01}};
+static const double depth_to_rgb_T[3] = {
+  1.9985242312092553e-02, -7.4423738761617583e-04, -1.0916736334336222e-02};
+
 
 #define torch_(NAME) TH_CONCAT_3(torch_, Real, NAME)
 #define torch_string_(NAME) TH_CONCAT_STRING_3(torch., Real, NAME)
@@ -56,10 +83,297 @@
 
 static const void* torch_FloatTensor_id = NULL;
 static const void* torch_DoubleTensor_id = NULL;
+static const void* torch_ByteTensor_id = NULL;
+static const void* torch_ShortTensor_id = NULL;
+
+static uint64_t clock_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* what the depth maps hold, set by newdevice */
+typedef enum kinect_depth_mode {
+  KINECT_DEPTH_RAW = 0,  /* the raw 11-bit disparity / D_MAXSIZE */
+  KINECT_DEPTH_METERS,   /* meters, from the 11-bit disparity through a table, 0 if invalid */
+  KINECT_DEPTH_MM,       /* millimeters, from the FREENECT_DEPTH_MM stream, 0 if invalid */
+} kinect_depth_mode;
+
+/* grabbing options of each device, set by newdevice, or of a recording, set by openRecording */
+typedef struct kinect_config {
+  int index;        /* device the conversions are counted for, -1 for a recording */
+  bool depth_only;  /* only the depth stream is started */
+  kinect_depth_mode depth_mode;
+  freenect_depth_format depth_format;  /* DFORMAT, or FREENECT_DEPTH_MM */
+  bool registered;  /* the depth of RGBD maps is aligned into the rgb frame */
+  float *registration;  /* 480x640x3 rays of the depth pixels, in the rgb camera frame */
+  float *zbuffer;       /* 480x640 depths already registered, nearest wins */
+  kinect_filter *filter;  /* temporal filter of the depth frames, NULL if off, see setfilter */
+  kinect_change *change;  /* change detection of grabRGBDChanges, NULL if off, see setchanges */
+  void *change_storage;   /* storage of the map grabRGBDChanges filled last, held so it is not reused */
+  void (*free_change_storage)(void *storage);
+  void *change_map;       /* data of that map, its other tiles are up to date */
+  uint64_t batch_start;   /* nonzero while a grab times several conversions as one, see grabPyramid */
+  /* raw 11-bit depth to the depth mode, and to meters, for each map type: the generic code
+     picks its own with .Real, see build_depth_tables */
+  struct {
+    float Float[D_MAXSIZE+1];
+    double Double[D_MAXSIZE+1];
+    unsigned char Byte[D_MAXSIZE+1];
+    short Short[D_MAXSIZE+1];
+  } depth_tables;
+  struct {
+    float Float[D_MAXSIZE+1];
+    double Double[D_MAXSIZE+1];
+    float Byte[D_MAXSIZE+1];
+    float Short[D_MAXSIZE+1];
+  } meter_tables;
+} kinect_config;
+
+static kinect_config configs[MAX_KINECTS];
+
+/* the next grabRGBDChanges converts its whole map */
+static void forget_change_map(kinect_config *config) {
+  if (config->change_storage)
+    config->free_change_storage(config->change_storage);
+  config->change_storage = NULL;
+  config->change_map = NULL;
+}
+
+/* a frame of a stream was converted since start: counted in the stats, timings reads the last one */
+static void convert_done(kinect_config *config, int is_depth, uint64_t start) {
+  int index = config->index;
+  if (index < 0 || config->batch_start)
+    return;
+  freenect_sync_record_convert(index, is_depth, clock_ns() - start);
+}
+
+/* the depth frame maps are filled from: a new frame goes through the filter of the device. Only
+   the grabbed frames do, the filter counts its time constants in grabs */
+static uint16_t *filtered_depth(int index, uint16_t *depth, int is_new) {
+  kinect_filter *filter = configs[index].filter;
+  if (!filter)
+    return depth;
+  const uint16_t *output = kinect_filter_output(filter);
+  if (!is_new && output)
+    return (uint16_t *)output;
+  return (uint16_t *)kinect_filter_apply(filter, depth);
+}
+
+/* how much a HxW map is downsampled from 480x640: 1, 2, 4 or 8, 0 if it is no such map */
+static int scale_factor(long h, long w) {
+  int f;
+  for (f = 1; f <= 8; f *= 2)
+    if (h * f == 480 && w * f == 640)
+      return f;
+  return 0;
+}
+
+/* meters of a raw 11-bit disparity with Nicolas Burrus' fit, 0 if there is no reading */
+static double depth_meters(int raw) {
+  double inverse = raw * -0.0030711016 + 3.3309495161;
+  return (raw < D_MAXSIZE && inverse > 0) ? 1.0 / inverse : 0;
+}
+
+/* maps converted on a worker thread as soon as frames are published, see registerMaps */
+typedef struct kinect_worker {
+  int index;
+  bool rgb, depth;       /* streams converted into the maps */
+  void *maps[2];         /* the registered maps, see capture_map */
+  void (*fill)(void *map, unsigned char *rgb, uint16_t *depth, int index);
+  int (*moved)(void *map);
+  void (*free_map)(void *map);
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool running;
+  bool failed;           /* the device went away */
+  int front;             /* map handed to Lua, the worker fills the other one */
+  bool ready;            /* the back map holds frames Lua has not swapped in */
+  unsigned int timestamps[2][2]; /* rgb and depth timestamps of each map */
+} kinect_worker;
+
+static kinect_worker *workers[MAX_KINECTS];
+
+/* how long the worker waits for a frame before checking if it is stopped */
+#define WORKER_WAIT_MS 100
+
+static void *worker_loop(void *arg) {
+  kinect_worker *worker = arg;
+  int index = worker->index;
+  pthread_mutex_lock(&worker->lock);
+  while (worker->running) {
+    pthread_mutex_unlock(&worker->lock);
+    unsigned int timestampRGB = 0, timestampD = 0;
+    unsigned char *rgb = NULL;
+    uint16_t *depth = NULL;
+    freenect_sync_frame_info info = {1, 0};
+    int ret;
+    if (worker->rgb && worker->depth)
+      ret = freenect_sync_get_pair((void**)&rgb, &timestampRGB, (void**)&depth, &timestampD, index,
+                                   FREENECT_VIDEO_RGB, configs[index].depth_format, -1, WORKER_WAIT_MS, NULL, NULL);
+    else if (worker->rgb)
+      ret = freenect_sync_get_video_timeout((void**)&rgb, &timestampRGB, index, FREENECT_VIDEO_RGB, WORKER_WAIT_MS, &info);
+    else
+      ret = freenect_sync_get_depth_timeout((void**)&depth, &timestampD, index, configs[index].depth_format, WORKER_WAIT_MS, &info);
+
+    pthread_mutex_lock(&worker->lock);
+    if (ret < 0) {
+      worker->failed = true;
+      pthread_cond_broadcast(&worker->cond);
+      break;
+    }
+    if (ret > 0 || !info.is_new)
+      continue;
+    // Lua keeps the front map, a frame it has not swapped in yet is overwritten
+    int back = 1 - worker->front;
+    worker->ready = false;
+    pthread_mutex_unlock(&worker->lock);
+
+    if (depth)
+      depth = filtered_depth(index, depth, 1);
+    worker->fill(worker->maps[back], rgb, depth, index);
+
+    pthread_mutex_lock(&worker->lock);
+    worker->timestamps[back][0] = timestampRGB;
+    worker->timestamps[back][1] = timestampD;
+    worker->ready = true;
+    pthread_cond_broadcast(&worker->cond);
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return NULL;
+}
+
+static void start_worker(int index, void *front, void *back, bool rgb, bool depth,
+                         void (*fill)(void *, unsigned char *, uint16_t *, int),
+                         int (*moved)(void *), void (*free_map)(void *)) {
+  kinect_worker *worker = calloc(1, sizeof(kinect_worker));
+  worker->index = index;
+  worker->rgb = rgb;
+  worker->depth = depth;
+  worker->maps[0] = front;
+  worker->maps[1] = back;
+  worker->moved = moved;
+  worker->fill = fill;
+  worker->free_map = free_map;
+  worker->running = true;
+  pthread_mutex_init(&worker->lock, NULL);
+  // swapMaps deadlines are on the monotonic clock
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&worker->cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  workers[index] = worker;
+  pthread_create(&worker->thread, NULL, worker_loop, worker);
+}
+
+/* joins the worker and gives the maps back to Lua, from the Lua thread only */
+static void stop_worker(int index) {
+  kinect_worker *worker = workers[index];
+  if (!worker)
+    return;
+  pthread_mutex_lock(&worker->lock);
+  worker->running = false;
+  pthread_mutex_unlock(&worker->lock);
+  pthread_join(worker->thread, NULL);
+  pthread_mutex_destroy(&worker->lock);
+  pthread_cond_destroy(&worker->cond);
+  worker->free_map(worker->maps[0]);
+  worker->free_map(worker->maps[1]);
+  free(worker);
+  workers[index] = NULL;
+}
+
+/* the rays of the depth pixels rotated into the rgb camera frame, once per config */
+static void build_registration(kinect_config *config) {
+  if (config->registration)
+    return;
+  config->registration = malloc(480*640*3 * sizeof(float));
+  config->zbuffer = malloc(480*640 * sizeof(float));
+  float *ray = config->registration;
+  int u, v, i;
+  for (v = 0; v < 480; v++)
+    for (u = 0; u < 640; u++, ray += 3) {
+      double depth_ray[3] = {(u - DEPTH_CX) / DEPTH_FX, (v - DEPTH_CY) / DEPTH_FY, 1};
+      for (i = 0; i < 3; i++)
+        ray[i] = depth_to_rgb_R[i][0] * depth_ray[0] + depth_to_rgb_R[i][1] * depth_ray[1] +
+                 depth_to_rgb_R[i][2] * depth_ray[2];
+    }
+}
+
+/* the timestamps of a batch, or other n x k results: the DoubleTensor at arg resized, or a new one, pushed on the stack */
+static THDoubleTensor *push_timestamps(lua_State *L, int arg, long n, long k) {
+  THDoubleTensor *timestamps;
+  if (luaT_isudata(L, arg, torch_DoubleTensor_id)) {
+    timestamps = luaT_toudata(L, arg, torch_DoubleTensor_id);
+    lua_pushvalue(L, arg);
+  } else {
+    timestamps = THDoubleTensor_new();
+    luaT_pushudata(L, timestamps, torch_DoubleTensor_id);
+  }
+  if (k > 1)
+    THDoubleTensor_resize2d(timestamps, n, k);
+  else
+    THDoubleTensor_resize1d(timestamps, n);
+  return timestamps;
+}
+
+/* a recording opened for random access, see openRecording */
+typedef struct kinect_reader {
+  kinect_playback *playback;  /* NULL once closed */
+  kinect_config config;       /* depth settings of the read functions, apart from the devices' */
+} kinect_reader;
+
+static kinect_reader *check_reader(lua_State *L, int arg, const char *fn) {
+  kinect_reader *reader = luaL_checkudata(L, arg, "libkinect.recording");
+  if (!reader->playback)
+    luaL_error(L, "<libkinect.%s> the recording is closed", fn);
+  return reader;
+}
+
+/* frame n (1 is the first) of a stream of a recording, its timestamp and seconds into the recording */
+static const void *reader_frame(lua_State *L, kinect_reader *reader, int is_depth, long n, const char *fn,
+                                uint32_t *timestamp, double *seconds) {
+  const kinect_record_chunk *chunk = kinect_playback_chunk(reader->playback, is_depth, n-1);
+  if (!chunk)
+    luaL_error(L, "<libkinect.%s> the recording has no %s frame #%d", fn, is_depth ? "depth" : "rgb", (int)n);
+  uint32_t fmt = is_depth ? reader->config.depth_format : FREENECT_VIDEO_RGB;
+  uint32_t bytes = is_depth ? 640*480*sizeof(uint16_t) : 640*480*3;
+  if (chunk->fmt != fmt || (chunk->codec == KINECT_RECORD_RAW && chunk->size != bytes))
+    luaL_error(L, "<libkinect.%s> %s frame #%d was recorded in another format", fn, is_depth ? "depth" : "rgb", (int)n);
+  const void *data;
+  if (kinect_playback_frame(reader->playback, is_depth, n-1, &data, timestamp))
+    luaL_error(L, "<libkinect.%s> %s frame #%d is corrupt", fn, is_depth ? "depth" : "rgb", (int)n);
+  *seconds = kinect_playback_time(reader->playback, is_depth, n-1);
+  return data;
+}
 
 #include "generic/kinect.c"
 #include "THGenerateFloatTypes.h"
 
+/* raw bytes and raw depth: the integer types the frames fit without loss */
+#include "generic/kinect.c"
+#define real unsigned char
+#define accreal long
+#define Real Byte
+#define TH_REAL_IS_BYTE
+#include TH_GENERIC_FILE
+#undef accreal
+#undef real
+#undef Real
+#undef TH_REAL_IS_BYTE
+#define real short
+#define accreal long
+#define Real Short
+#define TH_REAL_IS_SHORT
+#include TH_GENERIC_FILE
+#undef accreal
+#undef real
+#undef Real
+#undef TH_REAL_IS_SHORT
+#undef TH_GENERIC_FILE
+
 /******************************
  userdata to impose gc on exit
 ******************************/
@@ -71,12 +385,53 @@ typedef struct l_userdata {
 
 static kinect_userdata *kinects[MAX_KINECTS] = {};
 
+/* what the depth maps of a device or a recording hold, for newdevice and openRecording */
+static void configure_depth(lua_State *L, kinect_config *config, const char *depth, bool registered, const char *fn) {
+  // the filter state is in the units of the old format
+  if (config->filter) {
+    kinect_filter_close(config->filter);
+    config->filter = NULL;
+  }
+  if (config->change) {
+    kinect_change_close(config->change);
+    config->change = NULL;
+    forget_change_map(config);
+  }
+  if (!strcmp(depth, "raw")) config->depth_mode = KINECT_DEPTH_RAW;
+  else if (!strcmp(depth, "meters")) config->depth_mode = KINECT_DEPTH_METERS;
+  else if (!strcmp(depth, "mm")) config->depth_mode = KINECT_DEPTH_MM;
+  else
+    luaL_error(L, "<libkinect.%s> unknown depth %s, choose among raw, meters, mm", fn, depth);
+  config->depth_format = config->depth_mode == KINECT_DEPTH_MM ? FREENECT_DEPTH_MM : DFORMAT;
+  libkinect_Floatbuild_depth_tables(config);
+  libkinect_Doublebuild_depth_tables(config);
+  libkinect_Bytebuild_depth_tables(config);
+  libkinect_Shortbuild_depth_tables(config);
+  config->registered = registered;
+  if (registered)
+    build_registration(config);
+}
+
 /**************************************************
  init device and start the thread for grabbing
 **************************************************/
 static int l_init_kinect(lua_State * L){
   int index = 0;
+  const char *streams = "rgbd";
+  const char *depth = "raw";
   if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (lua_isstring(L, 2)) streams = lua_tostring(L, 2);
+  if (lua_isstring(L, 3)) depth = lua_tostring(L, 3);
+  bool registered = lua_toboolean(L, 4);
+  if (index < 0 || index >= MAX_KINECTS)
+    luaL_error(L, "<libkinect.newdevice> invalid Kinect ID #%d", index);
+  if (strcmp(streams, "rgbd") && strcmp(streams, "depth"))
+    luaL_error(L, "<libkinect.newdevice> unknown streams %s, choose among rgbd, depth", streams);
+  // the worker converts with the depth tables, filter and registration configure_depth replaces
+  if (workers[index])
+    luaL_error(L, "<libkinect.newdevice> Kinect ID #%d converts into registered maps, unregister them first", index);
+
+  configure_depth(L, &configs[index], depth, registered, "newdevice");
 
   // create a kinect object
   kinect_userdata *kinect = (kinect_userdata *)lua_newuserdata(L, sizeof(kinect_userdata));
@@ -87,7 +442,12 @@ static int l_init_kinect(lua_State * L){
   // init the device
   char buff[255];
   sprintf(buff, "Init Kinect ID #%d failed, did you plug the device?",index);
-  if (wrap_setup_kinect(index, VFORMAT, 0))
+  configs[index].depth_only = !strcmp(streams, "depth");
+  if (configs[index].depth_only) {
+    // the video stream is never started, grabDepth only waits on depth frames
+    if (wrap_setup_kinect(index, configs[index].depth_format, 1))
+      luaL_error(L, buff);
+  } else if (wrap_setup_kinect(index, VFORMAT, 0))
     luaL_error(L, buff);
   kinect->index = index;
   kinect->ison = true;
@@ -100,6 +460,76 @@ static int l_init_kinect(lua_State * L){
 }
 
 
+/**********************************************************
+ select where the frames come from before init the device
+**********************************************************/
+static int l_set_source(lua_State *L) {
+  int index = 0;
+  const char *name = "device";
+  const char *path = NULL;
+  double fps = 0;
+  // get args
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (lua_isstring(L, 2)) name = lua_tostring(L, 2);
+  if (lua_isstring(L, 3)) path = lua_tostring(L, 3);
+  if (lua_isnumber(L, 4)) fps = lua_tonumber(L, 4);
+
+  freenect_sync_source source;
+  if (!strcmp(name, "device")) source = FREENECT_SYNC_SOURCE_DEVICE;
+  else if (!strcmp(name, "synthetic")) source = FREENECT_SYNC_SOURCE_SYNTHETIC;
+  else if (!strcmp(name, "replay")) source = FREENECT_SYNC_SOURCE_REPLAY;
+  else if (!strcmp(name, "recording")) source = FREENECT_SYNC_SOURCE_RECORDING;
+  else
+    luaL_error(L, "<libkinect.setsource> unknown source %s, choose among device, synthetic, replay, recording", name);
+  if (freenect_sync_set_source(index, source, path, fps))
+    luaL_error(L, "<libkinect.setsource> cannot set the source of Kinect ID #%d", index);
+  return 0;
+}
+
+
+/****************************************************************
+ size and policy (latest | queue) of a stream ring before init
+****************************************************************/
+static int l_set_ring(lua_State *L) {
+  int index = 0;
+  const char *stream = "rgb";
+  int nbufs = 3;
+  const char *name = "latest";
+  // get args
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (lua_isstring(L, 2)) stream = lua_tostring(L, 2);
+  if (lua_isnumber(L, 3)) nbufs = lua_tonumber(L, 3);
+  if (lua_isstring(L, 4)) name = lua_tostring(L, 4);
+
+  freenect_sync_policy policy;
+  if (!strcmp(name, "latest")) policy = FREENECT_SYNC_LATEST;
+  else if (!strcmp(name, "queue")) policy = FREENECT_SYNC_QUEUE;
+  else
+    luaL_error(L, "<libkinect.setring> unknown policy %s, choose among latest, queue", name);
+  if (strcmp(stream, "rgb") && strcmp(stream, "depth"))
+    luaL_error(L, "<libkinect.setring> unknown stream %s, choose among rgb, depth", stream);
+  if (freenect_sync_set_ring(index, !strcmp(stream, "depth"), nbufs, policy))
+    luaL_error(L, "<libkinect.setring> cannot set the ring of Kinect ID #%d", index);
+  return 0;
+}
+
+
+/*****************************************************************
+ give a device its own libfreenect context and event thread,
+ optionally pinned to a CPU, before init
+*****************************************************************/
+static int l_set_threading(lua_State *L) {
+  int index = 0;
+  int cpu = -1;
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  bool own = lua_toboolean(L, 2);
+  if (lua_isnumber(L, 3)) cpu = lua_tonumber(L, 3);
+  if (freenect_sync_set_threading(index, own, cpu))
+    luaL_error(L, "<libkinect.setthreading> cannot set the threading of Kinect ID #%d", index);
+  return 0;
+}
+
+
 /********************************
  set the LED color of the kinect
 ********************************/
@@ -138,11 +568,662 @@ static int l_tilt(lua_State *L) {
   return 0;
 }
 
+/*******************************************
+ stage timings of the last grab, in ns
+*******************************************/
+static int l_timings(lua_State *L) {
+  int index = 0;
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (index < 0 || index >= MAX_KINECTS)
+    luaL_error(L, "<libkinect.timings> invalid Kinect ID #%d", index);
+
+  const char *names[2] = {"rgb", "depth"};
+  int is_depth;
+  lua_newtable(L);
+  for (is_depth = 0; is_depth < 2; is_depth++) {
+    freenect_sync_timing timing = {0, 0};
+    freenect_sync_get_timing(&timing, index, is_depth);
+    freenect_sync_stats stats;
+    freenect_sync_get_stats(&stats, index, is_depth);
+    lua_newtable(L);
+    lua_pushnumber(L, timing.wait_ns);
+    lua_setfield(L, -2, "wait");
+    lua_pushnumber(L, timing.swap_ns);
+    lua_setfield(L, -2, "swap");
+    lua_pushnumber(L, stats.last_convert_ns);
+    lua_setfield(L, -2, "convert");
+    lua_setfield(L, -2, names[is_depth]);
+  }
+  return 1;
+}
+
+static void push_histogram(lua_State *L, freenect_sync_histogram *histogram) {
+  int i;
+  lua_newtable(L);
+  lua_pushnumber(L, histogram->count);
+  lua_setfield(L, -2, "count");
+  lua_pushnumber(L, histogram->count ? (double)histogram->sum_ns / histogram->count : 0);
+  lua_setfield(L, -2, "mean");
+  lua_pushnumber(L, histogram->max_ns);
+  lua_setfield(L, -2, "max");
+  lua_pushnumber(L, freenect_sync_histogram_percentile(histogram, 0.5));
+  lua_setfield(L, -2, "p50");
+  lua_pushnumber(L, freenect_sync_histogram_percentile(histogram, 0.99));
+  lua_setfield(L, -2, "p99");
+  // bucket i counts the values in [2^(i-1), 2^i) ns
+  lua_newtable(L);
+  for (i = 0; i < FREENECT_SYNC_HISTOGRAM_BUCKETS; i++) {
+    lua_pushnumber(L, histogram->buckets[i]);
+    lua_rawseti(L, -2, i+1);
+  }
+  lua_setfield(L, -2, "buckets");
+}
+
+/*****************************************************************
+ telemetry per stream: frame counters and wait, latency and
+ conversion histograms in ns, read without taking any lock
+*****************************************************************/
+static int l_stats(lua_State *L) {
+  int index = 0;
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (index < 0 || index >= MAX_KINECTS)
+    luaL_error(L, "<libkinect.stats> invalid Kinect ID #%d", index);
+
+  const char *names[2] = {"rgb", "depth"};
+  int is_depth;
+  lua_newtable(L);
+  for (is_depth = 0; is_depth < 2; is_depth++) {
+    freenect_sync_stats stats;
+    freenect_sync_get_stats(&stats, index, is_depth);
+    lua_newtable(L);
+    lua_pushnumber(L, stats.produced);
+    lua_setfield(L, -2, "produced");
+    lua_pushnumber(L, stats.delivered);
+    lua_setfield(L, -2, "delivered");
+    lua_pushnumber(L, stats.dropped);
+    lua_setfield(L, -2, "dropped");
+    push_histogram(L, &stats.wait);
+    lua_setfield(L, -2, "wait");
+    push_histogram(L, &stats.latency);
+    lua_setfield(L, -2, "latency");
+    push_histogram(L, &stats.convert);
+    lua_setfield(L, -2, "convert");
+    lua_setfield(L, -2, names[is_depth]);
+  }
+  return 1;
+}
+
+/*****************************
+ zero the stats of a device
+*****************************/
+static int l_reset_stats(lua_State *L) {
+  int index = 0;
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (freenect_sync_reset_stats(index))
+    luaL_error(L, "<libkinect.resetStats> invalid Kinect ID #%d", index);
+  return 0;
+}
+
+/******************************************************
+ print the stats of every stream each period seconds,
+ 0 stops
+******************************************************/
+static int l_stats_dump(lua_State *L) {
+  double period = luaL_checknumber(L, 1);
+  if (freenect_sync_set_stats_dump(period))
+    luaL_error(L, "<libkinect.statsDump> cannot dump the stats every %f s", period);
+  return 0;
+}
+
+/*****************************************************
+ produced/delivered/dropped/queued frames per stream
+*****************************************************/
+static int l_counters(lua_State *L) {
+  int index = 0;
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (index < 0 || index >= MAX_KINECTS)
+    luaL_error(L, "<libkinect.counters> invalid Kinect ID #%d", index);
+
+  const char *names[2] = {"rgb", "depth"};
+  int is_depth;
+  lua_newtable(L);
+  for (is_depth = 0; is_depth < 2; is_depth++) {
+    freenect_sync_counters counters = {0, 0, 0, 0};
+    freenect_sync_get_counters(&counters, index, is_depth);
+    lua_newtable(L);
+    lua_pushnumber(L, counters.produced);
+    lua_setfield(L, -2, "produced");
+    lua_pushnumber(L, counters.delivered);
+    lua_setfield(L, -2, "delivered");
+    lua_pushnumber(L, counters.dropped);
+    lua_setfield(L, -2, "dropped");
+    lua_pushnumber(L, counters.queued);
+    lua_setfield(L, -2, "queued");
+    lua_setfield(L, -2, names[is_depth]);
+  }
+  return 1;
+}
+
+/*****************************************************************
+ temporal filter of the depth frames: ema | median | off, with
+ hole filling from history, applied once per new frame in C
+*****************************************************************/
+static int l_set_filter(lua_State *L) {
+  int index = 0;
+  const char *mode = "ema";
+  kinect_filter_params params = {KINECT_FILTER_EMA, 0.3, 0, 5, 5};
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (lua_isstring(L, 2)) mode = lua_tostring(L, 2);
+  if (lua_isnumber(L, 3)) params.alpha = lua_tonumber(L, 3);
+  if (lua_isnumber(L, 4)) params.window = lua_tonumber(L, 4);
+  if (lua_isnumber(L, 5)) params.hold = lua_tonumber(L, 5);
+  if (index < 0 || index >= MAX_KINECTS || !kinects[index])
+    luaL_error(L, "<libkinect.setfilter> Kinect ID #%d is not initialized", index);
+  if (workers[index])
+    luaL_error(L, "<libkinect.setfilter> Kinect ID #%d converts into registered maps, unregister them first", index);
+  int mm = configs[index].depth_format == FREENECT_DEPTH_MM;
+  // about 5% of the range at 1.5 m, in disparity or in mm
+  params.jump = mm ? 75 : 12;
+  if (lua_isnumber(L, 6)) params.jump = lua_tonumber(L, 6);
+  if (!strcmp(mode, "ema")) params.mode = KINECT_FILTER_EMA;
+  else if (!strcmp(mode, "median")) params.mode = KINECT_FILTER_MEDIAN;
+  else if (strcmp(mode, "off"))
+    luaL_error(L, "<libkinect.setfilter> unknown mode %s, choose among ema, median, off", mode);
+
+  kinect_filter *filter = NULL;
+  if (strcmp(mode, "off")) {
+    filter = kinect_filter_open(640, 480, mm ? 0 : D_MAXSIZE, &params);
+    if (!filter)
+      luaL_error(L, "<libkinect.setfilter> alpha must be in (0,1], window in [1,%d] and hold in [0,254]",
+                 KINECT_FILTER_MAX_WINDOW);
+  }
+  if (configs[index].filter)
+    kinect_filter_close(configs[index].filter);
+  configs[index].filter = filter;
+  return 0;
+}
+
+/*************************************************************
+ per pixel share of the recent depth frames holding a reading,
+ 0 to 1, into a contiguous FloatTensor of 480x640 elements
+*************************************************************/
+static int l_depth_confidence(lua_State *L) {
+  int index = 0;
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  THFloatTensor *tensor = luaT_checkudata(L, 2, torch_FloatTensor_id);
+  if (index < 0 || index >= MAX_KINECTS || !configs[index].filter)
+    luaL_error(L, "<libkinect.depthConfidence> Kinect ID #%d has no depth filter", index);
+  THArgCheck(THFloatTensor_isContiguous(tensor) && THFloatTensor_nElement(tensor) == 480*640, 2,
+             "contiguous tensor of 480x640 elements expected");
+  const uint8_t *confidence = kinect_filter_confidence(configs[index].filter);
+  float *data = THFloatTensor_data(tensor);
+  long i;
+  for (i = 0; i < 480*640; i++)
+    data[i] = confidence[i] / 255.0f;
+  lua_pushvalue(L, 2);
+  return 1;
+}
+
+/****************************************************************
+ change detection of grabRGBDChanges: tiles of tile pixels whose
+ colors or depth moved more than the thresholds, 0 tile for off
+****************************************************************/
+static int l_set_changes(lua_State *L) {
+  int index = 0;
+  kinect_change_params params = {32, 8, 0, 0};
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (lua_isnumber(L, 2)) params.tile = lua_tonumber(L, 2);
+  if (lua_isnumber(L, 3)) params.rgb = lua_tonumber(L, 3);
+  if (index < 0 || index >= MAX_KINECTS || !kinects[index])
+    luaL_error(L, "<libkinect.setchanges> Kinect ID #%d is not initialized", index);
+  if (workers[index])
+    luaL_error(L, "<libkinect.setchanges> Kinect ID #%d converts into registered maps, unregister them first", index);
+  int mm = configs[index].depth_format == FREENECT_DEPTH_MM;
+  // about 2% of the range at 1.5 m, in disparity or in mm
+  params.depth = mm ? 30 : 5;
+  if (lua_isnumber(L, 4)) params.depth = lua_tonumber(L, 4);
+  params.invalid = mm ? 0 : D_MAXSIZE;
+
+  kinect_change *change = NULL;
+  if (params.tile) {
+    change = kinect_change_open(&params);
+    if (!change)
+      luaL_error(L, "<libkinect.setchanges> tile must divide 160 and be at least 8, thresholds positive");
+  }
+  if (configs[index].change)
+    kinect_change_close(configs[index].change);
+  configs[index].change = change;
+  forget_change_map(&configs[index]);
+  return 0;
+}
+
+/**************************************************************
+ descriptor readable while frames of a stream wait, to poll on
+**************************************************************/
+static int l_frame_fd(lua_State *L) {
+  int index = 0;
+  const char *stream = "depth";
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (lua_isstring(L, 2)) stream = lua_tostring(L, 2);
+  if (index < 0 || index >= MAX_KINECTS || !kinects[index])
+    luaL_error(L, "<libkinect.frameFd> Kinect ID #%d is not initialized", index);
+  if (strcmp(stream, "rgb") && strcmp(stream, "depth"))
+    luaL_error(L, "<libkinect.frameFd> unknown stream %s, choose among rgb, depth", stream);
+  int fd = freenect_sync_get_fd(index, !strcmp(stream, "depth"));
+  if (fd < 0)
+    luaL_error(L, "<libkinect.frameFd> cannot get the descriptor of Kinect ID #%d", index);
+  lua_pushnumber(L, fd);
+  return 1;
+}
+
+/*******************************************************************
+ the leases handed to Lua: each keeps a reference to its storage, a
+ storage only referenced from here was collected without a release
+*******************************************************************/
+typedef struct held_lease {
+  THByteStorage *rgb;
+  THShortStorage *depth;
+} held_lease;
+static held_lease *held[MAX_KINECTS];
+static int nheld[MAX_KINECTS];
+
+static void hold_lease(int index, THByteStorage *rgb, THShortStorage *depth) {
+  held[index] = realloc(held[index], (nheld[index] + 1) * sizeof(held_lease));
+  held[index][nheld[index]].rgb = rgb;
+  held[index][nheld[index]].depth = depth;
+  nheld[index]++;
+}
+
+/* gives the buffer of lease i back, its storage is emptied for all the tensors sharing it */
+static int return_lease(int index, int i) {
+  held_lease lease = held[index][i];
+  held[index][i] = held[index][--nheld[index]];
+  int err;
+  if (lease.rgb) {
+    err = freenect_sync_release(lease.rgb->data, index, 0);
+    lease.rgb->data = NULL;
+    lease.rgb->size = 0;
+    THByteStorage_free(lease.rgb);
+  } else {
+    err = freenect_sync_release(lease.depth->data, index, 1);
+    lease.depth->data = NULL;
+    lease.depth->size = 0;
+    THShortStorage_free(lease.depth);
+  }
+  return err;
+}
+
+/* returns the leases no tensor reaches anymore */
+static void reap_leases(int index) {
+  int i = nheld[index];
+  while (i--)
+    if ((held[index][i].rgb ? held[index][i].rgb->refcount : held[index][i].depth->refcount) == 1)
+      return_lease(index, i);
+}
+
+/*************************************************************
+ lease the raw RGB frame as a 480x640x3 ByteTensor, no copy
+*************************************************************/
+static int l_lease_rgb(lua_State *L) {
+  int index = 0;
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (index < 0 || index >= MAX_KINECTS)
+    luaL_error(L, "<libkinect.leaseRGB> invalid Kinect ID #%d", index);
+  if (workers[index])
+    luaL_error(L, "<libkinect.leaseRGB> Kinect ID #%d converts into registered maps, use swapMaps", index);
+  if (configs[index].depth_only)
+    luaL_error(L, "<libkinect.leaseRGB> Kinect ID #%d only streams depth", index);
+  reap_leases(index);
+
+  unsigned int timestamp;
+  unsigned char *data = 0;
+  if (freenect_sync_lease_video((void**)&data, &timestamp, index, FREENECT_VIDEO_RGB))
+    luaL_error(L, "<libkinect.leaseRGB> Error Kinect not connected?");
+
+  // the storage does not own the ring buffer, release or the next lease after it is collected gives it back
+  THByteStorage *storage = THByteStorage_newWithData(data, 480*640*3);
+  THByteStorage_clearFlag(storage, TH_STORAGE_FREEMEM);
+  THByteTensor *tensor = THByteTensor_newWithStorage3d(storage, 0, 480, 640*3, 640, 3, 3, 1);
+  hold_lease(index, storage, NULL);
+  luaT_pushudata(L, tensor, torch_ByteTensor_id);
+  lua_pushnumber(L, timestamp);
+  return 2;
+}
+
+/*************************************************************
+ lease the raw depth frame as a 480x640 ShortTensor, no copy
+*************************************************************/
+static int l_lease_depth(lua_State *L) {
+  int index = 0;
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (index < 0 || index >= MAX_KINECTS)
+    luaL_error(L, "<libkinect.leaseDepth> invalid Kinect ID #%d", index);
+  if (workers[index])
+    luaL_error(L, "<libkinect.leaseDepth> Kinect ID #%d converts into registered maps, use swapMaps", index);
+  reap_leases(index);
+
+  unsigned int timestamp;
+  short *data = 0;
+  if (freenect_sync_lease_depth((void**)&data, &timestamp, index, configs[index].depth_format))
+    luaL_error(L, "<libkinect.leaseDepth> Error Kinect not connected?");
+
+  THShortStorage *storage = THShortStorage_newWithData(data, 480*640);
+  THShortStorage_clearFlag(storage, TH_STORAGE_FREEMEM);
+  THShortTensor *tensor = THShortTensor_newWithStorage2d(storage, 0, 480, 640, 640, 1);
+  hold_lease(index, NULL, storage);
+  luaT_pushudata(L, tensor, torch_ShortTensor_id);
+  lua_pushnumber(L, timestamp);
+  return 2;
+}
+
+/*****************************************************************
+ give a leased frame back, every tensor sharing its storage is
+ emptied
+*****************************************************************/
+static int l_release(lua_State *L) {
+  int index = 0;
+  if (lua_isnumber(L, 2)) index = lua_tonumber(L, 2);
+  THByteTensor *rgb = luaT_toudata(L, 1, torch_ByteTensor_id);
+  THShortTensor *depth = luaT_toudata(L, 1, torch_ShortTensor_id);
+  if (!rgb && !depth)
+    luaL_error(L, "<libkinect.release> tensor from leaseRGB or leaseDepth expected");
+
+  if (index < 0 || index >= MAX_KINECTS)
+    luaL_error(L, "<libkinect.release> invalid Kinect ID #%d", index);
+
+  // a lease is one of the storages held for the device
+  int i = nheld[index];
+  while (i-- && (rgb ? (!rgb->storage || held[index][i].rgb != rgb->storage)
+                     : (!depth->storage || held[index][i].depth != depth->storage)))
+    ;
+  if (i < 0 || return_lease(index, i))
+    luaL_error(L, "<libkinect.release> this tensor holds no lease of Kinect ID #%d", index);
+
+  // the memory is back in the ring, the storage can't reach it anymore
+  if (rgb)
+    rgb->nDimension = 0;
+  else
+    depth->nDimension = 0;
+  reap_leases(index);
+  return 0;
+}
+
+/************************************************
+ get or force the conversion kernel in use
+************************************************/
+static int l_kernel(lua_State *L) {
+  if (lua_isstring(L, 1) && kinect_convert_set_kernel(lua_tostring(L, 1)))
+    luaL_error(L, "<libkinect.kernel> kernel %s is unknown or not supported", lua_tostring(L, 1));
+  lua_pushstring(L, kinect_convert_kernel());
+  return 1;
+}
+
+/********************************************************
+ check the conversion kernels against the scalar code
+********************************************************/
+static int l_testconvert(lua_State *L) {
+  lua_pushnumber(L, kinect_convert_selftest());
+  return 1;
+}
+
+/************************************************************************
+ swap in the map the worker converted last, wait up to timeout ms for it
+************************************************************************/
+static int l_swap_maps(lua_State *L) {
+  int index = 0;
+  int timeout = -1;
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (lua_isnumber(L, 2)) timeout = lua_tonumber(L, 2);
+  if (index < 0 || index >= MAX_KINECTS || !workers[index])
+    luaL_error(L, "<libkinect.swapMaps> no maps registered with Kinect ID #%d", index);
+
+  kinect_worker *worker = workers[index];
+  struct timespec deadline;
+  if (timeout > 0) {
+    uint64_t end = clock_ns() + timeout * 1000000ull;
+    deadline.tv_sec = end / 1000000000ull;
+    deadline.tv_nsec = end % 1000000000ull;
+  }
+  pthread_mutex_lock(&worker->lock);
+  int late = 0;
+  while (!worker->ready && !worker->failed && !late) {
+    if (timeout < 0)
+      pthread_cond_wait(&worker->cond, &worker->lock);
+    else if (!timeout || pthread_cond_timedwait(&worker->cond, &worker->lock, &deadline) == ETIMEDOUT)
+      late = 1;
+  }
+  bool isNew = worker->ready;
+  if (isNew) {
+    worker->front = 1 - worker->front;
+    worker->ready = false;
+  }
+  int front = worker->front;
+  unsigned int timestampRGB = worker->timestamps[front][0];
+  unsigned int timestampD = worker->timestamps[front][1];
+  bool failed = worker->failed;
+  pthread_mutex_unlock(&worker->lock);
+  if (failed)
+    luaL_error(L, "<libkinect.swapMaps> Error Kinect not connected?");
+  // the worker kept writing into the data captured at registration
+  if (worker->moved(worker->maps[front]))
+    luaL_error(L, "<libkinect.swapMaps> map %d of Kinect ID #%d was resized or set since registerMaps",
+               front + 1, index);
+
+  // return which map (1 or 2) holds the frame, its timestamps and if it is new
+  lua_pushnumber(L, front + 1);
+  lua_pushnumber(L, timestampRGB);
+  lua_pushnumber(L, timestampD);
+  lua_pushboolean(L, isNew);
+  return 4;
+}
+
+/**********************************************
+ stop converting into the registered maps
+**********************************************/
+static int l_unregister_maps(lua_State *L) {
+  int index = 0;
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (index < 0 || index >= MAX_KINECTS)
+    luaL_error(L, "<libkinect.unregisterMaps> invalid Kinect ID #%d", index);
+  stop_worker(index);
+  return 0;
+}
+
+/* recordings in progress, see record */
+static kinect_recorder *recorders[MAX_KINECTS] = {};
+
+static void push_record_stats(lua_State *L, kinect_record_stats *stats) {
+  const char *names[2] = {"rgb", "depth"};
+  int is_depth;
+  lua_newtable(L);
+  for (is_depth = 0; is_depth < 2; is_depth++) {
+    lua_newtable(L);
+    lua_pushnumber(L, stats->frames[is_depth]);
+    lua_setfield(L, -2, "frames");
+    lua_pushnumber(L, stats->dropped[is_depth]);
+    lua_setfield(L, -2, "dropped");
+    lua_setfield(L, -2, names[is_depth]);
+  }
+  lua_pushnumber(L, stats->bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, stats->encode_ns);
+  lua_setfield(L, -2, "encode");
+}
+
+/* finish the recording of a device, if any, nonzero if the file is incomplete */
+static int stop_recorder(int index, kinect_record_stats *stats) {
+  kinect_recorder *rec = recorders[index];
+  if (!rec)
+    return 0;
+  recorders[index] = NULL;
+  return kinect_record_close(rec, stats);
+}
+
+/***********************************************************
+ record every frame of a device into a file, raw RGB and
+ coded depth, written on a thread of its own: the grab
+ functions go on as usual
+***********************************************************/
+static int l_record(lua_State *L) {
+  int index = 0;
+  int slots = 16;
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  if (lua_isnumber(L, 3)) slots = lua_tonumber(L, 3);
+  if (index < 0 || index >= MAX_KINECTS)
+    luaL_error(L, "<libkinect.record> invalid Kinect ID #%d", index);
+  if (recorders[index])
+    luaL_error(L, "<libkinect.record> Kinect ID #%d is already recording", index);
+  recorders[index] = kinect_record_open(path, index, slots);
+  if (!recorders[index])
+    luaL_error(L, "<libkinect.record> cannot record Kinect ID #%d into %s", index, path);
+  return 0;
+}
+
+/*****************************************************
+ counters of the recording of a device, nil if none
+*****************************************************/
+static int l_record_stats(lua_State *L) {
+  int index = 0;
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (index < 0 || index >= MAX_KINECTS)
+    luaL_error(L, "<libkinect.recordStats> invalid Kinect ID #%d", index);
+  if (!recorders[index])
+    return 0;
+  kinect_record_stats stats;
+  kinect_record_get_stats(recorders[index], &stats);
+  push_record_stats(L, &stats);
+  return 1;
+}
+
+/*******************************************************
+ write the frames waiting and the index, close the file
+*******************************************************/
+static int l_stop_record(lua_State *L) {
+  int index = 0;
+  if (lua_isnumber(L, 1)) index = lua_tonumber(L, 1);
+  if (index < 0 || index >= MAX_KINECTS)
+    luaL_error(L, "<libkinect.stopRecord> invalid Kinect ID #%d", index);
+  if (!recorders[index])
+    luaL_error(L, "<libkinect.stopRecord> Kinect ID #%d is not recording", index);
+  kinect_record_stats stats;
+  if (stop_recorder(index, &stats))
+    luaL_error(L, "<libkinect.stopRecord> the recording of Kinect ID #%d is incomplete, disk full?", index);
+  push_record_stats(L, &stats);
+  return 1;
+}
+
+/***************************************************************
+ open a recording for random access: the read functions convert
+ its frames with the depth settings given here, as newdevice
+ would set them for a device
+***************************************************************/
+static int l_open_recording(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  const char *depth = "raw";
+  if (lua_isstring(L, 2)) depth = lua_tostring(L, 2);
+  bool registered = lua_toboolean(L, 3);
+
+  kinect_reader *reader = (kinect_reader *)lua_newuserdata(L, sizeof(kinect_reader));
+  memset(reader, 0, sizeof(kinect_reader));
+  reader->config.index = -1;
+  luaL_getmetatable(L, "libkinect.recording");
+  lua_setmetatable(L, -2);
+  configure_depth(L, &reader->config, depth, registered, "openRecording");
+  reader->playback = kinect_playback_open(path);
+  if (!reader->playback)
+    luaL_error(L, "<libkinect.openRecording> cannot open recording %s", path);
+  return 1;
+}
+
+static int reader_stream(lua_State *L, int arg, const char *fn) {
+  const char *stream = "rgb";
+  if (lua_isstring(L, arg)) stream = lua_tostring(L, arg);
+  if (strcmp(stream, "rgb") && strcmp(stream, "depth"))
+    luaL_error(L, "<libkinect.%s> unknown stream %s, choose among rgb, depth", fn, stream);
+  return !strcmp(stream, "depth");
+}
+
+/* frames of a stream of a recording */
+static int l_reader_count(lua_State *L) {
+  kinect_reader *reader = check_reader(L, 1, "count");
+  lua_pushnumber(L, kinect_playback_count(reader->playback, reader_stream(L, 2, "count")));
+  return 1;
+}
+
+/* seconds between the first and the last frame */
+static int l_reader_duration(lua_State *L) {
+  kinect_reader *reader = check_reader(L, 1, "duration");
+  lua_pushnumber(L, kinect_playback_duration(reader->playback));
+  return 1;
+}
+
+/* frame of a stream closest to seconds into the recording, nil if the stream is empty */
+static int l_reader_find(lua_State *L) {
+  kinect_reader *reader = check_reader(L, 1, "find");
+  double seconds = luaL_checknumber(L, 2);
+  long n = kinect_playback_find(reader->playback, reader_stream(L, 3, "find"), seconds);
+  if (n < 0)
+    return 0;
+  lua_pushnumber(L, n + 1);
+  return 1;
+}
+
+/* seconds into the recording of frame n of a stream */
+static int l_reader_time(lua_State *L) {
+  kinect_reader *reader = check_reader(L, 1, "time");
+  long n = luaL_checknumber(L, 2);
+  double seconds = kinect_playback_time(reader->playback, reader_stream(L, 3, "time"), n - 1);
+  if (seconds < 0)
+    luaL_error(L, "<libkinect.time> the recording has no frame #%d", (int)n);
+  lua_pushnumber(L, seconds);
+  return 1;
+}
+
+/* unmap the recording, also on garbage collection */
+static int l_reader_close(lua_State *L) {
+  kinect_reader *reader = luaL_checkudata(L, 1, "libkinect.recording");
+  if (reader->playback)
+    kinect_playback_close(reader->playback);
+  reader->playback = NULL;
+  free(reader->config.registration);
+  free(reader->config.zbuffer);
+  reader->config.registration = NULL;
+  reader->config.zbuffer = NULL;
+  return 0;
+}
+
+static int l_reader_tostring(lua_State *L) {
+  kinect_reader *reader = luaL_checkudata(L, 1, "libkinect.recording");
+  if (reader->playback)
+    lua_pushfstring(L, "Recording of %d rgb and %d depth frames.",
+                    (int)kinect_playback_count(reader->playback, 0), (int)kinect_playback_count(reader->playback, 1));
+  else
+    lua_pushliteral(L, "Recording closed.");
+  return 1;
+}
+
+static const luaL_reg Recording_meta[] = {
+  {"count",      l_reader_count},
+  {"duration",   l_reader_duration},
+  {"find",       l_reader_find},
+  {"time",       l_reader_time},
+  {"close",      l_reader_close},
+  {"__gc",       l_reader_close},
+  {"__tostring", l_reader_tostring},
+  {NULL, NULL}  /* sentinel */
+};
+
 /******************************
  stop the global thread
 ******************************/
 static int l_stop(lua_State *L) {
   int i;
+  // the workers would set the devices up again
+  for (i = 0; i < MAX_KINECTS; ++i) {
+    stop_worker(i);
+    stop_recorder(i, NULL);
+  }
   for (i = 0; i < MAX_KINECTS; ++i) {
     kinect_userdata *kinect = kinects[i];
     if (kinect) { // shut down
@@ -166,6 +1247,8 @@ static int l_gc(lua_State *L) {
     printf("Turning Kinect ID #%d off...\n", kinect->index);
     kinect->ison = false;
     kinect->led = 0;
+    stop_worker(kinect->index);
+    stop_recorder(kinect->index, NULL);
     freenect_sync_set_led(kinect->led,kinect->index);
     freenect_sync_stop();
   }
@@ -194,8 +1277,31 @@ static const luaL_reg Kinect_meta[] = {
 *******************/
 static const struct luaL_reg kinect [] = {
   {"newdevice", l_init_kinect},
+  {"setsource", l_set_source},
+  {"setring", l_set_ring},
+  {"setthreading", l_set_threading},
   {"led", l_led},
   {"tilt", l_tilt},
+  {"timings", l_timings},
+  {"counters", l_counters},
+  {"frameFd", l_frame_fd},
+  {"setfilter", l_set_filter},
+  {"depthConfidence", l_depth_confidence},
+  {"setchanges", l_set_changes},
+  {"stats", l_stats},
+  {"resetStats", l_reset_stats},
+  {"statsDump", l_stats_dump},
+  {"leaseRGB", l_lease_rgb},
+  {"leaseDepth", l_lease_depth},
+  {"release", l_release},
+  {"kernel", l_kernel},
+  {"testconvert", l_testconvert},
+  {"swapMaps", l_swap_maps},
+  {"unregisterMaps", l_unregister_maps},
+  {"record", l_record},
+  {"recordStats", l_record_stats},
+  {"stopRecord", l_stop_record},
+  {"openRecording", l_open_recording},
   {"stop", l_stop},
   {NULL, NULL}  /* sentinel */
 };
@@ -215,14 +1321,32 @@ DLL_EXPORT int luaopen_libkinect(lua_State * L) {
                              metatable.__metatable = methods */
   lua_pop(L, 1);         /* drop metatable */
 
+  /* recordings are their own methods table */
+  luaL_newmetatable(L, "libkinect.recording");
+  luaL_openlib(L, 0, Recording_meta, 0);
+  lua_pushliteral(L, "__index");
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -3);      /* metatable.__index = metatable */
+  lua_pop(L, 1);
+
+  int i;
+  for (i = 0; i < MAX_KINECTS; i++)
+    configs[i].index = i;
+
   torch_FloatTensor_id = luaT_checktypename2id(L, "torch.FloatTensor");
   torch_DoubleTensor_id = luaT_checktypename2id(L, "torch.DoubleTensor");
+  torch_ByteTensor_id = luaT_checktypename2id(L, "torch.ByteTensor");
+  torch_ShortTensor_id = luaT_checktypename2id(L, "torch.ShortTensor");
 
   libkinect_FloatMain_init(L);
   libkinect_DoubleMain_init(L);
+  libkinect_ByteMain_init(L);
+  libkinect_ShortMain_init(L);
 
   luaL_register(L, "libkinect.double", libkinect_DoubleMain__);
   luaL_register(L, "libkinect.float", libkinect_FloatMain__);
+  luaL_register(L, "libkinect.byte", libkinect_ByteMain__);
+  luaL_register(L, "libkinect.short", libkinect_ShortMain__);
 
 
   return 1;
@@ -0,0 +1,213 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ *
+ * Change detection between the frames of a device and a reference, per tile
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "kinect_change.h"
+
+#define WIDTH KINECT_CHANGE_WIDTH
+#define HEIGHT KINECT_CHANGE_HEIGHT
+
+struct kinect_change {
+	kinect_change_params params;
+	int cols, rows; // Tiles per row, rows of tiles
+	unsigned char *rgb; // The reference
+	uint16_t *depth;
+	int empty; // There is no reference, every tile changes
+	uint8_t *mask;
+	int *open; // Rectangle each run of the row of tiles above starts, -1 if none
+	int *next;
+	kinect_change_region *regions; // Rectangles of the last kinect_change_regions, one per tile at most
+};
+
+/* the sums of a row of tiles, per column */
+typedef struct sums {
+	uint16_t rgb[WIDTH * 3];
+	uint32_t depth[WIDTH];
+	uint16_t flips[WIDTH];
+} sums_t;
+
+kinect_change *kinect_change_open(const kinect_change_params *params)
+{
+	int t = params->tile;
+	if (t < 8 || 160 % t || params->rgb < 0 || params->depth < 0)
+		return NULL;
+	kinect_change *change = (kinect_change *)calloc(1, sizeof(kinect_change));
+	change->params = *params;
+	change->cols = WIDTH / t;
+	change->rows = HEIGHT / t;
+	change->rgb = (unsigned char *)malloc(WIDTH * HEIGHT * 3);
+	change->depth = (uint16_t *)malloc(WIDTH * HEIGHT * sizeof(uint16_t));
+	change->mask = (uint8_t *)calloc(change->cols * change->rows, 1);
+	change->open = (int *)malloc(change->cols * sizeof(int));
+	change->next = (int *)malloc(change->cols * sizeof(int));
+	change->regions = (kinect_change_region *)malloc(change->cols * change->rows * sizeof(kinect_change_region));
+	change->empty = 1;
+	return change;
+}
+
+void kinect_change_close(kinect_change *change)
+{
+	free(change->rgb);
+	free(change->depth);
+	free(change->mask);
+	free(change->open);
+	free(change->next);
+	free(change->regions);
+	free(change);
+}
+
+void kinect_change_reset(kinect_change *change)
+{
+	change->empty = 1;
+}
+
+/*
+  Add the differences of a row of the frame with the reference to the sums.
+  The loops have a constant trip count, no branch, and the sums are restrict,
+  out of reach of the frames, so that they are vectorized.
+*/
+static inline void sum_row(sums_t *restrict sums, const unsigned char *rgb, const unsigned char *reference,
+                           const uint16_t *depth, const uint16_t *depth_reference, uint16_t invalid)
+{
+	int i;
+	for (i = 0; i < WIDTH * 3; ++i)
+		sums->rgb[i] += rgb[i] > reference[i] ? rgb[i] - reference[i] : reference[i] - rgb[i];
+	for (i = 0; i < WIDTH; ++i) {
+		int valid = depth[i] != invalid, was_valid = depth_reference[i] != invalid;
+		int delta = depth[i] - depth_reference[i];
+		sums->depth[i] += (delta < 0 ? -delta : delta) & -(valid & was_valid);
+		sums->flips[i] += valid ^ was_valid;
+	}
+}
+
+/* Decide the tiles of a row of tiles from the sums of its columns */
+static int changed_tiles(kinect_change *change, const sums_t *sums, uint8_t *mask)
+{
+	int t = change->params.tile;
+	uint64_t area = (uint64_t)t * t;
+	int changed = 0;
+	int tx, x;
+	for (tx = 0; tx < change->cols; ++tx) {
+		uint64_t rgb = 0, depth = 0, flips = 0;
+		for (x = tx * t; x < (tx + 1) * t; ++x) {
+			rgb += sums->rgb[3 * x] + sums->rgb[3 * x + 1] + sums->rgb[3 * x + 2];
+			depth += sums->depth[x];
+			flips += sums->flips[x];
+		}
+		mask[tx] = rgb > 3 * area * change->params.rgb || depth > area * change->params.depth || 4 * flips > area;
+		changed += mask[tx];
+	}
+	return changed;
+}
+
+int kinect_change_detect(kinect_change *change, const unsigned char *rgb, const uint16_t *depth)
+{
+	int t = change->params.tile;
+	sums_t sums;
+	int changed = 0;
+	int tx, ty, y;
+	for (ty = 0; ty < change->rows; ++ty) {
+		uint8_t *mask = change->mask + ty * change->cols;
+		long first = (long)ty * t * WIDTH;
+		if (change->empty) {
+			memset(mask, 1, change->cols);
+			changed += change->cols;
+		} else {
+			memset(&sums, 0, sizeof(sums));
+			for (y = 0; y < t; ++y) {
+				long row = first + (long)y * WIDTH;
+				sum_row(&sums, rgb + 3 * row, change->rgb + 3 * row, depth + row, change->depth + row,
+				        change->params.invalid);
+			}
+			changed += changed_tiles(change, &sums, mask);
+		}
+		// the reference follows the changed tiles, while the rows are still in the cache
+		for (y = 0; y < t; ++y) {
+			long row = first + (long)y * WIDTH;
+			for (tx = 0; tx < change->cols; ++tx) {
+				if (!mask[tx])
+					continue;
+				long pixel = row + (long)tx * t;
+				int run = 1;
+				while (tx + run < change->cols && mask[tx + run])
+					++run;
+				memcpy(change->rgb + 3 * pixel, rgb + 3 * pixel, 3 * run * t);
+				memcpy(change->depth + pixel, depth + pixel, run * t * sizeof(uint16_t));
+				tx += run - 1;
+			}
+		}
+	}
+	change->empty = 0;
+	return changed;
+}
+
+const kinect_change_region *kinect_change_regions(kinect_change *change, int *count)
+{
+	kinect_change_region *regions = change->regions;
+	int t = change->params.tile;
+	int n = 0;
+	int tx, ty;
+	for (tx = 0; tx < change->cols; ++tx)
+		change->open[tx] = -1;
+	for (ty = 0; ty < change->rows; ++ty) {
+		const uint8_t *mask = change->mask + ty * change->cols;
+		for (tx = 0; tx < change->cols; ++tx)
+			change->next[tx] = -1;
+		for (tx = 0; tx < change->cols; ++tx) {
+			if (!mask[tx])
+				continue;
+			int start = tx;
+			while (tx + 1 < change->cols && mask[tx + 1])
+				++tx;
+			int r = change->open[start];
+			if (r >= 0 && regions[r].w == (tx + 1 - start) * t) {
+				regions[r].h += t;
+			} else {
+				r = n++;
+				regions[r].x = start * t;
+				regions[r].y = ty * t;
+				regions[r].w = (tx + 1 - start) * t;
+				regions[r].h = t;
+			}
+			change->next[start] = r;
+		}
+		int *open = change->open;
+		change->open = change->next;
+		change->next = open;
+	}
+	*count = n;
+	return regions;
+}
+
+const uint8_t *kinect_change_mask(kinect_change *change, int *cols, int *rows)
+{
+	*cols = change->cols;
+	*rows = change->rows;
+	return change->mask;
+}
@@ -0,0 +1,103 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ *
+ * Change detection between the frames of a device and a reference, per tile
+ */
+
+#ifndef KINECT_CHANGE_H
+#define KINECT_CHANGE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the frames compared are 640x480: 24-bit RGB and 16-bit depth */
+#define KINECT_CHANGE_WIDTH 640
+#define KINECT_CHANGE_HEIGHT 480
+
+typedef struct {
+	int tile;      /* side of the square tiles in pixels, at least 8, dividing 160 (8, 10, 16, 20, 32, 40, 80, 160) */
+	int rgb;       /* a tile changes if its colors moved more than this per channel, on average */
+	int depth;     /* or if its depth moved more than this per pixel, on average, in the units of the frames */
+	uint16_t invalid; /* the depth of pixels without reading, 2047 for the 11-bit disparity and 0 for mm */
+} kinect_change_params;
+
+typedef struct {
+	int x, y;      /* top left pixel, from 0 */
+	int w, h;
+} kinect_change_region;
+
+typedef struct kinect_change kinect_change;
+
+kinect_change *kinect_change_open(const kinect_change_params *params);
+/*  State of the change detection of a device, without reference: the first frame changes every tile
+
+    Returns:
+        The state, NULL if the parameters are out of range.
+*/
+
+void kinect_change_close(kinect_change *change);
+
+int kinect_change_detect(kinect_change *change, const unsigned char *rgb, const uint16_t *depth);
+/*  Compare a frame with the reference, in a single pass, and move the changed tiles of the reference to it
+
+    The reference only follows the tiles that changed, so a slow drift below the thresholds is never
+    reported: kinect_change_reset forces a whole frame. Pixels gaining or losing their reading count
+    as a change when they are more than a quarter of a tile.
+
+    Returns:
+        The number of tiles that changed.
+*/
+
+void kinect_change_reset(kinect_change *change);
+/*  The next frame changes every tile */
+
+const kinect_change_region *kinect_change_regions(kinect_change *change, int *count);
+/*  The tiles the last kinect_change_detect found changed, merged into rectangles
+
+    Runs of changed tiles along a row of tiles make a rectangle, which grows down while the row below
+    has the same run. The rectangles are kept in the state until the next call.
+
+    Args:
+        count: Populated with the number of rectangles
+
+    Returns:
+        The rectangles.
+*/
+
+const uint8_t *kinect_change_mask(kinect_change *change, int *cols, int *rows);
+/*  The tiles of the last kinect_change_detect, row by row, 1 where they changed
+
+    Args:
+        cols, rows: Populated with the tiles per row and the rows of tiles
+*/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,406 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ *
+ * Frame conversion kernels, picked at runtime among AVX2, SSE2 and scalar
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kinect_convert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KINECT_CONVERT_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*rgb_planar_float_t)(const unsigned char *rgb, float *r, float *g, float *b, long n);
+typedef void (*rgb_planar_double_t)(const unsigned char *rgb, double *r, double *g, double *b, long n);
+typedef void (*rgb_planar_byte_t)(const unsigned char *rgb, unsigned char *r, unsigned char *g, unsigned char *b, long n);
+typedef void (*rgb_planar_short_t)(const unsigned char *rgb, short *r, short *g, short *b, long n);
+
+typedef struct kernel {
+	const char *name;
+	int (*supported)(void);
+	rgb_planar_float_t rgb_float;
+	rgb_planar_double_t rgb_double;
+	rgb_planar_byte_t rgb_byte;
+	rgb_planar_short_t rgb_short;
+} kernel_t;
+
+/*******************************************************
+ scalar: one table lookup per value, same division
+*******************************************************/
+static float lut_float[256];
+static double lut_double[256];
+
+static void init_luts(void)
+{
+	int v;
+	for (v = 0; v < 256; ++v) {
+		lut_float[v] = ((float)v) / 255;
+		lut_double[v] = ((double)v) / 255;
+	}
+}
+
+static int scalar_supported(void)
+{
+	return 1;
+}
+
+static void scalar_rgb_float(const unsigned char *rgb, float *r, float *g, float *b, long n)
+{
+	long i;
+	for (i = 0; i < n; ++i, rgb += 3) {
+		r[i] = lut_float[rgb[0]];
+		g[i] = lut_float[rgb[1]];
+		b[i] = lut_float[rgb[2]];
+	}
+}
+
+static void scalar_rgb_double(const unsigned char *rgb, double *r, double *g, double *b, long n)
+{
+	long i;
+	for (i = 0; i < n; ++i, rgb += 3) {
+		r[i] = lut_double[rgb[0]];
+		g[i] = lut_double[rgb[1]];
+		b[i] = lut_double[rgb[2]];
+	}
+}
+
+static void scalar_rgb_byte(const unsigned char *rgb, unsigned char *r, unsigned char *g, unsigned char *b, long n)
+{
+	long i;
+	for (i = 0; i < n; ++i, rgb += 3) {
+		r[i] = rgb[0];
+		g[i] = rgb[1];
+		b[i] = rgb[2];
+	}
+}
+
+static void scalar_rgb_short(const unsigned char *rgb, short *r, short *g, short *b, long n)
+{
+	long i;
+	for (i = 0; i < n; ++i, rgb += 3) {
+		r[i] = rgb[0];
+		g[i] = rgb[1];
+		b[i] = rgb[2];
+	}
+}
+
+#ifdef KINECT_CONVERT_X86
+/* NOTE: multiplying by 1/255 differs from the division on 126 of the 256
+   float values, the kernels divide to stay bit-for-bit with the scalar path */
+
+/*******************************************************
+ sse2: 4 pixels per step, transposed with shuffles
+*******************************************************/
+static int sse2_supported(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+/* loads 4 RGB pixels as 12 int32: a = r0 g0 b0 r1, b = g1 b1 r2 g2, c = b2 r3 g3 b3,
+   then transposes them into one vector per channel */
+__attribute__((target("sse2")))
+static inline void sse2_load4(const unsigned char *rgb, __m128i *r, __m128i *g, __m128i *b)
+{
+	int tail;
+	memcpy(&tail, rgb + 8, 4);
+	__m128i zero = _mm_setzero_si128();
+	__m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)rgb), _mm_cvtsi32_si128(tail));
+	__m128i lo = _mm_unpacklo_epi8(v, zero);
+	__m128i hi = _mm_unpackhi_epi8(v, zero);
+	__m128 a = _mm_castsi128_ps(_mm_unpacklo_epi16(lo, zero));
+	__m128 bb = _mm_castsi128_ps(_mm_unpackhi_epi16(lo, zero));
+	__m128 c = _mm_castsi128_ps(_mm_unpacklo_epi16(hi, zero));
+	__m128 t;
+	t = _mm_shuffle_ps(bb, c, _MM_SHUFFLE(1, 1, 2, 2));
+	*r = _mm_castps_si128(_mm_shuffle_ps(a, t, _MM_SHUFFLE(2, 0, 3, 0)));
+	t = _mm_shuffle_ps(bb, c, _MM_SHUFFLE(2, 2, 3, 3));
+	*g = _mm_castps_si128(_mm_shuffle_ps(_mm_shuffle_ps(a, bb, _MM_SHUFFLE(0, 0, 1, 1)), t, _MM_SHUFFLE(2, 0, 2, 0)));
+	t = _mm_shuffle_ps(a, bb, _MM_SHUFFLE(1, 1, 2, 2));
+	*b = _mm_castps_si128(_mm_shuffle_ps(t, c, _MM_SHUFFLE(3, 0, 2, 0)));
+}
+
+__attribute__((target("sse2")))
+static void sse2_rgb_float(const unsigned char *rgb, float *r, float *g, float *b, long n)
+{
+	const __m128 scale = _mm_set1_ps(255);
+	long i;
+	for (i = 0; i + 4 <= n; i += 4, rgb += 12) {
+		__m128i vr, vg, vb;
+		sse2_load4(rgb, &vr, &vg, &vb);
+		_mm_storeu_ps(r + i, _mm_div_ps(_mm_cvtepi32_ps(vr), scale));
+		_mm_storeu_ps(g + i, _mm_div_ps(_mm_cvtepi32_ps(vg), scale));
+		_mm_storeu_ps(b + i, _mm_div_ps(_mm_cvtepi32_ps(vb), scale));
+	}
+	scalar_rgb_float(rgb, r + i, g + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static inline void sse2_store4_double(double *dst, __m128i v, __m128d scale)
+{
+	_mm_storeu_pd(dst, _mm_div_pd(_mm_cvtepi32_pd(v), scale));
+	_mm_storeu_pd(dst + 2, _mm_div_pd(_mm_cvtepi32_pd(_mm_srli_si128(v, 8)), scale));
+}
+
+__attribute__((target("sse2")))
+static void sse2_rgb_double(const unsigned char *rgb, double *r, double *g, double *b, long n)
+{
+	const __m128d scale = _mm_set1_pd(255);
+	long i;
+	for (i = 0; i + 4 <= n; i += 4, rgb += 12) {
+		__m128i vr, vg, vb;
+		sse2_load4(rgb, &vr, &vg, &vb);
+		sse2_store4_double(r + i, vr, scale);
+		sse2_store4_double(g + i, vg, scale);
+		sse2_store4_double(b + i, vb, scale);
+	}
+	scalar_rgb_double(rgb, r + i, g + i, b + i, n - i);
+}
+
+/*******************************************************
+ avx2: 16 pixels per step, deinterleaved with pshufb
+*******************************************************/
+static int avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+/* shuffle masks picking channel c out of the k-th 16 bytes of 16 pixels */
+static unsigned char avx2_masks[3][3][16];
+
+static void init_avx2_masks(void)
+{
+	int c, k, i;
+	for (c = 0; c < 3; ++c)
+		for (k = 0; k < 3; ++k)
+			for (i = 0; i < 16; ++i) {
+				int src = 3 * i + c - 16 * k;
+				avx2_masks[c][k][i] = (src >= 0 && src < 16) ? src : 0x80;
+			}
+}
+
+__attribute__((target("avx2")))
+static inline __m128i avx2_channel(__m128i a, __m128i b, __m128i c, int ch)
+{
+	__m128i va = _mm_shuffle_epi8(a, _mm_loadu_si128((const __m128i *)avx2_masks[ch][0]));
+	__m128i vb = _mm_shuffle_epi8(b, _mm_loadu_si128((const __m128i *)avx2_masks[ch][1]));
+	__m128i vc = _mm_shuffle_epi8(c, _mm_loadu_si128((const __m128i *)avx2_masks[ch][2]));
+	return _mm_or_si128(_mm_or_si128(va, vb), vc);
+}
+
+__attribute__((target("avx2")))
+static inline void avx2_store16_float(float *dst, __m128i v, __m256 scale)
+{
+	_mm256_storeu_ps(dst, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)), scale));
+	_mm256_storeu_ps(dst + 8, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(v, 8))), scale));
+}
+
+__attribute__((target("avx2")))
+static void avx2_rgb_float(const unsigned char *rgb, float *r, float *g, float *b, long n)
+{
+	const __m256 scale = _mm256_set1_ps(255);
+	long i;
+	for (i = 0; i + 16 <= n; i += 16, rgb += 48) {
+		__m128i a = _mm_loadu_si128((const __m128i *)rgb);
+		__m128i bb = _mm_loadu_si128((const __m128i *)(rgb + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(rgb + 32));
+		avx2_store16_float(r + i, avx2_channel(a, bb, c, 0), scale);
+		avx2_store16_float(g + i, avx2_channel(a, bb, c, 1), scale);
+		avx2_store16_float(b + i, avx2_channel(a, bb, c, 2), scale);
+	}
+	sse2_rgb_float(rgb, r + i, g + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline void avx2_store16_double(double *dst, __m128i v, __m256d scale)
+{
+	int k;
+	for (k = 0; k < 4; ++k, v = _mm_srli_si128(v, 4))
+		_mm256_storeu_pd(dst + 4 * k, _mm256_div_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(v)), scale));
+}
+
+__attribute__((target("avx2")))
+static void avx2_rgb_double(const unsigned char *rgb, double *r, double *g, double *b, long n)
+{
+	const __m256d scale = _mm256_set1_pd(255);
+	long i;
+	for (i = 0; i + 16 <= n; i += 16, rgb += 48) {
+		__m128i a = _mm_loadu_si128((const __m128i *)rgb);
+		__m128i bb = _mm_loadu_si128((const __m128i *)(rgb + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(rgb + 32));
+		avx2_store16_double(r + i, avx2_channel(a, bb, c, 0), scale);
+		avx2_store16_double(g + i, avx2_channel(a, bb, c, 1), scale);
+		avx2_store16_double(b + i, avx2_channel(a, bb, c, 2), scale);
+	}
+	sse2_rgb_double(rgb, r + i, g + i, b + i, n - i);
+}
+
+/* the integer planes need no conversion, the shuffles are the whole work */
+__attribute__((target("avx2")))
+static void avx2_rgb_byte(const unsigned char *rgb, unsigned char *r, unsigned char *g, unsigned char *b, long n)
+{
+	long i;
+	for (i = 0; i + 16 <= n; i += 16, rgb += 48) {
+		__m128i a = _mm_loadu_si128((const __m128i *)rgb);
+		__m128i bb = _mm_loadu_si128((const __m128i *)(rgb + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(rgb + 32));
+		_mm_storeu_si128((__m128i *)(r + i), avx2_channel(a, bb, c, 0));
+		_mm_storeu_si128((__m128i *)(g + i), avx2_channel(a, bb, c, 1));
+		_mm_storeu_si128((__m128i *)(b + i), avx2_channel(a, bb, c, 2));
+	}
+	scalar_rgb_byte(rgb, r + i, g + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_rgb_short(const unsigned char *rgb, short *r, short *g, short *b, long n)
+{
+	long i;
+	for (i = 0; i + 16 <= n; i += 16, rgb += 48) {
+		__m128i a = _mm_loadu_si128((const __m128i *)rgb);
+		__m128i bb = _mm_loadu_si128((const __m128i *)(rgb + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(rgb + 32));
+		_mm256_storeu_si256((__m256i *)(r + i), _mm256_cvtepu8_epi16(avx2_channel(a, bb, c, 0)));
+		_mm256_storeu_si256((__m256i *)(g + i), _mm256_cvtepu8_epi16(avx2_channel(a, bb, c, 1)));
+		_mm256_storeu_si256((__m256i *)(b + i), _mm256_cvtepu8_epi16(avx2_channel(a, bb, c, 2)));
+	}
+	scalar_rgb_short(rgb, r + i, g + i, b + i, n - i);
+}
+#endif
+
+/* best first, sse2 has no byte shuffle and keeps the scalar integer planes */
+static const kernel_t kernels[] = {
+#ifdef KINECT_CONVERT_X86
+	{"avx2", avx2_supported, avx2_rgb_float, avx2_rgb_double, avx2_rgb_byte, avx2_rgb_short},
+	{"sse2", sse2_supported, sse2_rgb_float, sse2_rgb_double, scalar_rgb_byte, scalar_rgb_short},
+#endif
+	{"scalar", scalar_supported, scalar_rgb_float, scalar_rgb_double, scalar_rgb_byte, scalar_rgb_short},
+	{NULL, NULL, NULL, NULL, NULL, NULL}
+};
+
+static const kernel_t *current = NULL; // Only changed by kinect_convert_set_kernel once selected
+static pthread_once_t selected = PTHREAD_ONCE_INIT;
+
+static void select_kernel(void)
+{
+	const kernel_t *k;
+	init_luts();
+#ifdef KINECT_CONVERT_X86
+	init_avx2_masks();
+#endif
+	for (k = kernels; !k->supported(); ++k)
+		;
+	__atomic_store_n(&current, k, __ATOMIC_RELEASE);
+}
+
+/* the first caller selects the kernel and builds the tables, the others wait for it */
+static const kernel_t *kernel(void)
+{
+	pthread_once(&selected, select_kernel);
+	return __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+}
+
+void kinect_rgb_planar_Float(const unsigned char *rgb, float *r, float *g, float *b, long n)
+{
+	kernel()->rgb_float(rgb, r, g, b, n);
+}
+
+void kinect_rgb_planar_Double(const unsigned char *rgb, double *r, double *g, double *b, long n)
+{
+	kernel()->rgb_double(rgb, r, g, b, n);
+}
+
+void kinect_rgb_planar_Byte(const unsigned char *rgb, unsigned char *r, unsigned char *g, unsigned char *b, long n)
+{
+	kernel()->rgb_byte(rgb, r, g, b, n);
+}
+
+void kinect_rgb_planar_Short(const unsigned char *rgb, short *r, short *g, short *b, long n)
+{
+	kernel()->rgb_short(rgb, r, g, b, n);
+}
+
+const char *kinect_convert_kernel(void)
+{
+	return kernel()->name;
+}
+
+int kinect_convert_set_kernel(const char *name)
+{
+	const kernel_t *k;
+	kernel();
+	for (k = kernels; k->name; ++k)
+		if (!strcmp(k->name, name) && k->supported()) {
+			__atomic_store_n(&current, k, __ATOMIC_RELEASE);
+			return 0;
+		}
+	return -1;
+}
+
+int kinect_convert_selftest(void)
+{
+	// every byte value on every channel, plus an odd tail for the remainders
+	const long n = 256 * 3 + 7;
+	unsigned char *rgb = (unsigned char *)malloc(n * 3);
+	float *f = (float *)malloc(n * 3 * sizeof(float));
+	double *d = (double *)malloc(n * 3 * sizeof(double));
+	unsigned char *u8 = (unsigned char *)malloc(n * 3);
+	short *s16 = (short *)malloc(n * 3 * sizeof(short));
+	const kernel_t *k;
+	long i;
+	int c, mismatches = 0;
+	for (i = 0; i < n * 3; ++i)
+		rgb[i] = (i * 7 + i / 768) & 0xff;
+	kernel();
+	for (k = kernels; k->name; ++k) {
+		if (!k->supported())
+			continue;
+		k->rgb_float(rgb, f, f + n, f + 2 * n, n);
+		k->rgb_double(rgb, d, d + n, d + 2 * n, n);
+		k->rgb_byte(rgb, u8, u8 + n, u8 + 2 * n, n);
+		k->rgb_short(rgb, s16, s16 + n, s16 + 2 * n, n);
+		for (i = 0; i < n; ++i)
+			for (c = 0; c < 3; ++c) {
+				float fref = ((float)rgb[3 * i + c]) / 255;
+				double dref = ((double)rgb[3 * i + c]) / 255;
+				if (memcmp(&fref, f + c * n + i, sizeof(float)) ||
+				    memcmp(&dref, d + c * n + i, sizeof(double)) ||
+				    u8[c * n + i] != rgb[3 * i + c] || s16[c * n + i] != rgb[3 * i + c]) {
+					if (!mismatches)
+						printf("<kinect_convert> %s differs at pixel %ld channel %d\n", k->name, i, c);
+					++mismatches;
+				}
+			}
+	}
+	free(rgb);
+	free(f);
+	free(d);
+	free(u8);
+	free(s16);
+	return mismatches;
+}
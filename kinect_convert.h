@@ -0,0 +1,65 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ *
+ * Frame conversion kernels, picked at runtime among AVX2, SSE2 and scalar
+ */
+
+#ifndef KINECT_CONVERT_H
+#define KINECT_CONVERT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void kinect_rgb_planar_Float(const unsigned char *rgb, float *r, float *g, float *b, long n);
+void kinect_rgb_planar_Double(const unsigned char *rgb, double *r, double *g, double *b, long n);
+/*  Deinterleave n RGB pixels into three planes, each value divided by 255
+
+    Reads every pixel once. The result is bit-for-bit the one of ((real)v) / 255.
+*/
+
+void kinect_rgb_planar_Byte(const unsigned char *rgb, unsigned char *r, unsigned char *g, unsigned char *b, long n);
+void kinect_rgb_planar_Short(const unsigned char *rgb, short *r, short *g, short *b, long n);
+/*  Deinterleave n RGB pixels into three planes of the raw values, 0 to 255 */
+
+const char *kinect_convert_kernel(void);
+/*  Name of the kernel in use: "avx2", "sse2" or "scalar" */
+
+int kinect_convert_set_kernel(const char *name);
+/*  Force a kernel, nonzero if it is unknown or not supported by this CPU */
+
+int kinect_convert_selftest(void);
+/*  Compare every kernel supported by this CPU against the scalar division,
+    and its integer planes against the raw bytes
+
+    Returns:
+        Number of values that differ, 0 when all kernels agree bit-for-bit.
+*/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ *
+ * Temporal filtering of depth frames: averaging or median, hole filling and confidence
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "kinect_filter.h"
+
+/* age of a pixel that never had a reading, or too long ago to count */
+#define AGE_NONE 255
+
+/* pixels whose medians are taken together, the sorting network runs across them */
+#define BLOCK 64
+
+struct kinect_filter {
+	long n; // Pixels per frame
+	uint16_t invalid;
+	kinect_filter_params params;
+	float *average; // EMA, or the last median with MEDIAN, -1 where there is no value
+	uint8_t *age; // Frames since the last reading, saturated at AGE_NONE
+	uint8_t *confidence;
+	uint16_t *history; // MEDIAN: the last window frames, one plane each
+	long plane; // MEDIAN: pixels per plane, n padded to whole blocks with invalid
+	int next; // MEDIAN: where the next frame goes in each window
+	long frames; // Applied so far
+	uint16_t *output;
+};
+
+kinect_filter *kinect_filter_open(int width, int height, uint16_t invalid, const kinect_filter_params *params)
+{
+	long i;
+	if (params->mode == KINECT_FILTER_EMA && !(params->alpha > 0 && params->alpha <= 1))
+		return NULL;
+	if (params->mode == KINECT_FILTER_MEDIAN && (params->window < 1 || params->window > KINECT_FILTER_MAX_WINDOW))
+		return NULL;
+	if (params->hold < 0 || params->hold >= AGE_NONE || params->jump < 0)
+		return NULL;
+	kinect_filter *filter = (kinect_filter *)calloc(1, sizeof(kinect_filter));
+	filter->n = (long)width * height;
+	filter->invalid = invalid;
+	filter->params = *params;
+	filter->average = (float *)malloc(filter->n * sizeof(float));
+	for (i = 0; i < filter->n; ++i)
+		filter->average[i] = -1;
+	filter->age = (uint8_t *)malloc(filter->n);
+	memset(filter->age, AGE_NONE, filter->n);
+	filter->confidence = (uint8_t *)calloc(filter->n, 1);
+	filter->output = (uint16_t *)malloc(filter->n * sizeof(uint16_t));
+	if (params->mode == KINECT_FILTER_MEDIAN) {
+		filter->plane = (filter->n + BLOCK - 1) / BLOCK * BLOCK;
+		filter->history = (uint16_t *)malloc(filter->plane * params->window * sizeof(uint16_t));
+		for (i = 0; i < filter->plane * params->window; ++i)
+			filter->history[i] = invalid;
+	}
+	return filter;
+}
+
+void kinect_filter_close(kinect_filter *filter)
+{
+	free(filter->average);
+	free(filter->age);
+	free(filter->confidence);
+	free(filter->history);
+	free(filter->output);
+	free(filter);
+}
+
+/*
+  Medians of the readings of the window frames for the block of pixels from
+  start, invalid where there is none. Pixels without reading sort last, so
+  the same branchless network does for every pixel, vectorized across them.
+ */
+static void block_medians(const kinect_filter *filter, long start, uint16_t *median)
+{
+	uint16_t sorted[KINECT_FILTER_MAX_WINDOW][BLOCK];
+	uint8_t count[BLOCK];
+	int window = filter->params.window;
+	int i, j, p;
+	memset(count, 0, BLOCK);
+	for (i = 0; i < window; ++i) {
+		const uint16_t *plane = filter->history + i * filter->plane + start;
+		for (p = 0; p < BLOCK; ++p) {
+			int valid = plane[p] != filter->invalid;
+			sorted[i][p] = valid ? plane[p] : UINT16_MAX;
+			count[p] += valid;
+		}
+	}
+	for (i = 0; i < window - 1; ++i)
+		for (j = 0; j < window - 1 - i; ++j)
+			for (p = 0; p < BLOCK; ++p) {
+				uint16_t a = sorted[j][p], b = sorted[j + 1][p];
+				sorted[j][p] = a < b ? a : b;
+				sorted[j + 1][p] = a < b ? b : a;
+			}
+	for (p = 0; p < BLOCK; ++p)
+		median[p] = count[p] ? sorted[(count[p] - 1) / 2][p] : filter->invalid;
+}
+
+const uint16_t *kinect_filter_apply(kinect_filter *filter, const uint16_t *depth)
+{
+	const kinect_filter_params *params = &filter->params;
+	uint16_t invalid = filter->invalid;
+	uint16_t medians[BLOCK];
+	long start, i;
+	if (params->mode == KINECT_FILTER_MEDIAN)
+		memcpy(filter->history + filter->next * filter->plane, depth, filter->n * sizeof(uint16_t));
+	for (start = 0; start < filter->n; start += BLOCK) {
+		int len = filter->n - start < BLOCK ? filter->n - start : BLOCK;
+		if (params->mode == KINECT_FILTER_MEDIAN)
+			block_medians(filter, start, medians);
+		for (i = start; i < start + len; ++i) {
+			uint16_t d = depth[i];
+			int valid = d != invalid;
+			uint8_t c = filter->confidence[i];
+			filter->confidence[i] = valid ? c + ((255 - c + 7) >> 3) : c - ((c + 7) >> 3);
+			if (valid)
+				filter->age[i] = 0;
+			else if (filter->age[i] < AGE_NONE)
+				++filter->age[i];
+
+			if (params->mode == KINECT_FILTER_MEDIAN) {
+				uint16_t median = medians[i - start];
+				if (median != invalid) {
+					filter->average[i] = median;
+					filter->output[i] = median;
+					continue;
+				}
+			} else if (valid) {
+				float average = filter->average[i];
+				// a reading after a hole too long to bridge, or of a new surface: start over
+				if (average < 0 || (params->jump && abs(d - (int)(average + 0.5f)) > params->jump))
+					filter->average[i] = d;
+				else
+					filter->average[i] = average + params->alpha * (d - average);
+				filter->output[i] = (uint16_t)(filter->average[i] + 0.5f);
+				continue;
+			}
+			// no reading: the last value is held for a while
+			if (filter->age[i] <= params->hold && filter->average[i] >= 0) {
+				filter->output[i] = (uint16_t)(filter->average[i] + 0.5f);
+			} else {
+				filter->output[i] = invalid;
+				filter->average[i] = -1;
+			}
+		}
+	}
+	if (params->mode == KINECT_FILTER_MEDIAN)
+		filter->next = (filter->next + 1) % params->window;
+	++filter->frames;
+	return filter->output;
+}
+
+const uint16_t *kinect_filter_output(kinect_filter *filter)
+{
+	return filter->frames ? filter->output : NULL;
+}
+
+const uint8_t *kinect_filter_confidence(kinect_filter *filter)
+{
+	return filter->confidence;
+}
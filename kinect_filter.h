@@ -0,0 +1,90 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ *
+ * Temporal filtering of depth frames: averaging or median, hole filling and confidence
+ */
+
+#ifndef KINECT_FILTER_H
+#define KINECT_FILTER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	KINECT_FILTER_EMA = 0,    /* exponential moving average, restarted where the reading jumps */
+	KINECT_FILTER_MEDIAN = 1, /* median of the readings of the last window frames */
+} kinect_filter_mode;
+
+typedef struct {
+	kinect_filter_mode mode;
+	float alpha;  /* EMA: weight of the new reading, in (0, 1] */
+	int jump;     /* EMA: a reading further than this from the average restarts it, 0 for never */
+	int window;   /* MEDIAN: frames the median is taken over, 1 to KINECT_FILTER_MAX_WINDOW */
+	int hold;     /* frames a pixel without reading keeps its last value, 0 to 254 */
+} kinect_filter_params;
+
+#define KINECT_FILTER_MAX_WINDOW 9
+
+typedef struct kinect_filter kinect_filter;
+
+kinect_filter *kinect_filter_open(int width, int height, uint16_t invalid, const kinect_filter_params *params);
+/*  State of a filter over width x height depth frames
+
+    Args:
+        invalid: The value of pixels without reading, 2047 for the 11-bit disparity and 0 for mm
+
+    Returns:
+        The filter, NULL if the parameters are out of range.
+*/
+
+void kinect_filter_close(kinect_filter *filter);
+
+const uint16_t *kinect_filter_apply(kinect_filter *filter, const uint16_t *depth);
+/*  Update the state with the next frame of the stream, in a single pass, and filter it
+
+    A pixel without reading in the frame gets the filtered value it had, for hold frames, then
+    invalid. A pixel whose reading jumps (EMA) restarts from it, so moving edges do not smear.
+
+    Returns:
+        The filtered frame, owned by the filter and valid until the next call.
+*/
+
+const uint16_t *kinect_filter_output(kinect_filter *filter);
+/*  The frame the last kinect_filter_apply returned, NULL before the first one */
+
+const uint8_t *kinect_filter_confidence(kinect_filter *filter);
+/*  Per pixel, how many of the recent frames held a reading: 0 (none) to 255 (all)
+
+    A running average of the validity with a weight of 1/8, so it follows about the last 8 frames.
+*/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,244 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ *
+ * Random access reader of the files written by kinect_record, through a memory mapping
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <libfreenect.h>
+#include "kinect_playback.h"
+
+/* the frames are converted as medium resolution ones */
+#define WIDTH 640
+#define HEIGHT 480
+
+typedef struct stream {
+	const kinect_record_chunk **chunks; // Frame n of the stream, into the mapping
+	long count;
+	long capacity;
+} stream_t;
+
+struct kinect_playback {
+	const unsigned char *map;
+	long size;
+	stream_t streams[2];
+	uint64_t first_ns; // Publish time of the first frame
+	uint64_t last_ns;
+	uint16_t *depth; // Decoded depth frame
+	uint32_t width;
+	uint32_t height;
+};
+
+static void add_chunk(kinect_playback *pb, const kinect_record_chunk *chunk)
+{
+	stream_t *stream = &pb->streams[chunk->is_depth ? 1 : 0];
+	if (stream->count == stream->capacity) {
+		stream->capacity = stream->capacity ? 2 * stream->capacity : 1024;
+		stream->chunks = (const kinect_record_chunk **)realloc(stream->chunks, stream->capacity * sizeof(*stream->chunks));
+	}
+	stream->chunks[stream->count++] = chunk;
+	if (!pb->first_ns || chunk->published_ns < pb->first_ns)
+		pb->first_ns = chunk->published_ns;
+	if (chunk->published_ns > pb->last_ns)
+		pb->last_ns = chunk->published_ns;
+}
+
+/* bytes of a medium resolution frame of the stream and format of a chunk, 0 for an unknown format */
+static uint32_t frame_bytes(const kinect_record_chunk *chunk)
+{
+	freenect_frame_mode mode = chunk->is_depth ?
+		freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, (freenect_depth_format)chunk->fmt) :
+		freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, (freenect_video_format)chunk->fmt);
+	return mode.is_valid ? mode.bytes : 0;
+}
+
+/* a chunk that lies within the file and holds one whole frame, NULL otherwise */
+static const kinect_record_chunk *chunk_at(kinect_playback *pb, uint64_t offset)
+{
+	if (offset % 8 || offset + sizeof(kinect_record_chunk) > (uint64_t)pb->size)
+		return NULL;
+	const kinect_record_chunk *chunk = (const kinect_record_chunk *)(pb->map + offset);
+	if (chunk->magic != KINECT_RECORD_CHUNK_MAGIC || offset + sizeof(*chunk) + chunk->size > (uint64_t)pb->size)
+		return NULL;
+	// Raw frames are read in place, coded ones are decoded into a whole frame
+	if (chunk->codec == KINECT_RECORD_RAW && chunk->size != frame_bytes(chunk))
+		return NULL;
+	if (chunk->codec != KINECT_RECORD_RAW && (chunk->codec != KINECT_RECORD_RICE || !chunk->is_depth))
+		return NULL;
+	return chunk;
+}
+
+static int index_chunks(kinect_playback *pb, const kinect_record_header *header)
+{
+	uint64_t i;
+	if (header->index_offset) {
+		if (header->index_offset % 8 || header->index_offset > (uint64_t)pb->size ||
+		    header->frames > (pb->size - header->index_offset) / sizeof(kinect_record_entry))
+			return -1;
+		const kinect_record_entry *entries = (const kinect_record_entry *)(pb->map + header->index_offset);
+		for (i = 0; i < header->frames; ++i) {
+			const kinect_record_chunk *chunk = chunk_at(pb, entries[i].offset);
+			if (!chunk)
+				return -1;
+			add_chunk(pb, chunk);
+		}
+		return 0;
+	}
+	// Not closed: the chunks follow each other up to the first incomplete one
+	uint64_t offset = sizeof(kinect_record_header);
+	const kinect_record_chunk *chunk;
+	while ((chunk = chunk_at(pb, offset))) {
+		add_chunk(pb, chunk);
+		offset += sizeof(*chunk) + KINECT_RECORD_PADDED(chunk->size);
+	}
+	return 0;
+}
+
+kinect_playback *kinect_playback_open(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("Error: Cannot open recording %s\n", path);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(kinect_record_header)) {
+		printf("Error: %s is no recording\n", path);
+		close(fd);
+		return NULL;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	// The mapping holds its own reference to the file
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Error: Cannot map recording %s\n", path);
+		return NULL;
+	}
+	const kinect_record_header *header = (const kinect_record_header *)map;
+	if (memcmp(header->magic, KINECT_RECORD_MAGIC, sizeof(KINECT_RECORD_MAGIC))) {
+		printf("Error: %s is no recording\n", path);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	// The conversions read whole 640x480 frames
+	if (header->width != WIDTH || header->height != HEIGHT) {
+		printf("Error: Recording %s is %ux%u, not %dx%d\n", path, header->width, header->height, WIDTH, HEIGHT);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	kinect_playback *pb = (kinect_playback *)calloc(1, sizeof(kinect_playback));
+	pb->map = (const unsigned char *)map;
+	pb->size = st.st_size;
+	pb->width = header->width;
+	pb->height = header->height;
+	if (index_chunks(pb, header)) {
+		printf("Error: The index of recording %s is corrupt\n", path);
+		kinect_playback_close(pb);
+		return NULL;
+	}
+	pb->depth = (uint16_t *)malloc(pb->width * pb->height * sizeof(uint16_t));
+	return pb;
+}
+
+void kinect_playback_close(kinect_playback *pb)
+{
+	munmap((void *)pb->map, pb->size);
+	free(pb->streams[0].chunks);
+	free(pb->streams[1].chunks);
+	free(pb->depth);
+	free(pb);
+}
+
+long kinect_playback_count(kinect_playback *pb, int is_depth)
+{
+	return pb->streams[is_depth ? 1 : 0].count;
+}
+
+double kinect_playback_duration(kinect_playback *pb)
+{
+	return (pb->last_ns - pb->first_ns) / 1e9;
+}
+
+const kinect_record_chunk *kinect_playback_chunk(kinect_playback *pb, int is_depth, long n)
+{
+	stream_t *stream = &pb->streams[is_depth ? 1 : 0];
+	if (n < 0 || n >= stream->count)
+		return NULL;
+	return stream->chunks[n];
+}
+
+double kinect_playback_time(kinect_playback *pb, int is_depth, long n)
+{
+	const kinect_record_chunk *chunk = kinect_playback_chunk(pb, is_depth, n);
+	if (!chunk)
+		return -1;
+	return (chunk->published_ns - pb->first_ns) / 1e9;
+}
+
+long kinect_playback_find(kinect_playback *pb, int is_depth, double seconds)
+{
+	stream_t *stream = &pb->streams[is_depth ? 1 : 0];
+	if (!stream->count)
+		return -1;
+	double target = pb->first_ns + seconds * 1e9;
+	// First frame published at or after the target
+	long lo = 0, hi = stream->count;
+	while (lo < hi) {
+		long mid = lo + (hi - lo) / 2;
+		if (stream->chunks[mid]->published_ns < target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == stream->count)
+		return lo - 1;
+	if (lo > 0 && target - stream->chunks[lo - 1]->published_ns < stream->chunks[lo]->published_ns - target)
+		return lo - 1;
+	return lo;
+}
+
+int kinect_playback_frame(kinect_playback *pb, int is_depth, long n, const void **data, uint32_t *timestamp)
+{
+	const kinect_record_chunk *chunk = kinect_playback_chunk(pb, is_depth, n);
+	if (!chunk)
+		return -1;
+	const unsigned char *payload = (const unsigned char *)(chunk + 1);
+	if (chunk->codec == KINECT_RECORD_RICE) {
+		if (kinect_record_decode_depth(payload, chunk->size, pb->width, pb->height, pb->depth))
+			return -1;
+		*data = pb->depth;
+	} else {
+		*data = payload;
+	}
+	if (timestamp)
+		*timestamp = chunk->timestamp;
+	return 0;
+}
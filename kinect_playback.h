@@ -0,0 +1,93 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ *
+ * Random access reader of the files written by kinect_record, through a memory mapping
+ */
+
+#ifndef KINECT_PLAYBACK_H
+#define KINECT_PLAYBACK_H
+
+#include <stdint.h>
+#include "kinect_record.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kinect_playback kinect_playback;
+
+kinect_playback *kinect_playback_open(const char *path);
+/*  Map a recording and index its frames per stream
+
+    The file is mapped read-only, nothing is read up front but the index (the chunks are walked
+    instead if the recording was not closed), so frames come from the page cache as they are used.
+    Only 640x480 recordings open, and a raw frame whose size is not that of its format makes the
+    index corrupt (or ends the walk).
+
+    Returns:
+        The reader, NULL on error.
+*/
+
+void kinect_playback_close(kinect_playback *pb);
+
+long kinect_playback_count(kinect_playback *pb, int is_depth);
+/*  Frames of a stream */
+
+double kinect_playback_duration(kinect_playback *pb);
+/*  Seconds between the first and the last frame published */
+
+const kinect_record_chunk *kinect_playback_chunk(kinect_playback *pb, int is_depth, long n);
+/*  Chunk of frame n (0 is the first) of a stream, in constant time, NULL out of range
+
+    The payload follows the chunk in the mapping.
+*/
+
+double kinect_playback_time(kinect_playback *pb, int is_depth, long n);
+/*  Seconds between the first frame of the recording and frame n of a stream, -1 out of range */
+
+long kinect_playback_find(kinect_playback *pb, int is_depth, double seconds);
+/*  Frame of a stream published closest to seconds after the first frame of the recording
+
+    Binary search on the publish times, which unlike the device timestamps never wrap.
+
+    Returns:
+        The frame number, -1 if the stream has no frame.
+*/
+
+int kinect_playback_frame(kinect_playback *pb, int is_depth, long n, const void **data, uint32_t *timestamp);
+/*  Frame n of a stream as the device gave it
+
+    Raw frames point into the mapping, no copy is made. Coded depth is decoded into a buffer of the
+    reader, valid until the next call for a depth frame.
+
+    Returns:
+        Nonzero if n is out of range or the frame is corrupt.
+*/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
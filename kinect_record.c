@@ -0,0 +1,420 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ *
+ * Recorder of the frames of a device into a chunked file, on its own thread
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libfreenect_sync.h"
+#include "kinect_record.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+/* the largest frame of the medium resolution formats, RGB */
+#define SLOT_SIZE (WIDTH * HEIGHT * 3)
+
+/* unary quotients this long are escapes, the value follows on 16 bits */
+#define RICE_ESCAPE 16
+
+typedef struct slot {
+	unsigned char *data;
+	kinect_record_chunk chunk;
+	int ready; // Set by the tap once the copy is done, the thread waits for it
+} slot_t;
+
+struct kinect_recorder {
+	int index;
+	FILE *file;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running; // Cleared by kinect_record_close, the thread then drains the queue
+	slot_t *slots;
+	int nslots;
+	slot_t **free; // Slots the tap can fill
+	int nfree;
+	slot_t **queue; // Claimed slots, circular, oldest first
+	int head;
+	int count;
+	kinect_record_entry *entries; // The index, only touched by the thread
+	long nentries;
+	long capacity;
+	uint64_t offset; // Where the next chunk goes
+	unsigned char *encoded; // Depth coding buffer
+	int failed; // A write failed, the file is incomplete
+	kinect_record_stats stats;
+};
+
+static uint64_t monotonic_nsec(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/*******************************************************
+ depth coding: LSB first bit stream
+*******************************************************/
+typedef struct bit_writer {
+	uint64_t acc;
+	int nbits;
+	unsigned char *p;
+} bit_writer_t;
+
+static inline void put_bits(bit_writer_t *bw, uint32_t value, int n)
+{
+	bw->acc |= (uint64_t)value << bw->nbits;
+	bw->nbits += n;
+	if (bw->nbits >= 32) {
+		uint32_t word = (uint32_t)bw->acc;
+		memcpy(bw->p, &word, 4);
+		bw->p += 4;
+		bw->acc >>= 32;
+		bw->nbits -= 32;
+	}
+}
+
+static inline void flush_bits(bit_writer_t *bw)
+{
+	while (bw->nbits > 0) {
+		*bw->p++ = (unsigned char)bw->acc;
+		bw->acc >>= 8;
+		bw->nbits -= 8;
+	}
+	bw->nbits = 0;
+}
+
+long kinect_record_depth_bound(int width, int height)
+{
+	// an escape is the longest code, 32 bits, and each row starts with its 4-bit parameter
+	return (long)height * (1 + (long)width * 4) + 8;
+}
+
+long kinect_record_encode_depth(const uint16_t *depth, int width, int height, unsigned char *out)
+{
+	uint32_t *residuals = (uint32_t *)malloc(width * sizeof(uint32_t));
+	bit_writer_t bw = {0, 0, out};
+	int x, y;
+	for (y = 0; y < height; ++y) {
+		const uint16_t *row = depth + (long)y * width;
+		int prediction = y ? row[-width] : 0;
+		uint64_t sum = 0;
+		for (x = 0; x < width; ++x) {
+			int delta = row[x] - prediction;
+			residuals[x] = delta >= 0 ? 2 * delta : -2 * delta - 1;
+			sum += residuals[x];
+			prediction = row[x];
+		}
+		// 2^k about the mean residual
+		int k = 0;
+		while (k < 15 && ((uint64_t)width << (k + 1)) <= sum)
+			++k;
+		put_bits(&bw, k, 4);
+		for (x = 0; x < width; ++x) {
+			uint32_t q = residuals[x] >> k;
+			if (q < RICE_ESCAPE) {
+				put_bits(&bw, (1u << q) - 1, q + 1);
+				if (k)
+					put_bits(&bw, residuals[x] & ((1u << k) - 1), k);
+			} else {
+				put_bits(&bw, (1u << RICE_ESCAPE) - 1, RICE_ESCAPE);
+				put_bits(&bw, row[x], 16);
+			}
+		}
+	}
+	flush_bits(&bw);
+	free(residuals);
+	return bw.p - out;
+}
+
+typedef struct bit_reader {
+	uint64_t acc;
+	int nbits;
+	const unsigned char *in;
+	long pos, size;
+} bit_reader_t;
+
+/* keeps at least 56 bits in the accumulator, zeros past the end */
+static inline void refill_bits(bit_reader_t *br)
+{
+	while (br->nbits <= 56) {
+		uint64_t byte = br->pos < br->size ? br->in[br->pos] : 0;
+		++br->pos;
+		br->acc |= byte << br->nbits;
+		br->nbits += 8;
+	}
+}
+
+static inline uint32_t get_bits(bit_reader_t *br, int n)
+{
+	uint32_t value = (uint32_t)(br->acc & ((1ull << n) - 1));
+	br->acc >>= n;
+	br->nbits -= n;
+	return value;
+}
+
+int kinect_record_decode_depth(const unsigned char *in, long size, int width, int height, uint16_t *depth)
+{
+	bit_reader_t br = {0, 0, in, 0, size};
+	int x, y;
+	for (y = 0; y < height; ++y) {
+		uint16_t *row = depth + (long)y * width;
+		int prediction = y ? row[-width] : 0;
+		refill_bits(&br);
+		int k = get_bits(&br, 4);
+		for (x = 0; x < width; ++x) {
+			refill_bits(&br);
+			int q = __builtin_ctzll(~br.acc);
+			if (q < RICE_ESCAPE) {
+				get_bits(&br, q + 1);
+				uint32_t u = ((uint32_t)q << k) | (k ? get_bits(&br, k) : 0);
+				prediction += (u & 1) ? -(int)((u + 1) >> 1) : (int)(u >> 1);
+			} else {
+				get_bits(&br, RICE_ESCAPE);
+				prediction = get_bits(&br, 16);
+			}
+			row[x] = (uint16_t)prediction;
+		}
+	}
+	// the zeros read past the end decode, but not into a frame that was written
+	return br.pos - br.nbits / 8 > size ? -1 : 0;
+}
+
+/*******************************************************
+ recorder
+*******************************************************/
+/* Runs on the producer thread: only copies the frame, drops it if no slot is free.
+   The lock only covers claiming the slot, the copy is done after it */
+static void record_tap(void *user, int is_depth, const void *data, int size, int fmt, uint32_t timestamp, uint64_t published_ns)
+{
+	kinect_recorder *rec = (kinect_recorder *)user;
+	pthread_mutex_lock(&rec->lock);
+	// a frame larger than a slot (not 640x480) is dropped too
+	if (!rec->nfree || size > SLOT_SIZE) {
+		++rec->stats.dropped[is_depth];
+		pthread_mutex_unlock(&rec->lock);
+		return;
+	}
+	slot_t *slot = rec->free[--rec->nfree];
+	rec->queue[(rec->head + rec->count) % rec->nslots] = slot;
+	++rec->count;
+	pthread_cond_signal(&rec->cond);
+	pthread_mutex_unlock(&rec->lock);
+
+	memcpy(slot->data, data, size);
+	slot->chunk.magic = KINECT_RECORD_CHUNK_MAGIC;
+	slot->chunk.is_depth = is_depth;
+	slot->chunk.fmt = fmt;
+	slot->chunk.codec = KINECT_RECORD_RAW;
+	slot->chunk.timestamp = timestamp;
+	slot->chunk.size = size;
+	slot->chunk.published_ns = published_ns;
+	__atomic_store_n(&slot->ready, 1, __ATOMIC_RELEASE);
+}
+
+/* 16-bit depth is coded, packed depth and video are written raw */
+static int codable_depth(const kinect_record_chunk *chunk)
+{
+	return chunk->is_depth && chunk->size == WIDTH * HEIGHT * 2;
+}
+
+static void write_chunk(kinect_recorder *rec, slot_t *slot)
+{
+	static const char padding[8];
+	uint64_t start = monotonic_nsec();
+	const void *payload = slot->data;
+	if (codable_depth(&slot->chunk)) {
+		slot->chunk.size = kinect_record_encode_depth((const uint16_t *)slot->data, WIDTH, HEIGHT, rec->encoded);
+		slot->chunk.codec = KINECT_RECORD_RICE;
+		payload = rec->encoded;
+	}
+	if (fwrite(&slot->chunk, sizeof(slot->chunk), 1, rec->file) != 1 ||
+	    fwrite(payload, slot->chunk.size, 1, rec->file) != 1 ||
+	    fwrite(padding, 1, KINECT_RECORD_PADDED(slot->chunk.size) - slot->chunk.size, rec->file) !=
+	    KINECT_RECORD_PADDED(slot->chunk.size) - slot->chunk.size) {
+		rec->failed = 1;
+		return;
+	}
+	if (rec->nentries == rec->capacity) {
+		rec->capacity = rec->capacity ? 2 * rec->capacity : 1024;
+		rec->entries = (kinect_record_entry *)realloc(rec->entries, rec->capacity * sizeof(kinect_record_entry));
+	}
+	kinect_record_entry *entry = &rec->entries[rec->nentries++];
+	entry->offset = rec->offset;
+	entry->published_ns = slot->chunk.published_ns;
+	entry->timestamp = slot->chunk.timestamp;
+	entry->is_depth = slot->chunk.is_depth;
+	rec->offset += sizeof(slot->chunk) + KINECT_RECORD_PADDED(slot->chunk.size);
+
+	pthread_mutex_lock(&rec->lock);
+	++rec->stats.frames[slot->chunk.is_depth];
+	rec->stats.bytes = rec->offset;
+	rec->stats.encode_ns = monotonic_nsec() - start;
+	pthread_mutex_unlock(&rec->lock);
+}
+
+static void *record_thread(void *arg)
+{
+	kinect_recorder *rec = (kinect_recorder *)arg;
+	pthread_mutex_lock(&rec->lock);
+	while (rec->running || rec->count) {
+		if (!rec->count) {
+			pthread_cond_wait(&rec->cond, &rec->lock);
+			continue;
+		}
+		slot_t *slot = rec->queue[rec->head];
+		rec->head = (rec->head + 1) % rec->nslots;
+		--rec->count;
+		pthread_mutex_unlock(&rec->lock);
+		while (!__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE))
+			sched_yield(); // The tap is still copying into it
+		if (!rec->failed)
+			write_chunk(rec, slot);
+		slot->ready = 0;
+		pthread_mutex_lock(&rec->lock);
+		rec->free[rec->nfree++] = slot;
+	}
+	pthread_mutex_unlock(&rec->lock);
+	return NULL;
+}
+
+static void stop_thread(kinect_recorder *rec)
+{
+	pthread_mutex_lock(&rec->lock);
+	rec->running = 0;
+	pthread_cond_signal(&rec->cond);
+	pthread_mutex_unlock(&rec->lock);
+	pthread_join(rec->thread, NULL);
+}
+
+static void free_recorder(kinect_recorder *rec)
+{
+	int i;
+	for (i = 0; i < rec->nslots; ++i)
+		free(rec->slots[i].data);
+	free(rec->slots);
+	free(rec->free);
+	free(rec->queue);
+	free(rec->entries);
+	free(rec->encoded);
+	pthread_mutex_destroy(&rec->lock);
+	pthread_cond_destroy(&rec->cond);
+	free(rec);
+}
+
+kinect_recorder *kinect_record_open(const char *path, int index, int slots)
+{
+	int i;
+	if (slots < 2) {
+		printf("Error: A recorder needs at least 2 slots\n");
+		return NULL;
+	}
+	kinect_recorder *rec = (kinect_recorder *)calloc(1, sizeof(kinect_recorder));
+	rec->index = index;
+	rec->nslots = slots;
+	rec->slots = (slot_t *)calloc(slots, sizeof(slot_t));
+	rec->free = (slot_t **)malloc(slots * sizeof(slot_t *));
+	rec->queue = (slot_t **)malloc(slots * sizeof(slot_t *));
+	for (i = 0; i < slots; ++i) {
+		rec->slots[i].data = (unsigned char *)malloc(SLOT_SIZE);
+		rec->free[rec->nfree++] = &rec->slots[i];
+	}
+	rec->encoded = (unsigned char *)malloc(kinect_record_depth_bound(WIDTH, HEIGHT));
+	pthread_mutex_init(&rec->lock, NULL);
+	pthread_cond_init(&rec->cond, NULL);
+
+	rec->file = fopen(path, "wb");
+	if (!rec->file) {
+		printf("Error: Cannot create recording %s\n", path);
+		free_recorder(rec);
+		return NULL;
+	}
+	// big writes, the thread only blocks on the disk
+	setvbuf(rec->file, NULL, _IOFBF, 1 << 20);
+	kinect_record_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, KINECT_RECORD_MAGIC, sizeof(KINECT_RECORD_MAGIC));
+	header.width = WIDTH;
+	header.height = HEIGHT;
+	if (fwrite(&header, sizeof(header), 1, rec->file) != 1) {
+		printf("Error: Cannot write recording %s\n", path);
+		fclose(rec->file);
+		free_recorder(rec);
+		return NULL;
+	}
+	rec->offset = sizeof(header);
+
+	rec->running = 1;
+	pthread_create(&rec->thread, NULL, record_thread, rec);
+	if (freenect_sync_set_tap(index, record_tap, rec)) {
+		stop_thread(rec);
+		fclose(rec->file);
+		remove(path);
+		free_recorder(rec);
+		return NULL;
+	}
+	return rec;
+}
+
+int kinect_record_close(kinect_recorder *rec, kinect_record_stats *stats)
+{
+	// no frame comes in once the tap is removed, the thread writes the ones waiting
+	freenect_sync_set_tap(rec->index, NULL, NULL);
+	stop_thread(rec);
+
+	kinect_record_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, KINECT_RECORD_MAGIC, sizeof(KINECT_RECORD_MAGIC));
+	header.width = WIDTH;
+	header.height = HEIGHT;
+	header.index_offset = rec->offset;
+	header.frames = rec->nentries;
+	if (!rec->failed &&
+	    (rec->nentries && fwrite(rec->entries, sizeof(kinect_record_entry), rec->nentries, rec->file) != (size_t)rec->nentries))
+		rec->failed = 1;
+	if (!rec->failed &&
+	    (fseek(rec->file, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, rec->file) != 1))
+		rec->failed = 1;
+	if (fclose(rec->file))
+		rec->failed = 1;
+	rec->stats.bytes = rec->offset + rec->nentries * sizeof(kinect_record_entry);
+	if (stats)
+		*stats = rec->stats;
+	int failed = rec->failed;
+	free_recorder(rec);
+	return failed ? -1 : 0;
+}
+
+void kinect_record_get_stats(kinect_recorder *rec, kinect_record_stats *stats)
+{
+	pthread_mutex_lock(&rec->lock);
+	*stats = rec->stats;
+	pthread_mutex_unlock(&rec->lock);
+}
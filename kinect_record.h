@@ -0,0 +1,149 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ *
+ * Recorder of the frames of a device into a chunked file, on its own thread
+ */
+
+#ifndef KINECT_RECORD_H
+#define KINECT_RECORD_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*  File layout, all fields little-endian:
+
+        kinect_record_header
+        kinect_record_chunk + payload   one per frame, in the order they were published, padded
+                                        to KINECT_RECORD_PADDED(size) bytes
+        ...
+        kinect_record_entry             the index, one per chunk, at header.index_offset
+
+    The header is rewritten with the index when the recording is closed. A file whose index_offset
+    is 0 was not closed, its chunks can still be walked one after the other. The padding keeps every
+    chunk and the index 8-byte aligned, so that a mapping of the file can be read in place.
+*/
+
+#define KINECT_RECORD_MAGIC "KINREC1"
+#define KINECT_RECORD_CHUNK_MAGIC 0x4d52464b /* "KFRM" */
+#define KINECT_RECORD_PADDED(size) (((uint64_t)(size) + 7) & ~(uint64_t)7)
+
+typedef enum {
+	KINECT_RECORD_RAW = 0,  /* the frame as the device gave it */
+	KINECT_RECORD_RICE = 1, /* 16-bit depth, row deltas Rice coded, see kinect_record_encode_depth */
+} kinect_record_codec;
+
+typedef struct {
+	char magic[8];         /* KINECT_RECORD_MAGIC */
+	uint32_t width;
+	uint32_t height;
+	uint64_t index_offset; /* of the index, 0 until the recording is closed */
+	uint64_t frames;       /* entries in the index */
+} kinect_record_header;
+
+typedef struct {
+	uint32_t magic;        /* KINECT_RECORD_CHUNK_MAGIC */
+	uint32_t is_depth;
+	uint32_t fmt;          /* freenect_video_format or freenect_depth_format */
+	uint32_t codec;        /* kinect_record_codec */
+	uint32_t timestamp;    /* of the device */
+	uint32_t size;         /* bytes of payload following the chunk */
+	uint64_t published_ns; /* CLOCK_MONOTONIC time the frame was published at */
+} kinect_record_chunk;
+
+typedef struct {
+	uint64_t offset;       /* of the chunk from the start of the file */
+	uint64_t published_ns;
+	uint32_t timestamp;
+	uint32_t is_depth;
+} kinect_record_entry;
+
+typedef struct {
+	uint64_t frames[2];    /* written, video then depth */
+	uint64_t dropped[2];   /* lost because every slot was waiting to be written, or larger than a
+	                          640x480 RGB frame */
+	uint64_t bytes;        /* written to the file */
+	uint64_t encode_ns;    /* spent encoding and writing the last frame */
+} kinect_record_stats;
+
+typedef struct kinect_recorder kinect_recorder;
+
+kinect_recorder *kinect_record_open(const char *path, int index, int slots);
+/*  Start recording every frame of a device into path
+
+    Frames are copied into one of slots buffers as they are published (freenect_sync_set_tap) and
+    written by the recorder thread, the grab calls are never held up. When the thread falls behind
+    and every slot waits to be written, new frames are dropped and counted.
+
+    Args:
+        path: File to create, overwritten if it exists
+        index: Device index (0 is the first)
+        slots: Frames that can wait to be written, at least 2
+
+    Returns:
+        The recorder, NULL on error.
+*/
+
+int kinect_record_close(kinect_recorder *rec, kinect_record_stats *stats);
+/*  Stop taking frames, write the ones waiting and the index, and free the recorder
+
+    Args:
+        stats: If not NULL, populated with the final counters
+
+    Returns:
+        Nonzero if the file could not be completed.
+*/
+
+void kinect_record_get_stats(kinect_recorder *rec, kinect_record_stats *stats);
+/*  Counters of a running recorder */
+
+long kinect_record_encode_depth(const uint16_t *depth, int width, int height, unsigned char *out);
+/*  Lossless coding of a 16-bit depth frame
+
+    Each pixel is predicted by its left neighbour (the one above for the first column), the zigzagged
+    residual is Rice coded with a parameter chosen per row, and values too far from the prediction are
+    stored as is. out must hold kinect_record_depth_bound(width, height) bytes.
+
+    Returns:
+        Bytes written to out.
+*/
+
+long kinect_record_depth_bound(int width, int height);
+/*  Most bytes kinect_record_encode_depth can write */
+
+int kinect_record_decode_depth(const unsigned char *in, long size, int width, int height, uint16_t *depth);
+/*  Inverse of kinect_record_encode_depth
+
+    Returns:
+        Nonzero if in is truncated or corrupt.
+*/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
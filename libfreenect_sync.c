@@ -23,31 +23,130 @@
  * Binary distributions must follow the binary distribution requirements of
  * either License.
  */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
 #include <stdio.h>
 #include <pthread.h>
+#include <sched.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#endif
+#include <time.h>
+#include <limits.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
 #include "libfreenect_sync.h"
+#include "kinect_playback.h"
+
+typedef struct lease {
+	void *data;
+	int size;
+} lease_t;
+
+typedef struct frame {
+	void *data;
+	uint32_t timestamp; // Written by the producer before it publishes the frame
+	uint64_t published_ns; // When the producer published it
+} frame_t;
+
+/*
+  A ring of nbufs buffers: one is filled by the producer, one holds the frame
+  the consumer got last, the others queue published frames (oldest first) or
+  sit idle. When the queue is full, the producer recycles the oldest frame.
+
+  Buffers change hands through state alone, a word the producer and the
+  consumer update with compare-and-swap: the queue of published buffers,
+  4 bits each from bit 8, their count in bits 0-3 and the consumer buffer in
+  bits 4-7. A buffer not in the state nor the producer's is idle. The producer
+  never takes lock, which only keeps consumers and format changes apart.
+ */
+#define RING_MAX_BUFS 16
+#define RING_COUNT(state) ((int)((state) & 15))
+#define RING_CONSUMER(state) ((int)((state) >> 4 & 15))
+#define RING_SLOT(state, i) ((int)((state) >> (8 + 4 * (i)) & 15))
+#define RING_STATE(queue, count, consumer) ((uint64_t)(queue) << 8 | (uint64_t)(consumer) << 4 | (uint64_t)(count))
 
 typedef struct buffer_ring {
 	pthread_mutex_t lock;
+#ifndef __linux__
 	pthread_cond_t cb_cond;
-	void *bufs[3];
-	uint32_t timestamp;
-	int valid; // True if middle buffer is valid
+#endif
+	int nbufs;
+	freenect_sync_policy policy;
+	frame_t *frames; // nbufs buffers, referred to by their index
+	uint64_t state; // See above, only changed with __atomic operations
+	uint32_t seq; // Frames published, the futex consumers wait on
+	int waiters; // Consumers blocked on seq
+	int fd; // eventfd readable while frames are queued, -1 until asked for
+	int producer_id; // Only touched by the producer
+	void *producer; // Its buffer, being filled
+	int consumer; // Last frame handed to the consumer, copy of its bits of state
+	int held; // True while the consumer frame was handed out and can be handed out again, not once leased
 	int fmt;
+	int size; // Bytes per frame
+	lease_t *spares; // Buffers given back by released leases, reused first if of the ring size. Under leases_lock
+	int nspares;
+	int index; // Device index and stream, for the taps
+	int is_depth;
 } buffer_ring_t;
 
+/*
+  A libfreenect context of a single device, with the thread processing its
+  events: the same scheme as the global runloop, on a lock of its own.
+ */
+typedef struct device_loop {
+	freenect_context *ctx;
+	pthread_t thread;
+	int running;
+	pthread_mutex_t lock; // Held while events are processed, take it to call into libfreenect
+	int pending; // Tasks waiting for the lock, the event thread lets them in first
+	pthread_mutex_t pending_lock;
+	pthread_cond_t pending_cond;
+} device_loop_t;
+
 typedef struct sync_kinect {
-	freenect_device *dev;
+	freenect_device *dev; // NULL unless the source is a device
+	device_loop_t *loop; // Own context of the device or its feeder, NULL if it shares the global one
 	buffer_ring_t video;
 	buffer_ring_t depth;
+	freenect_sync_source source;
+	FILE *replay;
+	long replay_frames;
+	kinect_playback *playback; // Of a recording source
+	double fps;
+	int cpu; // The event or feeder thread is pinned to, -1 if none
 } sync_kinect_t;
 
+typedef struct ring_config {
+	int nbufs; // 0 means the default of 3
+	freenect_sync_policy policy;
+} ring_config_t;
+
+typedef struct source_config {
+	freenect_sync_source source;
+	char *path;
+	double fps;
+	ring_config_t video;
+	ring_config_t depth;
+	int own_thread; // The device gets its own context and event thread
+	int cpu; // 0 means none, else the CPU + 1
+} source_config_t;
+
 typedef int (*set_buffer_t)(freenect_device *dev, void *buf);
 
+typedef struct tap {
+	freenect_sync_tap_cb cb;
+	void *user;
+} tap_t;
+
 static sync_kinect_t *kinects[MAX_KINECTS] = {};
+static source_config_t sources[MAX_KINECTS] = {};
 static freenect_context *ctx;
 static int thread_running = 0;
 static pthread_t thread;
@@ -55,6 +154,23 @@ static pthread_mutex_t runloop_lock = PTHREAD_MUTEX_INITIALIZER;
 static int pending_runloop_tasks = 0;
 static pthread_mutex_t pending_runloop_tasks_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t pending_runloop_tasks_cond = PTHREAD_COND_INITIALIZER;
+/* The tap of each device, read by the producers without a lock, and how many of them are in it */
+static tap_t *taps[MAX_KINECTS] = {};
+static int tap_users[MAX_KINECTS] = {};
+static pthread_mutex_t taps_lock = PTHREAD_MUTEX_INITIALIZER; // Only keeps freenect_sync_set_tap calls apart
+
+/* Buffers held by the caller, per device and stream. Kept apart from the kinects, a lease outlives a stop */
+static lease_t *leases[MAX_KINECTS][2];
+static int nleases[MAX_KINECTS][2];
+static pthread_mutex_t leases_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Telemetry of each stream, only touched with relaxed atomics */
+static freenect_sync_stats telemetry[MAX_KINECTS][2];
+static pthread_t dump_thread;
+static int dump_running = 0;
+static double dump_period;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_cond = PTHREAD_COND_INITIALIZER;
 
 /* Locking Convention
    Rules:
@@ -64,11 +180,37 @@ static pthread_cond_t pending_runloop_tasks_cond = PTHREAD_COND_INITIALIZER;
    Lock Families:
        - pending_runloop_tasks_lock
        - runloop_lock, buffer_ring_t.lock (NOTE: You may only have one)
+       - device_loop_t.pending_lock
+       - runloop_lock, device_loop_t.lock, buffer_ring_t.lock (NOTE: The lock of a device loop stands
+         in for runloop_lock for the calls into its device and the frames its feeder publishes, the
+         global one is only taken first)
+       - buffer_ring_t.lock is only taken by consumers and format changes, the producer hands frames
+         over without it (see buffer_ring_t). Outside Linux, it also wakes blocked consumers under it
+       - taps_lock (NOTE: Only taken by freenect_sync_set_tap, the producers read the taps without it)
+       - runloop_lock, buffer_ring_t.lock, leases_lock (NOTE: Nothing is locked under leases_lock, which
+         also guards the spares and the kinects a release looks up)
+       - dump_lock (NOTE: Only guards the dump thread, the telemetry takes no lock)
 */
 
+static void alloc_buffer_ring(int fmt, int sz, buffer_ring_t *buf)
+{
+	int i;
+	buf->frames = (frame_t *)calloc(buf->nbufs, sizeof(frame_t));
+	for (i = 0; i < buf->nbufs; ++i)
+		buf->frames[i].data = malloc(sz);
+	// The producer starts on buffer 0, the consumer on 1, the others are idle
+	buf->producer_id = 0;
+	buf->producer = buf->frames[0].data;
+	buf->consumer = 1;
+	buf->state = RING_STATE(0, 0, 1);
+	buf->held = 0;
+	buf->fmt = fmt;
+	buf->size = sz;
+}
+
 static int alloc_buffer_ring_video(freenect_video_format fmt, buffer_ring_t *buf)
 {
-	int sz, i;
+	int sz;
 	switch (fmt) {
 		case FREENECT_VIDEO_RGB:
 		case FREENECT_VIDEO_BAYER:
@@ -81,17 +223,13 @@ static int alloc_buffer_ring_video(freenect_video_format fmt, buffer_ring_t *buf
 			printf("Invalid video format %d\n", fmt);
 			return -1;
 	}
-	for (i = 0; i < 3; ++i)
-		buf->bufs[i] = malloc(sz);
-	buf->timestamp = 0;
-	buf->valid = 0;
-	buf->fmt = fmt;
+	alloc_buffer_ring(fmt, sz, buf);
 	return 0;
 }
 
 static int alloc_buffer_ring_depth(freenect_depth_format fmt, buffer_ring_t *buf)
 {
-	int sz, i;
+	int sz;
 	switch (fmt) {
 		case FREENECT_DEPTH_11BIT:
 		case FREENECT_DEPTH_10BIT:
@@ -105,38 +243,152 @@ static int alloc_buffer_ring_depth(freenect_depth_format fmt, buffer_ring_t *buf
 			printf("Invalid depth format %d\n", fmt);
 			return -1;
 	}
-	for (i = 0; i < 3; ++i)
-		buf->bufs[i] = malloc(sz);
-	buf->timestamp = 0;
-	buf->valid = 0;
-	buf->fmt = fmt;
+	alloc_buffer_ring(fmt, sz, buf);
 	return 0;
 }
 
 static void free_buffer_ring(buffer_ring_t *buf)
 {
 	int i;
-	for (i = 0; i < 3; ++i) {
-		free(buf->bufs[i]);
-		buf->bufs[i] = NULL;
-	}
-	buf->timestamp = 0;
-	buf->valid = 0;
+	for (i = 0; buf->frames && i < buf->nbufs; ++i)
+		free(buf->frames[i].data);
+	free(buf->frames);
+	buf->frames = NULL;
+	buf->producer = NULL;
+	buf->state = RING_STATE(0, 0, 1);
+	// Spares have the size of the old format, leased buffers stay with their holder
+	pthread_mutex_lock(&leases_lock);
+	for (i = 0; i < buf->nspares; ++i)
+		free(buf->spares[i].data);
+	buf->nspares = 0;
+	pthread_mutex_unlock(&leases_lock);
+	buf->held = 0;
 	buf->fmt = -1;
+	buf->size = 0;
 }
 
-static void producer_cb_inner(freenect_device *dev, void *data, uint32_t timestamp, buffer_ring_t *buf, set_buffer_t set_buffer)
+static uint64_t monotonic_nsec(void)
 {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void stat_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void stat_set(uint64_t *value, uint64_t n)
+{
+	__atomic_store_n(value, n, __ATOMIC_RELAXED);
+}
+
+static void histogram_add(freenect_sync_histogram *histogram, uint64_t ns)
+{
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (bucket >= FREENECT_SYNC_HISTOGRAM_BUCKETS)
+		bucket = FREENECT_SYNC_HISTOGRAM_BUCKETS - 1;
+	stat_add(&histogram->count, 1);
+	stat_add(&histogram->sum_ns, ns);
+	stat_add(&histogram->buckets[bucket], 1);
+	uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Called by the producer once a frame is published, wakes the consumers blocked in ring_wait */
+static void ring_wake(buffer_ring_t *buf)
+{
+#ifdef __linux__
+	int fd = __atomic_load_n(&buf->fd, __ATOMIC_SEQ_CST);
+	if (fd >= 0)
+		eventfd_write(fd, 1);
+#endif
+	__atomic_fetch_add(&buf->seq, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&buf->waiters, __ATOMIC_SEQ_CST))
+		return;
+#ifdef __linux__
+	syscall(SYS_futex, &buf->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+	// Only reached while a consumer is blocked, the lock is never held for long
 	pthread_mutex_lock(&buf->lock);
-	assert(data == buf->bufs[2]);
-	void *temp_buf = buf->bufs[1];
-	buf->bufs[1] = buf->bufs[2];
-	buf->bufs[2] = temp_buf;
-	set_buffer(dev, temp_buf);
-	buf->timestamp = timestamp;
-	buf->valid = 1;
-	pthread_cond_signal(&buf->cb_cond);
+	pthread_cond_broadcast(&buf->cb_cond);
 	pthread_mutex_unlock(&buf->lock);
+#endif
+}
+
+/*
+  Blocks while buf->seq is still seq, which the caller read before it found
+  nothing to take, until deadline if timeout_ms is positive. The caller holds
+  buf->lock, which is let go meanwhile. Returns 1 once the deadline passed.
+ */
+static int ring_wait(buffer_ring_t *buf, uint32_t seq, int timeout_ms, const struct timespec *deadline)
+{
+	int late = 0;
+	__atomic_fetch_add(&buf->waiters, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+	pthread_mutex_unlock(&buf->lock);
+	// The bitset variant takes an absolute CLOCK_MONOTONIC deadline, as the frame ages use
+	if (syscall(SYS_futex, &buf->seq, FUTEX_WAIT_BITSET_PRIVATE, seq, timeout_ms < 0 ? NULL : deadline, NULL,
+	            FUTEX_BITSET_MATCH_ANY) && errno == ETIMEDOUT)
+		late = 1;
+	pthread_mutex_lock(&buf->lock);
+#else
+	while (__atomic_load_n(&buf->seq, __ATOMIC_SEQ_CST) == seq && !late) {
+		if (timeout_ms < 0)
+			pthread_cond_wait(&buf->cb_cond, &buf->lock);
+		else if (pthread_cond_timedwait(&buf->cb_cond, &buf->lock, deadline) == ETIMEDOUT)
+			late = 1;
+	}
+#endif
+	__atomic_fetch_sub(&buf->waiters, 1, __ATOMIC_SEQ_CST);
+	return late;
+}
+
+/* Publishes the producer buffer and moves the producer to an idle buffer, or to the oldest queued one when the queue is full */
+static void producer_cb_inner(freenect_device *dev, void *data, uint32_t timestamp, buffer_ring_t *buf, set_buffer_t set_buffer)
+{
+	uint64_t now = monotonic_nsec();
+	// The frame is still the producer's own, the tap reads it without holding up the consumer.
+	// Counted in before the tap is loaded, so a removal waits for this call to return
+	__atomic_fetch_add(&tap_users[buf->index], 1, __ATOMIC_SEQ_CST);
+	tap_t *tap = __atomic_load_n(&taps[buf->index], __ATOMIC_SEQ_CST);
+	if (tap)
+		tap->cb(tap->user, buf->is_depth, data, buf->size, buf->fmt, timestamp, now);
+	__atomic_fetch_sub(&tap_users[buf->index], 1, __ATOMIC_RELEASE);
+	assert(data == buf->producer);
+	int slots = buf->nbufs - 2;
+	int id = buf->producer_id;
+	frame_t *frame = &buf->frames[id];
+	// A consumer pairing frames may read these of a queued frame, which the producer can recycle
+	__atomic_store_n(&frame->timestamp, timestamp, __ATOMIC_RELAXED);
+	__atomic_store_n(&frame->published_ns, now, __ATOMIC_RELAXED);
+	uint64_t state = __atomic_load_n(&buf->state, __ATOMIC_ACQUIRE), next_state;
+	int next, i;
+	do {
+		int count = RING_COUNT(state);
+		uint64_t queue = state >> 8;
+		if (count == slots) {
+			// The consumer is behind, recycle the oldest frame
+			next = RING_SLOT(state, 0);
+			queue >>= 4;
+			--count;
+		} else {
+			unsigned used = 1u << id | 1u << RING_CONSUMER(state);
+			for (i = 0; i < count; ++i)
+				used |= 1u << RING_SLOT(state, i);
+			next = __builtin_ctz(~used);
+		}
+		next_state = RING_STATE(queue | (uint64_t)id << 4 * count, count + 1, RING_CONSUMER(state));
+	} while (!__atomic_compare_exchange_n(&buf->state, &state, next_state, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	if (RING_COUNT(state) == slots)
+		stat_add(&telemetry[buf->index][buf->is_depth].dropped, 1);
+	stat_add(&telemetry[buf->index][buf->is_depth].produced, 1);
+	buf->producer_id = next;
+	buf->producer = buf->frames[next].data;
+	set_buffer(dev, buf->producer);
+	ring_wake(buf);
 }
 
 static void video_producer_cb(freenect_device *dev, void *data, uint32_t timestamp)
@@ -149,6 +401,12 @@ static void depth_producer_cb(freenect_device *dev, void *data, uint32_t timesta
 	producer_cb_inner(dev, data, timestamp, &((sync_kinect_t *)freenect_get_user(dev))->depth, freenect_set_depth_buffer);
 }
 
+/* Synthetic and replay sources own no libusb buffer, they write straight into the producer buffer */
+static int feeder_set_buffer(freenect_device *dev, void *buf)
+{
+	return 0;
+}
+
 /* You should only use these functions to manipulate the pending_runloop_tasks_lock*/
 static void pending_runloop_tasks_inc(void)
 {
@@ -164,7 +422,7 @@ static void pending_runloop_tasks_dec(void)
 	--pending_runloop_tasks;
 	assert(pending_runloop_tasks >= 0);
 	if (!pending_runloop_tasks)
-		pthread_cond_signal(&pending_runloop_tasks_cond);
+		pthread_cond_broadcast(&pending_runloop_tasks_cond);
 	pthread_mutex_unlock(&pending_runloop_tasks_lock);
 }
 
@@ -176,31 +434,253 @@ static void pending_runloop_tasks_wait_zero(void)
 	pthread_mutex_unlock(&pending_runloop_tasks_lock);
 }
 
+/* The same for the lock of a device loop */
+static void loop_enter(device_loop_t *loop)
+{
+	pthread_mutex_lock(&loop->pending_lock);
+	++loop->pending;
+	pthread_mutex_unlock(&loop->pending_lock);
+	pthread_mutex_lock(&loop->lock);
+}
+
+static void loop_exit(device_loop_t *loop)
+{
+	pthread_mutex_unlock(&loop->lock);
+	pthread_mutex_lock(&loop->pending_lock);
+	if (!--loop->pending)
+		pthread_cond_broadcast(&loop->pending_cond);
+	pthread_mutex_unlock(&loop->pending_lock);
+}
+
+static void loop_wait_zero(device_loop_t *loop)
+{
+	pthread_mutex_lock(&loop->pending_lock);
+	while (loop->pending)
+		pthread_cond_wait(&loop->pending_cond, &loop->pending_lock);
+	pthread_mutex_unlock(&loop->pending_lock);
+}
+
+/* Pins the calling thread to a CPU, a negative one leaves it free */
+static void pin_thread(int cpu)
+{
+	if (cpu < 0)
+		return;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		printf("Warning: Cannot pin a thread to CPU %d\n", cpu);
+#else
+	printf("Warning: Threads are only pinned to a CPU on Linux\n");
+#endif
+}
+
+static uint32_t monotonic_usec(void)
+{
+	return (uint32_t)(monotonic_nsec() / 1000);
+}
+
+static void synthetic_fill(buffer_ring_t *buf, int is_depth, uint32_t frame)
+{
+	int x, y;
+	if (!is_depth && buf->fmt == FREENECT_VIDEO_RGB) {
+		unsigned char *rgb = (unsigned char *)buf->producer;
+		for (y = 0; y < 480; ++y)
+			for (x = 0; x < 640; ++x) {
+				*rgb++ = x + frame;
+				*rgb++ = y + frame;
+				*rgb++ = x ^ y;
+			}
+	} else if (is_depth && buf->fmt != FREENECT_DEPTH_11BIT_PACKED && buf->fmt != FREENECT_DEPTH_10BIT_PACKED) {
+		uint16_t *depth = (uint16_t *)buf->producer;
+		for (y = 0; y < 480; ++y)
+			for (x = 0; x < 640; ++x)
+				*depth++ = 400 + ((x + 2 * y + frame) & 1023);
+	} else {
+		memset(buf->producer, frame, buf->size);
+	}
+}
+
+/* Reads the next record of the replay file, see freenect_sync_set_source for the layout */
+static void replay_fill(sync_kinect_t *kinect, buffer_ring_t *buf, uint32_t frame)
+{
+	int is_depth = buf == &kinect->depth;
+	if (buf->fmt != (is_depth ? FREENECT_DEPTH_11BIT : FREENECT_VIDEO_RGB)) {
+		synthetic_fill(buf, is_depth, frame);
+		return;
+	}
+	long video_sz = freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB).bytes;
+	long depth_sz = freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT).bytes;
+	long record = (long)(frame % kinect->replay_frames) * (video_sz + depth_sz);
+	fseek(kinect->replay, record + (is_depth ? video_sz : 0), SEEK_SET);
+	if (fread(buf->producer, buf->size, 1, kinect->replay) != 1)
+		memset(buf->producer, 0, buf->size);
+}
+
+/* Copies the next frame of the recording, returns the timestamp it was recorded with */
+static uint32_t recording_fill(sync_kinect_t *kinect, buffer_ring_t *buf, uint32_t frame)
+{
+	int is_depth = buf == &kinect->depth;
+	long count = kinect_playback_count(kinect->playback, is_depth);
+	const kinect_record_chunk *chunk = count ? kinect_playback_chunk(kinect->playback, is_depth, frame % count) : NULL;
+	const void *data;
+	uint32_t timestamp;
+	// A raw chunk is copied as is, it must hold exactly one frame of the ring
+	if (!chunk || chunk->fmt != (uint32_t)buf->fmt ||
+	    (chunk->codec == KINECT_RECORD_RAW && chunk->size != (uint32_t)buf->size) ||
+	    kinect_playback_frame(kinect->playback, is_depth, frame % count, &data, &timestamp)) {
+		synthetic_fill(buf, is_depth, frame);
+		return monotonic_usec();
+	}
+	memcpy(buf->producer, data, buf->size);
+	return timestamp;
+}
+
+static void feed_stream(sync_kinect_t *kinect, buffer_ring_t *buf, uint32_t frame)
+{
+	if (buf->fmt == -1)
+		return;
+	uint32_t timestamp = monotonic_usec();
+	if (kinect->source == FREENECT_SYNC_SOURCE_REPLAY)
+		replay_fill(kinect, buf, frame);
+	else if (kinect->source == FREENECT_SYNC_SOURCE_RECORDING)
+		timestamp = recording_fill(kinect, buf, frame);
+	else
+		synthetic_fill(buf, buf == &kinect->depth, frame);
+	producer_cb_inner(NULL, buf->producer, timestamp, buf, feeder_set_buffer);
+}
+
+/* Stands in for the libfreenect callbacks of synthetic and replay sources, under the lock of its own loop */
+static void *feeder(void *arg)
+{
+	sync_kinect_t *kinect = (sync_kinect_t *)arg;
+	device_loop_t *loop = kinect->loop;
+	struct timespec next;
+	long period = kinect->fps > 0 ? (long)(1e9 / kinect->fps) : 0;
+	uint32_t frame = 0;
+	pin_thread(kinect->cpu);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	loop_wait_zero(loop);
+	pthread_mutex_lock(&loop->lock);
+	while (loop->running) {
+		feed_stream(kinect, &kinect->video, frame);
+		feed_stream(kinect, &kinect->depth, frame);
+		pthread_mutex_unlock(&loop->lock);
+		++frame;
+		if (period) {
+			next.tv_nsec += period;
+			while (next.tv_nsec >= 1000000000) {
+				next.tv_nsec -= 1000000000;
+				++next.tv_sec;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+		loop_wait_zero(loop);
+		pthread_mutex_lock(&loop->lock);
+	}
+	pthread_mutex_unlock(&loop->lock);
+	return NULL;
+}
+
+/* Processes the events of a device with its own context, in parallel with the other devices */
+static void *device_events(void *arg)
+{
+	sync_kinect_t *kinect = (sync_kinect_t *)arg;
+	device_loop_t *loop = kinect->loop;
+	pin_thread(kinect->cpu);
+	loop_wait_zero(loop);
+	pthread_mutex_lock(&loop->lock);
+	while (loop->running && freenect_process_events(loop->ctx) >= 0) {
+		pthread_mutex_unlock(&loop->lock);
+		loop_wait_zero(loop);
+		pthread_mutex_lock(&loop->lock);
+	}
+	pthread_mutex_unlock(&loop->lock);
+	return NULL;
+}
+
+static void free_device_loop(device_loop_t *loop)
+{
+	if (loop->ctx)
+		freenect_shutdown(loop->ctx);
+	pthread_mutex_destroy(&loop->lock);
+	pthread_mutex_destroy(&loop->pending_lock);
+	pthread_cond_destroy(&loop->pending_cond);
+	free(loop);
+}
+
 static void *init(void *unused)
 {
 	pending_runloop_tasks_wait_zero();
 	pthread_mutex_lock(&runloop_lock);
-	while (thread_running && freenect_process_events(ctx) >= 0) {
+	while (thread_running && (!ctx || freenect_process_events(ctx) >= 0)) {
+		// Without a device source there is no libusb event to wait for
+		int idle = !ctx;
 		pthread_mutex_unlock(&runloop_lock);
+		if (idle) {
+			struct timespec tick = {0, 10000000};
+			nanosleep(&tick, NULL);
+		}
 		// NOTE: This lets you run tasks while process_events isn't running
 		pending_runloop_tasks_wait_zero();
 		pthread_mutex_lock(&runloop_lock);
 	}
-	// Go through each device, call stop video, close device
+	// Event threads and feeders take the lock of their loop for every frame, stop them before tearing down
 	int i;
+	for (i = 0; i < MAX_KINECTS; ++i)
+		if (kinects[i]) {
+			if (kinects[i]->loop) {
+				loop_enter(kinects[i]->loop);
+				kinects[i]->loop->running = 0;
+				loop_exit(kinects[i]->loop);
+			}
+		}
+	pthread_mutex_unlock(&runloop_lock);
+	// The streams still run, so the event threads see the flag at their next frame
+	for (i = 0; i < MAX_KINECTS; ++i)
+		if (kinects[i] && kinects[i]->loop)
+			pthread_join(kinects[i]->loop->thread, NULL);
+	pthread_mutex_lock(&runloop_lock);
+	// Go through each device, call stop video, close device
 	for (i = 0; i < MAX_KINECTS; ++i) {
 		if (kinects[i]) {
-			freenect_stop_video(kinects[i]->dev);
-			freenect_stop_depth(kinects[i]->dev);
-			freenect_set_user(kinects[i]->dev, NULL);
-			freenect_close_device(kinects[i]->dev);
+			if (kinects[i]->dev) {
+				freenect_stop_video(kinects[i]->dev);
+				freenect_stop_depth(kinects[i]->dev);
+				freenect_set_user(kinects[i]->dev, NULL);
+				freenect_close_device(kinects[i]->dev);
+			}
+			if (kinects[i]->loop)
+				free_device_loop(kinects[i]->loop);
+			if (kinects[i]->replay)
+				fclose(kinects[i]->replay);
+			if (kinects[i]->playback)
+				kinect_playback_close(kinects[i]->playback);
+			// The producers are stopped, the ring locks keep out the consumers
+			pthread_mutex_lock(&kinects[i]->video.lock);
 			free_buffer_ring(&kinects[i]->video);
+			if (kinects[i]->video.fd >= 0)
+				close(kinects[i]->video.fd);
+			pthread_mutex_unlock(&kinects[i]->video.lock);
+			pthread_mutex_lock(&kinects[i]->depth.lock);
 			free_buffer_ring(&kinects[i]->depth);
+			if (kinects[i]->depth.fd >= 0)
+				close(kinects[i]->depth.fd);
+			pthread_mutex_unlock(&kinects[i]->depth.lock);
+			// A release looks the kinect up under leases_lock, it only finds it live
+			pthread_mutex_lock(&leases_lock);
+			free(kinects[i]->video.spares);
+			free(kinects[i]->depth.spares);
 			free(kinects[i]);
 			kinects[i] = NULL;
+			pthread_mutex_unlock(&leases_lock);
 		}
 	}
-	freenect_shutdown(ctx);
+	if (ctx) {
+		freenect_shutdown(ctx);
+		ctx = NULL;
+	}
 	pthread_mutex_unlock(&runloop_lock);
 	return NULL;
 }
@@ -208,58 +688,179 @@ static void *init(void *unused)
 static void init_thread(void)
 {
 	thread_running = 1;
-	freenect_init(&ctx, 0);
+	pthread_create(&thread, NULL, init, NULL);
+}
+
+/* The libfreenect context is only created once a device source needs it */
+static int init_context(void)
+{
+	if (ctx)
+		return 0;
+	if (freenect_init(&ctx, 0) < 0) {
+		ctx = NULL;
+		return -1;
+	}
 	// We claim both the motor and the camera, because we can't know in advance
 	// which devices the caller will want, and the c_sync interface doesn't
 	// support audio, so there's no reason to claim the device needlessly.
 	freenect_select_subdevices(ctx, (freenect_device_flags)(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA));
-	pthread_create(&thread, NULL, init, NULL);
+	return 0;
 }
 
 static int change_video_format(sync_kinect_t *kinect, freenect_video_format fmt)
 {
-	freenect_stop_video(kinect->dev);
+	if (kinect->dev)
+		freenect_stop_video(kinect->dev);
 	free_buffer_ring(&kinect->video);
 	if (alloc_buffer_ring_video(fmt, &kinect->video))
 		return -1;
-	freenect_set_video_mode(kinect->dev, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, fmt));
-	freenect_set_video_buffer(kinect->dev, kinect->video.bufs[2]);
-	freenect_start_video(kinect->dev);
+	if (kinect->dev) {
+		freenect_set_video_mode(kinect->dev, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, fmt));
+		freenect_set_video_buffer(kinect->dev, kinect->video.producer);
+		freenect_start_video(kinect->dev);
+	}
 	return 0;
 }
 
 static int change_depth_format(sync_kinect_t *kinect, freenect_depth_format fmt)
 {
-	freenect_stop_depth(kinect->dev);
+	if (kinect->dev)
+		freenect_stop_depth(kinect->dev);
 	free_buffer_ring(&kinect->depth);
 	if (alloc_buffer_ring_depth(fmt, &kinect->depth))
 		return -1;
-	freenect_set_depth_mode(kinect->dev, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, fmt));
-	freenect_set_depth_buffer(kinect->dev, kinect->depth.bufs[2]);
-	freenect_start_depth(kinect->dev);
+	if (kinect->dev) {
+		freenect_set_depth_mode(kinect->dev, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, fmt));
+		freenect_set_depth_buffer(kinect->dev, kinect->depth.producer);
+		freenect_start_depth(kinect->dev);
+	}
+	return 0;
+}
+
+/* A loop without context, for a feeder, its thread is started once the kinect is set up */
+static device_loop_t *alloc_device_loop(void)
+{
+	device_loop_t *loop = (device_loop_t *)calloc(1, sizeof(device_loop_t));
+	pthread_mutex_init(&loop->lock, NULL);
+	pthread_mutex_init(&loop->pending_lock, NULL);
+	pthread_cond_init(&loop->pending_cond, NULL);
+	return loop;
+}
+
+/* Opens a device in a context of its own, the event thread is started once the kinect is set up */
+static int open_own_device(sync_kinect_t *kinect, int index)
+{
+	device_loop_t *loop = alloc_device_loop();
+	if (freenect_init(&loop->ctx, 0) < 0) {
+		loop->ctx = NULL;
+		free_device_loop(loop);
+		return -1;
+	}
+	freenect_select_subdevices(loop->ctx, (freenect_device_flags)(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA));
+	if (freenect_open_device(loop->ctx, &kinect->dev, index) < 0) {
+		free_device_loop(loop);
+		return -1;
+	}
+	kinect->loop = loop;
+	return 0;
+}
+
+static int open_source(sync_kinect_t *kinect, int index)
+{
+	source_config_t *config = &sources[index];
+	kinect->source = config->source;
+	kinect->fps = config->fps;
+	kinect->cpu = config->cpu - 1;
+	kinect->dev = NULL;
+	kinect->loop = NULL;
+	kinect->replay = NULL;
+	kinect->replay_frames = 0;
+	kinect->playback = NULL;
+	if (config->source == FREENECT_SYNC_SOURCE_DEVICE) {
+		if (config->own_thread)
+			return open_own_device(kinect, index);
+		if (init_context())
+			return -1;
+		return freenect_open_device(ctx, &kinect->dev, index);
+	}
+	if (config->source == FREENECT_SYNC_SOURCE_REPLAY) {
+		long record = freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB).bytes +
+			freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT).bytes;
+		kinect->replay = fopen(config->path, "rb");
+		if (!kinect->replay) {
+			printf("Error: Cannot open replay file %s\n", config->path);
+			return -1;
+		}
+		fseek(kinect->replay, 0, SEEK_END);
+		kinect->replay_frames = ftell(kinect->replay) / record;
+		if (!kinect->replay_frames) {
+			printf("Error: Replay file %s holds no complete frame\n", config->path);
+			fclose(kinect->replay);
+			return -1;
+		}
+	}
+	if (config->source == FREENECT_SYNC_SOURCE_RECORDING) {
+		kinect->playback = kinect_playback_open(config->path);
+		if (!kinect->playback)
+			return -1;
+		if (!kinect_playback_count(kinect->playback, 0) && !kinect_playback_count(kinect->playback, 1)) {
+			printf("Error: Recording %s holds no frame\n", config->path);
+			kinect_playback_close(kinect->playback);
+			return -1;
+		}
+	}
 	return 0;
 }
 
 static sync_kinect_t *alloc_kinect(int index)
 {
 	sync_kinect_t *kinect = (sync_kinect_t*)malloc(sizeof(sync_kinect_t));
-	if (freenect_open_device(ctx, &kinect->dev, index)) {
+	if (open_source(kinect, index)) {
 		free(kinect);
 		return NULL;
 	}
-	int i;
-	for (i = 0; i < 3; ++i) {
-		kinect->video.bufs[i] = NULL;
-		kinect->depth.bufs[i] = NULL;
-	}
+	kinect->video.producer = kinect->depth.producer = NULL;
+	kinect->video.frames = kinect->depth.frames = NULL;
+	kinect->video.state = kinect->depth.state = RING_STATE(0, 0, 1);
+	kinect->video.seq = kinect->depth.seq = 0;
+	kinect->video.waiters = kinect->depth.waiters = 0;
+	kinect->video.fd = kinect->depth.fd = -1;
+	kinect->video.nbufs = sources[index].video.nbufs ? sources[index].video.nbufs : 3;
+	kinect->depth.nbufs = sources[index].depth.nbufs ? sources[index].depth.nbufs : 3;
+	kinect->video.policy = sources[index].video.policy;
+	kinect->depth.policy = sources[index].depth.policy;
 	kinect->video.fmt = -1;
 	kinect->depth.fmt = -1;
-	freenect_set_video_callback(kinect->dev, video_producer_cb);
-	freenect_set_depth_callback(kinect->dev, depth_producer_cb);
+	kinect->video.spares = kinect->depth.spares = NULL;
+	kinect->video.nspares = kinect->depth.nspares = 0;
+	kinect->video.index = kinect->depth.index = index;
+	kinect->video.is_depth = 0;
+	kinect->depth.is_depth = 1;
 	pthread_mutex_init(&kinect->video.lock, NULL);
 	pthread_mutex_init(&kinect->depth.lock, NULL);
-	pthread_cond_init(&kinect->video.cb_cond, NULL);
-	pthread_cond_init(&kinect->depth.cb_cond, NULL);
+#ifndef __linux__
+	// Deadlines of timed waits are on the same clock as the frame ages
+	pthread_condattr_t cond_attr;
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&kinect->video.cb_cond, &cond_attr);
+	pthread_cond_init(&kinect->depth.cb_cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+#endif
+	if (kinect->dev) {
+		freenect_set_video_callback(kinect->dev, video_producer_cb);
+		freenect_set_depth_callback(kinect->dev, depth_producer_cb);
+		if (kinect->loop) {
+			// No stream is started yet, so no callback comes before freenect_set_user
+			kinect->loop->running = 1;
+			pthread_create(&kinect->loop->thread, NULL, device_events, kinect);
+		}
+	} else {
+		// Each feeder publishes under the lock of its own loop, in parallel with the other devices
+		kinect->loop = alloc_device_loop();
+		kinect->loop->running = 1;
+		pthread_create(&kinect->loop->thread, NULL, feeder, kinect);
+	}
 	return kinect;
 }
 
@@ -271,7 +872,10 @@ static int setup_kinect(int index, int fmt, int is_depth)
 	if (!thread_running)
 		init_thread();
 	if (!kinects[index]) {
-		kinects[index] = alloc_kinect(index);
+		sync_kinect_t *kinect = alloc_kinect(index);
+		pthread_mutex_lock(&leases_lock);
+		kinects[index] = kinect;
+		pthread_mutex_unlock(&leases_lock);
 	}
 	if (!kinects[index]) {
 		printf("Error: Invalid index [%d]\n", index);
@@ -287,7 +891,12 @@ static int setup_kinect(int index, int fmt, int is_depth)
 		}
 		return -1;
 	}
-	freenect_set_user(kinects[index]->dev, kinects[index]);
+	// A device with its own loop is changed between its own events
+	device_loop_t *loop = kinects[index]->loop;
+	if (loop)
+		loop_enter(loop);
+	if (kinects[index]->dev)
+		freenect_set_user(kinects[index]->dev, kinects[index]);
 	buffer_ring_t *buf;
 	if (is_depth)
 		buf = &kinects[index]->depth;
@@ -301,26 +910,259 @@ static int setup_kinect(int index, int fmt, int is_depth)
 			change_video_format(kinects[index], (freenect_video_format)fmt);
 	}
 	pthread_mutex_unlock(&buf->lock);
+	if (loop)
+		loop_exit(loop);
 	pthread_mutex_unlock(&runloop_lock);
 	pending_runloop_tasks_dec();
 	return 0;
 }
 
-static int sync_get(void **data, uint32_t *timestamp, buffer_ring_t *buf)
+/* Takes the consumer buffer out of the ring for the caller, the ring goes on with a spare */
+static void lease_consumer_buffer(buffer_ring_t *buf)
+{
+	frame_t *frame = &buf->frames[buf->consumer];
+	pthread_mutex_lock(&leases_lock);
+	int *n = &nleases[buf->index][buf->is_depth];
+	leases[buf->index][buf->is_depth] = (lease_t *)realloc(leases[buf->index][buf->is_depth], (*n + 1) * sizeof(lease_t));
+	leases[buf->index][buf->is_depth][*n].data = frame->data;
+	leases[buf->index][buf->is_depth][*n].size = buf->size;
+	++*n;
+	frame->data = NULL;
+	// Spares released while the format changed have the old size
+	while (buf->nspares && !frame->data) {
+		lease_t *spare = &buf->spares[--buf->nspares];
+		if (spare->size == buf->size)
+			frame->data = spare->data;
+		else
+			free(spare->data);
+	}
+	pthread_mutex_unlock(&leases_lock);
+	if (!frame->data)
+		frame->data = malloc(buf->size);
+}
+
+/* Clears the descriptor of the ring once nothing is queued, a frame published meanwhile signals it again */
+static void ring_clear_fd(buffer_ring_t *buf)
+{
+#ifdef __linux__
+	eventfd_t n;
+	if (buf->fd < 0 || RING_COUNT(__atomic_load_n(&buf->state, __ATOMIC_SEQ_CST)))
+		return;
+	if (!eventfd_read(buf->fd, &n) && RING_COUNT(__atomic_load_n(&buf->state, __ATOMIC_SEQ_CST)))
+		eventfd_write(buf->fd, 1);
+#endif
+}
+
+/*
+  Makes the i-th frame queued in state the consumer frame, the older ones are
+  dropped and the previous consumer frame becomes idle. Returns 1 if the
+  producer changed the ring since state was read, nothing is taken then and
+  state is reloaded.
+ */
+static int take_queued_frame(buffer_ring_t *buf, uint64_t *state, int i)
+{
+	int id = RING_SLOT(*state, i);
+	uint64_t taken = RING_STATE((*state >> 8) >> 4 * (i + 1), RING_COUNT(*state) - i - 1, id);
+	if (!__atomic_compare_exchange_n(&buf->state, state, taken, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return 1;
+	freenect_sync_stats *stats = &telemetry[buf->index][buf->is_depth];
+	stat_add(&stats->dropped, i);
+	buf->consumer = id;
+	buf->held = 1;
+	stat_add(&stats->delivered, 1);
+	histogram_add(&stats->latency, monotonic_nsec() - buf->frames[id].published_ns);
+	ring_clear_fd(buf);
+	return 0;
+}
+
+/* Loads the state after seq, a frame published in between wakes ring_wait at once */
+static uint64_t ring_snapshot(buffer_ring_t *buf, uint32_t *seq)
 {
+	*seq = __atomic_load_n(&buf->seq, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&buf->state, __ATOMIC_SEQ_CST);
+}
+
+/*
+  Waits up to timeout_ms for a new frame (forever if negative, not at all if
+  zero). When none comes in time, the frame the consumer already holds is
+  returned again. Returns 1 if there is no such frame either.
+ */
+static int sync_get(void **data, uint32_t *timestamp, buffer_ring_t *buf, int lease, int timeout_ms, freenect_sync_frame_info *info)
+{
+	uint64_t start = monotonic_nsec();
+	struct timespec deadline;
+	if (timeout_ms > 0) {
+		uint64_t end = start + timeout_ms * 1000000ull;
+		deadline.tv_sec = end / 1000000000ull;
+		deadline.tv_nsec = end % 1000000000ull;
+	}
 	pthread_mutex_lock(&buf->lock);
 	// If there isn't a frame ready for us
-	while (!buf->valid)
-		pthread_cond_wait(&buf->cb_cond, &buf->lock);
-	void *temp_buf = buf->bufs[0];
-	*data = buf->bufs[0] = buf->bufs[1];
-	buf->bufs[1] = temp_buf;
-	buf->valid = 0;
-	*timestamp = buf->timestamp;
+	int late = 0;
+	uint32_t seq;
+	while (!RING_COUNT(ring_snapshot(buf, &seq)) && !late)
+		late = !timeout_ms || ring_wait(buf, seq, timeout_ms, &deadline);
+	uint64_t ready = monotonic_nsec();
+	freenect_sync_stats *stats = &telemetry[buf->index][buf->is_depth];
+	stat_set(&stats->last_wait_ns, ready - start);
+	histogram_add(&stats->wait, ready - start);
+	uint64_t state = __atomic_load_n(&buf->state, __ATOMIC_ACQUIRE);
+	if (RING_COUNT(state)) {
+		// Only the newest frame matters to the latest policy, the older ones are dropped.
+		// The producer only ever adds to the queue, so it is never found empty again
+		while (take_queued_frame(buf, &state, buf->policy == FREENECT_SYNC_LATEST ? RING_COUNT(state) - 1 : 0))
+			;
+		late = 0;
+	} else if (!buf->held) {
+		pthread_mutex_unlock(&buf->lock);
+		return 1;
+	}
+	frame_t *frame = &buf->frames[buf->consumer];
+	*data = frame->data;
+	*timestamp = frame->timestamp;
+	if (info) {
+		info->is_new = !late;
+		info->age = (ready - frame->published_ns) / 1e9;
+	}
+	if (lease) {
+		lease_consumer_buffer(buf);
+		buf->held = 0;
+	}
+	stat_set(&stats->last_swap_ns, monotonic_nsec() - ready);
 	pthread_mutex_unlock(&buf->lock);
 	return 0;
 }
 
+/* Timestamps wrap around, their difference does not */
+static int64_t timestamp_skew(uint32_t a, uint32_t b)
+{
+	return llabs((int64_t)(int32_t)(a - b));
+}
+
+/* Timestamp of the i-th frame queued in state, the producer may recycle it meanwhile */
+static uint32_t queued_timestamp(buffer_ring_t *buf, uint64_t state, int i)
+{
+	return __atomic_load_n(&buf->frames[RING_SLOT(state, i)].timestamp, __ATOMIC_RELAXED);
+}
+
+/* Position of the frame queued in state closest in time to timestamp, the newest wins a tie */
+static int closest_frame(buffer_ring_t *buf, uint64_t state, uint32_t timestamp, int64_t *skew)
+{
+	int i, pos = 0;
+	*skew = -1;
+	for (i = 0; i < RING_COUNT(state); ++i) {
+		int64_t s = timestamp_skew(queued_timestamp(buf, state, i), timestamp);
+		if (*skew < 0 || s <= *skew) {
+			*skew = s;
+			pos = i;
+		}
+	}
+	return pos;
+}
+
+/*
+  Finds the queued video and depth frames closest in time, the newest pair
+  wins a tie. Both states must hold at least one frame. A frame recycled
+  since may be looked at, taking from a changed state fails then.
+ */
+static int64_t closest_pair(buffer_ring_t *video, uint64_t video_state, buffer_ring_t *depth, uint64_t depth_state, int *video_pos, int *depth_pos)
+{
+	int64_t best = -1, skew;
+	int i;
+	for (i = 0; i < RING_COUNT(video_state); ++i) {
+		int j = closest_frame(depth, depth_state, queued_timestamp(video, video_state, i), &skew);
+		if (best < 0 || skew <= best) {
+			best = skew;
+			*video_pos = i;
+			*depth_pos = j;
+		}
+	}
+	return best;
+}
+
+/*
+  Waits up to timeout_ms for a video and a depth frame no more than max_skew
+  apart (the closest pair if max_skew is negative), then hands both out.
+  Only frames not handed out yet are paired. Returns 1 if no pair came in time.
+
+  Locks the video ring before the depth ring, nothing else holds both.
+ */
+static int sync_get_pair(void **video, uint32_t *video_timestamp, void **depth, uint32_t *depth_timestamp, sync_kinect_t *kinect, int64_t max_skew, int timeout_ms, freenect_sync_frame_info *video_info, freenect_sync_frame_info *depth_info)
+{
+	uint64_t start = monotonic_nsec();
+	struct timespec deadline;
+	if (timeout_ms > 0) {
+		uint64_t end = start + timeout_ms * 1000000ull;
+		deadline.tv_sec = end / 1000000000ull;
+		deadline.tv_nsec = end % 1000000000ull;
+	}
+	buffer_ring_t *v = &kinect->video, *d = &kinect->depth;
+	int video_pos = 0, depth_pos = 0;
+	uint64_t video_state, depth_state;
+	for (;;) {
+		pthread_mutex_lock(&v->lock);
+		pthread_mutex_lock(&d->lock);
+		uint32_t video_seq, depth_seq;
+		video_state = ring_snapshot(v, &video_seq);
+		depth_state = ring_snapshot(d, &depth_seq);
+		if (RING_COUNT(video_state) && RING_COUNT(depth_state)) {
+			int64_t skew = closest_pair(v, video_state, d, depth_state, &video_pos, &depth_pos);
+			if (max_skew < 0 || skew <= max_skew) {
+				if (!take_queued_frame(v, &video_state, video_pos))
+					break;
+				// The video producer got in first, pair again
+				pthread_mutex_unlock(&d->lock);
+				pthread_mutex_unlock(&v->lock);
+				continue;
+			}
+		}
+		// Wait on the stream lagging behind, its next frame may complete a pair
+		buffer_ring_t *lagging;
+		if (!RING_COUNT(video_state))
+			lagging = v;
+		else if (!RING_COUNT(depth_state))
+			lagging = d;
+		else
+			lagging = (int32_t)(queued_timestamp(v, video_state, RING_COUNT(video_state) - 1) -
+			                    queued_timestamp(d, depth_state, RING_COUNT(depth_state) - 1)) < 0 ? v : d;
+		pthread_mutex_unlock(lagging == v ? &d->lock : &v->lock);
+		int late = !timeout_ms || ring_wait(lagging, lagging == v ? video_seq : depth_seq, timeout_ms, &deadline);
+		pthread_mutex_unlock(&lagging->lock);
+		if (late)
+			return 1;
+	}
+	// The video frame is taken. If the depth producer got in first, the depth frame closest
+	// to it goes instead: the producer only adds to the queue, so there is one
+	int64_t skew;
+	while (take_queued_frame(d, &depth_state, depth_pos))
+		depth_pos = closest_frame(d, depth_state, v->frames[v->consumer].timestamp, &skew);
+	uint64_t ready = monotonic_nsec();
+	frame_t *video_frame = &v->frames[v->consumer], *depth_frame = &d->frames[d->consumer];
+	*video = video_frame->data;
+	*video_timestamp = video_frame->timestamp;
+	*depth = depth_frame->data;
+	*depth_timestamp = depth_frame->timestamp;
+	if (video_info) {
+		video_info->is_new = 1;
+		video_info->age = (ready - video_frame->published_ns) / 1e9;
+	}
+	if (depth_info) {
+		depth_info->is_new = 1;
+		depth_info->age = (ready - depth_frame->published_ns) / 1e9;
+	}
+	freenect_sync_stats *video_stats = &telemetry[v->index][0], *depth_stats = &telemetry[d->index][1];
+	stat_set(&video_stats->last_wait_ns, ready - start);
+	stat_set(&depth_stats->last_wait_ns, ready - start);
+	histogram_add(&video_stats->wait, ready - start);
+	histogram_add(&depth_stats->wait, ready - start);
+	uint64_t swap_ns = monotonic_nsec() - ready;
+	stat_set(&video_stats->last_swap_ns, swap_ns);
+	stat_set(&depth_stats->last_swap_ns, swap_ns);
+	pthread_mutex_unlock(&d->lock);
+	pthread_mutex_unlock(&v->lock);
+	return 0;
+}
+
 
 /*
   Use this to make sure the runloop is locked and no one is in it. Then you can
@@ -341,13 +1183,22 @@ static int runloop_enter(int index)
 		if (setup_kinect(index, FREENECT_DEPTH_11BIT, 1))
 			return -1;
 
+	// A device with its own loop does not wait on the others
+	if (kinects[index]->loop) {
+		loop_enter(kinects[index]->loop);
+		return 0;
+	}
 	pending_runloop_tasks_inc();
 	pthread_mutex_lock(&runloop_lock);
 	return 0;
 }
 
-static void runloop_exit()
+static void runloop_exit(int index)
 {
+	if (kinects[index]->loop) {
+		loop_exit(kinects[index]->loop);
+		return;
+	}
 	pthread_mutex_unlock(&runloop_lock);
 	pending_runloop_tasks_dec();
 }
@@ -357,6 +1208,31 @@ int wrap_setup_kinect(int index, int fmt, int is_depth)
   return setup_kinect(index, fmt, is_depth);
 }
 
+int freenect_sync_set_source(int index, freenect_sync_source source, const char *path, double fps)
+{
+	if (index < 0 || index >= MAX_KINECTS) {
+		printf("Error: Invalid index [%d]\n", index);
+		return -1;
+	}
+	if ((source == FREENECT_SYNC_SOURCE_REPLAY || source == FREENECT_SYNC_SOURCE_RECORDING) && !path) {
+		printf("Error: A replay or recording source needs a file\n");
+		return -1;
+	}
+	pthread_mutex_lock(&runloop_lock);
+	if (kinects[index]) {
+		pthread_mutex_unlock(&runloop_lock);
+		printf("Error: Kinect [%d] is already running\n", index);
+		return -1;
+	}
+	source_config_t *config = &sources[index];
+	free(config->path);
+	config->path = path ? strdup(path) : NULL;
+	config->source = source;
+	config->fps = fps;
+	pthread_mutex_unlock(&runloop_lock);
+	return 0;
+}
+
 
 int freenect_sync_get_video(void **video, uint32_t *timestamp, int index, freenect_video_format fmt)
 {
@@ -367,7 +1243,7 @@ int freenect_sync_get_video(void **video, uint32_t *timestamp, int index, freene
 	if (!thread_running || !kinects[index] || kinects[index]->video.fmt != fmt)
 		if (setup_kinect(index, fmt, 0))
 			return -1;
-	sync_get(video, timestamp, &kinects[index]->video);
+	sync_get(video, timestamp, &kinects[index]->video, 0, -1, NULL);
 	return 0;
 }
 
@@ -380,30 +1256,401 @@ int freenect_sync_get_depth(void **depth, uint32_t *timestamp, int index, freene
 	if (!thread_running || !kinects[index] || kinects[index]->depth.fmt != fmt)
 		if (setup_kinect(index, fmt, 1))
 			return -1;
-	sync_get(depth, timestamp, &kinects[index]->depth);
+	sync_get(depth, timestamp, &kinects[index]->depth, 0, -1, NULL);
+	return 0;
+}
+
+int freenect_sync_get_video_timeout(void **video, uint32_t *timestamp, int index, freenect_video_format fmt, int timeout_ms, freenect_sync_frame_info *info)
+{
+	if (index < 0 || index >= MAX_KINECTS) {
+		printf("Error: Invalid index [%d]\n", index);
+		return -1;
+	}
+	if (!thread_running || !kinects[index] || kinects[index]->video.fmt != fmt)
+		if (setup_kinect(index, fmt, 0))
+			return -1;
+	return sync_get(video, timestamp, &kinects[index]->video, 0, timeout_ms, info);
+}
+
+int freenect_sync_get_depth_timeout(void **depth, uint32_t *timestamp, int index, freenect_depth_format fmt, int timeout_ms, freenect_sync_frame_info *info)
+{
+	if (index < 0 || index >= MAX_KINECTS) {
+		printf("Error: Invalid index [%d]\n", index);
+		return -1;
+	}
+	if (!thread_running || !kinects[index] || kinects[index]->depth.fmt != fmt)
+		if (setup_kinect(index, fmt, 1))
+			return -1;
+	return sync_get(depth, timestamp, &kinects[index]->depth, 0, timeout_ms, info);
+}
+
+int freenect_sync_lease_video(void **video, uint32_t *timestamp, int index, freenect_video_format fmt)
+{
+	if (index < 0 || index >= MAX_KINECTS) {
+		printf("Error: Invalid index [%d]\n", index);
+		return -1;
+	}
+	if (!thread_running || !kinects[index] || kinects[index]->video.fmt != fmt)
+		if (setup_kinect(index, fmt, 0))
+			return -1;
+	sync_get(video, timestamp, &kinects[index]->video, 1, -1, NULL);
+	return 0;
+}
+
+int freenect_sync_lease_depth(void **depth, uint32_t *timestamp, int index, freenect_depth_format fmt)
+{
+	if (index < 0 || index >= MAX_KINECTS) {
+		printf("Error: Invalid index [%d]\n", index);
+		return -1;
+	}
+	if (!thread_running || !kinects[index] || kinects[index]->depth.fmt != fmt)
+		if (setup_kinect(index, fmt, 1))
+			return -1;
+	sync_get(depth, timestamp, &kinects[index]->depth, 1, -1, NULL);
+	return 0;
+}
+
+/* Position of the lease of data among the ones of a stream, -1 if it is none. Call with leases_lock held */
+static int find_lease(const void *data, int index, int is_depth)
+{
+	int i;
+	for (i = 0; i < nleases[index][is_depth]; ++i)
+		if (leases[index][is_depth][i].data == data)
+			return i;
+	return -1;
+}
+
+int freenect_sync_is_leased(const void *data, int index, int is_depth)
+{
+	if (index < 0 || index >= MAX_KINECTS || !data)
+		return 0;
+	pthread_mutex_lock(&leases_lock);
+	int leased = find_lease(data, index, is_depth ? 1 : 0) >= 0;
+	pthread_mutex_unlock(&leases_lock);
+	return leased;
+}
+
+int freenect_sync_release(void *data, int index, int is_depth)
+{
+	if (index < 0 || index >= MAX_KINECTS) {
+		printf("Error: Invalid index [%d]\n", index);
+		return -1;
+	}
+	is_depth = is_depth ? 1 : 0;
+	pthread_mutex_lock(&leases_lock);
+	int i = data ? find_lease(data, index, is_depth) : -1;
+	if (i < 0) {
+		pthread_mutex_unlock(&leases_lock);
+		printf("Error: Buffer %p is not leased from Kinect [%d]\n", data, index);
+		return -1;
+	}
+	lease_t lease = leases[index][is_depth][i];
+	leases[index][is_depth][i] = leases[index][is_depth][--nleases[index][is_depth]];
+	// A ring still running reuses the buffer, else nobody else knows it. The teardown of a kinect
+	// takes leases_lock too, so it is looked up under the lock the lease was taken with
+	if (kinects[index]) {
+		buffer_ring_t *buf = is_depth ? &kinects[index]->depth : &kinects[index]->video;
+		buf->spares = (lease_t *)realloc(buf->spares, (buf->nspares + 1) * sizeof(lease_t));
+		buf->spares[buf->nspares++] = lease;
+		pthread_mutex_unlock(&leases_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&leases_lock);
+	free(data);
+	return 0;
+}
+
+int freenect_sync_get_pair(void **video, uint32_t *video_timestamp, void **depth, uint32_t *depth_timestamp, int index, freenect_video_format video_fmt, freenect_depth_format depth_fmt, int64_t max_skew, int timeout_ms, freenect_sync_frame_info *video_info, freenect_sync_frame_info *depth_info)
+{
+	if (index < 0 || index >= MAX_KINECTS) {
+		printf("Error: Invalid index [%d]\n", index);
+		return -1;
+	}
+	if (!thread_running || !kinects[index] || kinects[index]->video.fmt != video_fmt)
+		if (setup_kinect(index, video_fmt, 0))
+			return -1;
+	if (kinects[index]->depth.fmt != depth_fmt)
+		if (setup_kinect(index, depth_fmt, 1))
+			return -1;
+	return sync_get_pair(video, video_timestamp, depth, depth_timestamp, kinects[index], max_skew, timeout_ms, video_info, depth_info);
+}
+
+int freenect_sync_set_ring(int index, int is_depth, int nbufs, freenect_sync_policy policy)
+{
+	if (index < 0 || index >= MAX_KINECTS) {
+		printf("Error: Invalid index [%d]\n", index);
+		return -1;
+	}
+	if (nbufs < 3 || nbufs > RING_MAX_BUFS) {
+		printf("Error: A ring needs 3 to %d buffers\n", RING_MAX_BUFS);
+		return -1;
+	}
+	pthread_mutex_lock(&runloop_lock);
+	if (kinects[index]) {
+		pthread_mutex_unlock(&runloop_lock);
+		printf("Error: Kinect [%d] is already running\n", index);
+		return -1;
+	}
+	ring_config_t *config = is_depth ? &sources[index].depth : &sources[index].video;
+	config->nbufs = nbufs;
+	config->policy = policy;
+	pthread_mutex_unlock(&runloop_lock);
+	return 0;
+}
+
+int freenect_sync_set_threading(int index, int own_thread, int cpu)
+{
+	if (index < 0 || index >= MAX_KINECTS) {
+		printf("Error: Invalid index [%d]\n", index);
+		return -1;
+	}
+	pthread_mutex_lock(&runloop_lock);
+	if (kinects[index]) {
+		pthread_mutex_unlock(&runloop_lock);
+		printf("Error: Kinect [%d] is already running\n", index);
+		return -1;
+	}
+	sources[index].own_thread = own_thread;
+	sources[index].cpu = cpu < 0 ? 0 : cpu + 1;
+	pthread_mutex_unlock(&runloop_lock);
+	return 0;
+}
+
+int freenect_sync_set_tap(int index, freenect_sync_tap_cb cb, void *user)
+{
+	if (index < 0 || index >= MAX_KINECTS) {
+		printf("Error: Invalid index [%d]\n", index);
+		return -1;
+	}
+	pthread_mutex_lock(&taps_lock);
+	if (cb) {
+		if (taps[index]) {
+			pthread_mutex_unlock(&taps_lock);
+			printf("Error: Kinect [%d] already has a tap\n", index);
+			return -1;
+		}
+		tap_t *tap = (tap_t *)malloc(sizeof(tap_t));
+		tap->cb = cb;
+		tap->user = user;
+		__atomic_store_n(&taps[index], tap, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&taps_lock);
+		return 0;
+	}
+	tap_t *tap = __atomic_exchange_n(&taps[index], NULL, __ATOMIC_SEQ_CST);
+	// A producer that loaded the tap is still counted in, the next ones see none
+	while (tap && __atomic_load_n(&tap_users[index], __ATOMIC_ACQUIRE))
+		sched_yield();
+	free(tap);
+	pthread_mutex_unlock(&taps_lock);
+	return 0;
+}
+
+int freenect_sync_get_fd(int index, int is_depth)
+{
+	if (index < 0 || index >= MAX_KINECTS || !kinects[index]) {
+		printf("Error: Kinect [%d] is not set up\n", index);
+		return -1;
+	}
+#ifdef __linux__
+	buffer_ring_t *buf = is_depth ? &kinects[index]->depth : &kinects[index]->video;
+	pthread_mutex_lock(&buf->lock);
+	if (buf->fd < 0) {
+		int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd < 0) {
+			pthread_mutex_unlock(&buf->lock);
+			printf("Error: Cannot create the frame descriptor of Kinect [%d]\n", index);
+			return -1;
+		}
+		// Frames already queued count as published once the producer sees the descriptor
+		__atomic_store_n(&buf->fd, fd, __ATOMIC_SEQ_CST);
+		if (RING_COUNT(__atomic_load_n(&buf->state, __ATOMIC_SEQ_CST)))
+			eventfd_write(fd, 1);
+	}
+	int fd = buf->fd;
+	pthread_mutex_unlock(&buf->lock);
+	return fd;
+#else
+	printf("Error: Frame descriptors are eventfds, only on Linux\n");
+	return -1;
+#endif
+}
+
+int freenect_sync_get_counters(freenect_sync_counters *counters, int index, int is_depth)
+{
+	if (index < 0 || index >= MAX_KINECTS || !kinects[index])
+		return -1;
+	buffer_ring_t *buf = is_depth ? &kinects[index]->depth : &kinects[index]->video;
+	freenect_sync_stats *stats = &telemetry[index][is_depth ? 1 : 0];
+	counters->produced = __atomic_load_n(&stats->produced, __ATOMIC_RELAXED);
+	counters->delivered = __atomic_load_n(&stats->delivered, __ATOMIC_RELAXED);
+	counters->dropped = __atomic_load_n(&stats->dropped, __ATOMIC_RELAXED);
+	counters->queued = RING_COUNT(__atomic_load_n(&buf->state, __ATOMIC_RELAXED));
+	return 0;
+}
+
+int freenect_sync_get_timing(freenect_sync_timing *timing, int index, int is_depth)
+{
+	if (index < 0 || index >= MAX_KINECTS || !kinects[index])
+		return -1;
+	freenect_sync_stats *stats = &telemetry[index][is_depth ? 1 : 0];
+	timing->wait_ns = __atomic_load_n(&stats->last_wait_ns, __ATOMIC_RELAXED);
+	timing->swap_ns = __atomic_load_n(&stats->last_swap_ns, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int freenect_sync_get_stats(freenect_sync_stats *stats, int index, int is_depth)
+{
+	if (index < 0 || index >= MAX_KINECTS)
+		return -1;
+	// Every field is a uint64_t, copied one at a time
+	const uint64_t *from = (const uint64_t *)&telemetry[index][is_depth ? 1 : 0];
+	uint64_t *to = (uint64_t *)stats;
+	size_t i;
+	for (i = 0; i < sizeof(freenect_sync_stats) / sizeof(uint64_t); ++i)
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+	return 0;
+}
+
+int freenect_sync_reset_stats(int index)
+{
+	if (index < 0 || index >= MAX_KINECTS)
+		return -1;
+	uint64_t *fields = (uint64_t *)telemetry[index];
+	size_t i;
+	for (i = 0; i < 2 * sizeof(freenect_sync_stats) / sizeof(uint64_t); ++i)
+		__atomic_store_n(&fields[i], 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void freenect_sync_record_convert(int index, int is_depth, uint64_t ns)
+{
+	if (index < 0 || index >= MAX_KINECTS)
+		return;
+	stat_set(&telemetry[index][is_depth ? 1 : 0].last_convert_ns, ns);
+	histogram_add(&telemetry[index][is_depth ? 1 : 0].convert, ns);
+}
+
+uint64_t freenect_sync_histogram_percentile(const freenect_sync_histogram *histogram, double p)
+{
+	uint64_t count = 0, total = 0;
+	int i;
+	for (i = 0; i < FREENECT_SYNC_HISTOGRAM_BUCKETS; ++i)
+		total += histogram->buckets[i];
+	if (!total)
+		return 0;
+	for (i = 0; i < FREENECT_SYNC_HISTOGRAM_BUCKETS - 1; ++i) {
+		count += histogram->buckets[i];
+		if (count >= p * total)
+			return (2ull << i) < histogram->max_ns ? 2ull << i : histogram->max_ns;
+	}
+	return histogram->max_ns;
+}
+
+static void *dump_stats(void *unused)
+{
+	const char *names[2] = {"rgb", "depth"};
+	static freenect_sync_stats last[MAX_KINECTS][2];
+	uint64_t then = monotonic_nsec();
+	int index, is_depth;
+	pthread_mutex_lock(&dump_lock);
+	while (dump_running) {
+		struct timespec deadline;
+		uint64_t end = monotonic_nsec() + (uint64_t)(dump_period * 1e9);
+		deadline.tv_sec = end / 1000000000ull;
+		deadline.tv_nsec = end % 1000000000ull;
+		while (dump_running && pthread_cond_timedwait(&dump_cond, &dump_lock, &deadline) != ETIMEDOUT)
+			;
+		if (!dump_running)
+			break;
+		uint64_t now = monotonic_nsec();
+		double seconds = (now - then) / 1e9;
+		then = now;
+		for (index = 0; index < MAX_KINECTS; ++index)
+			for (is_depth = 0; is_depth < 2; ++is_depth) {
+				freenect_sync_stats stats;
+				freenect_sync_get_stats(&stats, index, is_depth);
+				freenect_sync_stats *prev = &last[index][is_depth];
+				// A reset makes the counters go back, start over from them
+				if (stats.produced < prev->produced || stats.delivered < prev->delivered || stats.dropped < prev->dropped)
+					memset(prev, 0, sizeof(*prev));
+				if (stats.produced != prev->produced)
+					printf("Kinect [%d] %-5s produced %5.1f/s delivered %5.1f/s dropped %5.1f/s "
+					       "wait p50 %.1f p99 %.1f ms, latency p50 %.1f p99 %.1f ms, convert p50 %.1f p99 %.1f ms\n",
+					       index, names[is_depth],
+					       (stats.produced - prev->produced) / seconds, (stats.delivered - prev->delivered) / seconds,
+					       (stats.dropped - prev->dropped) / seconds,
+					       freenect_sync_histogram_percentile(&stats.wait, 0.5) / 1e6,
+					       freenect_sync_histogram_percentile(&stats.wait, 0.99) / 1e6,
+					       freenect_sync_histogram_percentile(&stats.latency, 0.5) / 1e6,
+					       freenect_sync_histogram_percentile(&stats.latency, 0.99) / 1e6,
+					       freenect_sync_histogram_percentile(&stats.convert, 0.5) / 1e6,
+					       freenect_sync_histogram_percentile(&stats.convert, 0.99) / 1e6);
+				*prev = stats;
+			}
+		fflush(stdout);
+	}
+	pthread_mutex_unlock(&dump_lock);
+	return NULL;
+}
+
+int freenect_sync_set_stats_dump(double period)
+{
+	if (period < 0) {
+		printf("Error: Invalid dump period %f\n", period);
+		return -1;
+	}
+	pthread_mutex_lock(&dump_lock);
+	int running = dump_running;
+	dump_running = 0;
+	pthread_cond_broadcast(&dump_cond);
+	pthread_mutex_unlock(&dump_lock);
+	if (running)
+		pthread_join(dump_thread, NULL);
+	if (!period)
+		return 0;
+	// Deadlines are on the monotonic clock
+	pthread_condattr_t cond_attr;
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_destroy(&dump_cond);
+	pthread_cond_init(&dump_cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	dump_period = period;
+	dump_running = 1;
+	if (pthread_create(&dump_thread, NULL, dump_stats, NULL)) {
+		dump_running = 0;
+		return -1;
+	}
 	return 0;
 }
 
 int freenect_sync_get_tilt_state(freenect_raw_tilt_state **state, int index)
 {
+	static freenect_raw_tilt_state level;
 	if (runloop_enter(index)) return -1;
-	freenect_update_tilt_state(kinects[index]->dev);
-	*state = freenect_get_tilt_state(kinects[index]->dev);
-	runloop_exit();
+	if (kinects[index]->dev) {
+		freenect_update_tilt_state(kinects[index]->dev);
+		*state = freenect_get_tilt_state(kinects[index]->dev);
+	} else {
+		*state = &level;
+	}
+	runloop_exit(index);
 	return 0;
 }
 
 int freenect_sync_set_tilt_degs(int angle, int index) {
 	if (runloop_enter(index)) return -1;
-	freenect_set_tilt_degs(kinects[index]->dev, angle);
-	runloop_exit();
+	if (kinects[index]->dev)
+		freenect_set_tilt_degs(kinects[index]->dev, angle);
+	runloop_exit(index);
 	return 0;
 }
 
 int freenect_sync_set_led(freenect_led_options led, int index) {
 	if (runloop_enter(index)) return -1;
-	freenect_set_led(kinects[index]->dev, led);
-	runloop_exit();
+	if (kinects[index]->dev)
+		freenect_set_led(kinects[index]->dev, led);
+	runloop_exit(index);
 	return 0;
 }
 
@@ -35,8 +35,82 @@
 extern "C" {
 #endif
 
+typedef enum {
+	FREENECT_SYNC_SOURCE_DEVICE = 0,    /* a real Kinect, through libfreenect */
+	FREENECT_SYNC_SOURCE_SYNTHETIC = 1, /* generated test pattern */
+	FREENECT_SYNC_SOURCE_REPLAY = 2,    /* raw frames read back from a file */
+	FREENECT_SYNC_SOURCE_RECORDING = 3, /* frames played back from a kinect_record file */
+} freenect_sync_source;
+
+typedef enum {
+	FREENECT_SYNC_LATEST = 0, /* the consumer gets the newest frame, older ones are dropped */
+	FREENECT_SYNC_QUEUE = 1,  /* the consumer gets frames in order, the oldest is dropped when full */
+} freenect_sync_policy;
+
+typedef struct {
+	uint64_t produced;  /* frames published by the producer */
+	uint64_t delivered; /* frames handed to the consumer */
+	uint64_t dropped;   /* frames recycled before the consumer got them */
+	int queued;         /* frames waiting for the consumer */
+} freenect_sync_counters;
+
+typedef struct {
+	int is_new;  /* 0 when no new frame came in time and the previous one is returned again */
+	double age;  /* seconds since the frame was published by the producer */
+} freenect_sync_frame_info;
+
+typedef struct {
+	uint64_t wait_ns; /* blocked until a frame was ready */
+	uint64_t swap_ns; /* spent swapping the ring buffers */
+} freenect_sync_timing;
+
+#define FREENECT_SYNC_HISTOGRAM_BUCKETS 32
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[FREENECT_SYNC_HISTOGRAM_BUCKETS]; /* i counts the values in [2^i, 2^(i+1)) ns, the last one
+	                                                      everything above, the first one also 0 */
+} freenect_sync_histogram;
+
+typedef struct {
+	uint64_t produced;                /* frames published by the producer */
+	uint64_t delivered;               /* frames handed to the consumer */
+	uint64_t dropped;                 /* frames overwritten before the consumer got them */
+	uint64_t last_wait_ns;            /* the last get blocked this long */
+	uint64_t last_swap_ns;            /* the last get spent this long swapping the ring buffers */
+	uint64_t last_convert_ns;         /* the last freenect_sync_record_convert */
+	freenect_sync_histogram wait;     /* consumer blocked until a frame was ready */
+	freenect_sync_histogram latency;  /* from the publication of a frame to its delivery */
+	freenect_sync_histogram convert;  /* conversion of a delivered frame, see freenect_sync_record_convert */
+} freenect_sync_stats;
+
+typedef void (*freenect_sync_tap_cb)(void *user, int is_depth, const void *data, int size, int fmt,
+                                     uint32_t timestamp, uint64_t published_ns);
+
 int wrap_setup_kinect(int index, int fmt, int is_depth);
 
+int freenect_sync_set_source(int index, freenect_sync_source source, const char *path, double fps);
+/*  Select where the frames of a device index come from, must be called before the device is set up
+
+    Synthetic and replay sources need no hardware: a feeder thread fills the same buffer rings as the
+    libfreenect callbacks, so every other function of this API works unchanged. Tilt and LED calls are
+    ignored for them. A replay file is a sequence of records, each one FREENECT_VIDEO_RGB frame followed
+    by one FREENECT_DEPTH_11BIT frame (medium resolution), and is played in a loop. A recording is read
+    through kinect_playback and also played in a loop, each stream with the device timestamps it was
+    recorded with; a stream whose format differs from the recorded one gets the synthetic pattern.
+
+    Args:
+        index: Device index (0 is the first)
+        source: Where the frames come from
+        path: Replay file or recording, ignored by the other sources
+        fps: Frames per second of the synthetic, replay and recording sources, 0 for as fast as possible
+
+    Returns:
+        Nonzero on error.
+*/
+
 int freenect_sync_get_video(void **video, uint32_t *timestamp, int index, freenect_video_format fmt);
 /*  Synchronous video function, starts the runloop if it isn't running
 
@@ -70,6 +144,189 @@ int freenect_sync_get_depth(void **depth, uint32_t *timestamp, int index, freene
         Nonzero on error.
 */
 
+int freenect_sync_set_ring(int index, int is_depth, int nbufs, freenect_sync_policy policy);
+/*  Size and policy of the buffer ring of a stream, must be called before the device is set up
+
+    The ring holds nbufs frame buffers: one for the producer, one for the consumer and nbufs - 2 to
+    queue published frames. The default, 3 buffers with FREENECT_SYNC_LATEST, is a triple buffer.
+    FREENECT_SYNC_QUEUE lets the consumer fall nbufs - 2 frames behind without losing any. Frames are
+    handed over without locks, the producer never waits for the consumer.
+
+    Args:
+        index: Device index (0 is the first)
+        is_depth: Which stream to configure
+        nbufs: Number of frame buffers, 3 to 16
+        policy: Which frame the consumer gets
+
+    Returns:
+        Nonzero on error.
+*/
+
+int freenect_sync_set_threading(int index, int own_thread, int cpu);
+/*  Give a device a libfreenect context and an event thread of its own, must be called before the
+    device is set up
+
+    By default every device shares one context, whose events are processed by one thread under one
+    lock: a tilt or LED call, or a slow callback, on one device holds up the frames of all of them.
+    The producers of a device with its own thread run in parallel with the other devices, and its
+    tilt, LED and format calls only wait on its own thread. The feeder thread of the other sources is
+    already per device, under a lock of its own: own_thread is ignored for them but the feeder is
+    pinned to cpu.
+
+    Args:
+        index: Device index (0 is the first)
+        own_thread: Nonzero for a context and event thread of its own
+        cpu: CPU the event (or feeder) thread is pinned to, -1 to let it run anywhere (Linux only)
+
+    Returns:
+        Nonzero on error.
+*/
+
+int freenect_sync_get_counters(freenect_sync_counters *counters, int index, int is_depth);
+/*  Frame counters of a stream, from its telemetry (see freenect_sync_get_stats) and its queue
+
+    Returns:
+        Nonzero on error.
+*/
+
+int freenect_sync_get_fd(int index, int is_depth);
+/*  File descriptor of a stream, readable while frames wait for the consumer, for select/poll/epoll
+
+    An eventfd (Linux only) created on the first call and closed by freenect_sync_stop. The producer
+    signals it as it publishes a frame and the consumer clears it as it takes the last queued one,
+    so it does not stay readable with nothing to take and no frame published meanwhile is missed.
+    Do not read it, get the frame with a timeout of 0 instead, which never blocks.
+
+    Args:
+        index: Device index (0 is the first), which must be set up
+        is_depth: Which stream
+
+    Returns:
+        The descriptor, -1 on error.
+*/
+
+int freenect_sync_set_tap(int index, freenect_sync_tap_cb cb, void *user);
+/*  Hand every frame of a device to cb as it is published, NULL to remove it
+
+    cb runs on the thread producing the frames, before the consumer can get them, so it must only
+    copy what it needs and return: the grab calls are never held up by it. There is one tap per
+    device. The producers read it without taking a lock, and a removal waits until no producer of
+    the device is in cb: once the tap is removed, cb is no longer running.
+
+    Args:
+        cb: Called with the stream, the frame buffer, its size and format, the device timestamp
+            and the CLOCK_MONOTONIC time it was published at
+        user: Passed back to cb
+
+    Returns:
+        Nonzero on error, or if the device already has a tap.
+*/
+
+int freenect_sync_get_video_timeout(void **video, uint32_t *timestamp, int index, freenect_video_format fmt, int timeout_ms, freenect_sync_frame_info *info);
+int freenect_sync_get_depth_timeout(void **depth, uint32_t *timestamp, int index, freenect_depth_format fmt, int timeout_ms, freenect_sync_frame_info *info);
+/*  Like freenect_sync_get_video/depth, but waits at most timeout_ms for a new frame
+
+    When no new frame comes in time, the last frame returned is returned again (and stays valid until
+    the next call), so a stalled device can't hang the caller.
+
+    Args:
+        timeout_ms: Negative to wait as long as it takes, 0 to return at once
+        info: If not NULL, populated with the freshness of the returned frame
+
+    Returns:
+        0 on success, 1 if no frame came in time and there is no previous one, negative on error.
+*/
+
+int freenect_sync_get_pair(void **video, uint32_t *video_timestamp, void **depth, uint32_t *depth_timestamp, int index,
+                           freenect_video_format video_fmt, freenect_depth_format depth_fmt, int64_t max_skew,
+                           int timeout_ms, freenect_sync_frame_info *video_info, freenect_sync_frame_info *depth_info);
+/*  A video and a depth frame matched by timestamp, instead of whichever frame each stream has ready
+
+    Pairs are made among the frames not returned yet, so the depth of each ring (freenect_sync_set_ring)
+    is the history searched. With a negative max_skew the closest pair is returned as soon as both
+    streams have a frame, so the call waits at most about one frame period.
+
+    Args:
+        max_skew: Largest timestamp difference accepted, negative for the closest pair
+        timeout_ms: Negative to wait as long as it takes, 0 to return at once
+
+    Returns:
+        0 on success, 1 if no pair came in time (nothing is consumed), negative on error.
+*/
+
+int freenect_sync_lease_video(void **video, uint32_t *timestamp, int index, freenect_video_format fmt);
+int freenect_sync_lease_depth(void **depth, uint32_t *timestamp, int index, freenect_depth_format fmt);
+/*  Like freenect_sync_get_video/depth, but the buffer is taken out of the ring
+
+    The ring goes on with a spare buffer, so the returned one is never written by the producer and
+    stays valid until it is given back with freenect_sync_release. Frames are not copied.
+
+    Returns:
+        Nonzero on error.
+*/
+
+int freenect_sync_release(void *data, int index, int is_depth);
+/*  Give a leased buffer back to the ring it came from
+
+    The leases are recorded apart from the device, so a buffer leased before the device was stopped
+    or set up again is still given back (and freed). Only a recorded lease is ever freed.
+
+    Args:
+        data: Buffer returned by freenect_sync_lease_video (is_depth = 0) or freenect_sync_lease_depth
+        index: Device index (0 is the first)
+        is_depth: Which stream the buffer was leased from
+
+    Returns:
+        Nonzero on error, or if data is not leased from this stream.
+*/
+
+int freenect_sync_is_leased(const void *data, int index, int is_depth);
+/*  Nonzero if data is a buffer leased from a stream and not released yet */
+
+int freenect_sync_get_timing(freenect_sync_timing *timing, int index, int is_depth);
+/*  Stage timings of the last freenect_sync_get_video (is_depth = 0) or freenect_sync_get_depth call,
+    from the telemetry of the stream
+
+    Args:
+        timing: Populated with the timings of the last call
+        index: Device index (0 is the first)
+        is_depth: Which stream to look at
+
+    Returns:
+        Nonzero on error.
+*/
+
+int freenect_sync_get_stats(freenect_sync_stats *stats, int index, int is_depth);
+/*  Telemetry of a stream since the device was first set up or the stats were reset
+
+    Nothing is locked: the counters are updated with relaxed atomics as frames go through the ring and
+    read one by one, so the fields of a snapshot taken while frames flow may be a few frames apart.
+    Cheap enough to be left on.
+
+    Returns:
+        Nonzero on error.
+*/
+
+int freenect_sync_reset_stats(int index);
+/*  Zero the telemetry of both streams of a device */
+
+void freenect_sync_record_convert(int index, int is_depth, uint64_t ns);
+/*  Count the conversion of a frame of a stream in its telemetry, for callers converting frames */
+
+uint64_t freenect_sync_histogram_percentile(const freenect_sync_histogram *histogram, double p);
+/*  Upper bound of the bucket the p-th fraction (0 to 1) of the values falls in, at most the largest
+    value, 0 if empty */
+
+int freenect_sync_set_stats_dump(double period);
+/*  Print the telemetry of every running stream each period seconds, from a thread of its own
+
+    Each line has the produced, delivered and dropped frame rates since the last dump and the p50/p99
+    of the wait, latency and conversion times. A period of 0 stops the dump.
+
+    Returns:
+        Nonzero on error.
+*/
+
 int freenect_sync_set_tilt_degs(int angle, int index);
 /*  Tilt function, starts the runloop if it isn't running
 
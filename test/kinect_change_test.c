@@ -0,0 +1,211 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ *
+ * Change detection of kinect_change, for ctest: exits nonzero if the tiles found
+ * changed or the rectangles they are merged into are not the expected ones
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kinect_change.h"
+
+#define WIDTH KINECT_CHANGE_WIDTH
+#define HEIGHT KINECT_CHANGE_HEIGHT
+#define TILE 32
+#define COLS (WIDTH / TILE)
+#define ROWS (HEIGHT / TILE)
+
+static uint32_t seed = 1;
+
+static uint32_t next_random(void)
+{
+	seed = seed * 1664525u + 1013904223u;
+	return seed >> 8;
+}
+
+/* sets the pixels of a tile: rgb to value if it is not negative, depth to depth if it is not negative */
+static void paint(unsigned char *rgb, uint16_t *depth, int tx, int ty, int value, int d)
+{
+	int x, y;
+	for (y = ty * TILE; y < (ty + 1) * TILE; ++y)
+		for (x = tx * TILE; x < (tx + 1) * TILE; ++x) {
+			if (value >= 0)
+				memset(rgb + 3 * (y * WIDTH + x), value, 3);
+			if (d >= 0)
+				depth[y * WIDTH + x] = d;
+		}
+}
+
+/*
+  Detects the changes of a frame, checks the number of tiles, the mask against
+  the tiles listed in expected (tx, ty pairs, -1 ends) and the rectangles
+  against regions (x, y, w, h in pixels, -1 ends)
+*/
+static int check(const char *name, kinect_change *change, const unsigned char *rgb, const uint16_t *depth,
+                 const int *expected, const int *regions)
+{
+	uint8_t mask[ROWS][COLS];
+	int changed = kinect_change_detect(change, rgb, depth);
+	int cols, rows, n, i, tiles = 0;
+	const uint8_t *found = kinect_change_mask(change, &cols, &rows);
+	const kinect_change_region *rects = kinect_change_regions(change, &n);
+	int failed = 0;
+
+	memset(mask, 0, sizeof(mask));
+	for (i = 0; expected[i] >= 0; i += 2, ++tiles)
+		mask[expected[i + 1]][expected[i]] = 1;
+	if (cols != COLS || rows != ROWS) {
+		printf("%s: %dx%d tiles\n", name, cols, rows);
+		return 1;
+	}
+	if (changed != tiles) {
+		printf("%s: %d tiles changed, %d expected\n", name, changed, tiles);
+		failed = 1;
+	}
+	if (memcmp(found, mask, sizeof(mask))) {
+		printf("%s: not the tiles expected\n", name);
+		failed = 1;
+	}
+	for (i = 0; regions[4 * i] >= 0; ++i)
+		if (i >= n || rects[i].x != regions[4 * i] || rects[i].y != regions[4 * i + 1] ||
+		    rects[i].w != regions[4 * i + 2] || rects[i].h != regions[4 * i + 3]) {
+			printf("%s: rectangle %d is not %dx%d at %d,%d\n", name, i, regions[4 * i + 2],
+			       regions[4 * i + 3], regions[4 * i], regions[4 * i + 1]);
+			failed = 1;
+		}
+	if (n != i) {
+		printf("%s: %d rectangles, %d expected\n", name, n, i);
+		failed = 1;
+	}
+	if (!failed)
+		printf("%s: %d tiles, %d rectangles\n", name, changed, n);
+	return failed;
+}
+
+int main(void)
+{
+	unsigned char *rgb = (unsigned char *)malloc(WIDTH * HEIGHT * 3);
+	uint16_t *depth = (uint16_t *)malloc(WIDTH * HEIGHT * sizeof(uint16_t));
+	kinect_change_params params = {TILE, 8, 5, 2047};
+	kinect_change *change = kinect_change_open(&params);
+	int all[2 * COLS * ROWS + 1];
+	const int none[] = {-1};
+	int failures = 0;
+	long i;
+
+	if (!change) {
+		printf("kinect_change: tiles of %d refused\n", TILE);
+		return 1;
+	}
+	for (i = 0; i < COLS * ROWS; ++i) {
+		all[2 * i] = i % COLS;
+		all[2 * i + 1] = i / COLS;
+	}
+	all[2 * COLS * ROWS] = -1;
+
+	// a noisy scene, below the thresholds from frame to frame
+	for (i = 0; i < WIDTH * HEIGHT; ++i) {
+		memset(rgb + 3 * i, 100 + next_random() % 4, 3);
+		depth[i] = 700 + next_random() % 3;
+	}
+	{
+		const int whole[] = {0, 0, WIDTH, HEIGHT, -1};
+		failures += check("first frame", change, rgb, depth, all, whole);
+	}
+	failures += check("same frame", change, rgb, depth, none, none);
+
+	// a block of 3x3 tiles is one rectangle
+	{
+		const int tiles[] = {2, 1, 3, 1, 4, 1, 2, 2, 3, 2, 4, 2, 2, 3, 3, 3, 4, 3, -1};
+		const int rects[] = {2 * TILE, TILE, 3 * TILE, 3 * TILE, -1};
+		for (i = 0; tiles[i] >= 0; i += 2)
+			paint(rgb, depth, tiles[i], tiles[i + 1], 200, -1);
+		failures += check("block", change, rgb, depth, tiles, rects);
+	}
+	// the reference followed the block
+	failures += check("block again", change, rgb, depth, none, none);
+
+	// runs only merge down while they start and end in the same columns: a run of 2 tiles over a
+	// run of 3 starts a new rectangle, which the same run of 3 below continues. Two runs on a row
+	// are two rectangles, the one with the same run below grows
+	{
+		const int tiles[] = {0, 5, 1, 5, 0, 6, 1, 6, 2, 6, 0, 7, 1, 7, 2, 7,
+		                     10, 10, 12, 10, 13, 10, 10, 11, 12, 11, 13, 11, 12, 12, -1};
+		const int rects[] = {0, 5 * TILE, 2 * TILE, TILE,
+		                     0, 6 * TILE, 3 * TILE, 2 * TILE,
+		                     10 * TILE, 10 * TILE, TILE, 2 * TILE,
+		                     12 * TILE, 10 * TILE, 2 * TILE, 2 * TILE,
+		                     12 * TILE, 12 * TILE, TILE, TILE, -1};
+		for (i = 0; tiles[i] >= 0; i += 2)
+			paint(rgb, depth, tiles[i], tiles[i + 1], 20, -1);
+		failures += check("runs", change, rgb, depth, tiles, rects);
+	}
+
+	// depth: a tile moves when its depth moves more than the threshold on average
+	{
+		const int tiles[] = {19, 14, -1};
+		const int rects[] = {19 * TILE, 14 * TILE, TILE, TILE, -1};
+		paint(rgb, depth, 18, 14, -1, 704);
+		paint(rgb, depth, 19, 14, -1, 720);
+		failures += check("depth", change, rgb, depth, tiles, rects);
+	}
+
+	// readings lost: over a quarter of a tile is a change, under it is not
+	{
+		const int tiles[] = {5, 0, -1};
+		const int rects[] = {5 * TILE, 0, TILE, TILE, -1};
+		int x, y;
+		for (y = 0; y < TILE; ++y)
+			for (x = 0; x < TILE; ++x) {
+				if (y < TILE / 2)
+					depth[y * WIDTH + 5 * TILE + x] = 2047;
+				if (y < TILE / 8)
+					depth[y * WIDTH + 7 * TILE + x] = 2047;
+			}
+		failures += check("readings", change, rgb, depth, tiles, rects);
+	}
+
+	// the next frame after a reset changes every tile
+	kinect_change_reset(change);
+	{
+		const int whole[] = {0, 0, WIDTH, HEIGHT, -1};
+		failures += check("reset", change, rgb, depth, all, whole);
+	}
+	failures += check("after reset", change, rgb, depth, none, none);
+
+	// the tiles must divide 160
+	params.tile = 24;
+	if (kinect_change_open(&params)) {
+		printf("tiles of 24 accepted\n");
+		++failures;
+	}
+
+	kinect_change_close(change);
+	free(rgb);
+	free(depth);
+	printf("kinect_change: %d checks failed\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ *
+ * Round trip of the lossless depth coding of kinect_record, for ctest: exits
+ * nonzero if a frame does not decode to itself
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kinect_record.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+
+static uint32_t seed = 1;
+
+static uint32_t next_random(void)
+{
+	seed = seed * 1664525u + 1013904223u;
+	return seed >> 8;
+}
+
+/* codes a frame, checks it decodes to itself and that a truncated code is refused */
+static int round_trip(const char *name, const uint16_t *depth, int width, int height)
+{
+	unsigned char *code = (unsigned char *)malloc(kinect_record_depth_bound(width, height));
+	uint16_t *decoded = (uint16_t *)malloc((long)width * height * sizeof(uint16_t));
+	long size = kinect_record_encode_depth(depth, width, height, code);
+	int failed = 0;
+	if (size > kinect_record_depth_bound(width, height)) {
+		printf("%s: %ld bytes, past the bound\n", name, size);
+		failed = 1;
+	} else if (kinect_record_decode_depth(code, size, width, height, decoded) ||
+	           memcmp(decoded, depth, (long)width * height * sizeof(uint16_t))) {
+		printf("%s: does not decode to itself\n", name);
+		failed = 1;
+	} else if (size > 8 && !kinect_record_decode_depth(code, size / 2, width, height, decoded)) {
+		printf("%s: decodes with half of its %ld bytes\n", name, size);
+		failed = 1;
+	} else {
+		printf("%s: %ld bytes, %.1f bits per pixel\n", name, size, 8.0 * size / ((long)width * height));
+	}
+	free(code);
+	free(decoded);
+	return failed;
+}
+
+int main(void)
+{
+	uint16_t *depth = (uint16_t *)malloc(WIDTH * HEIGHT * sizeof(uint16_t));
+	int failures = 0;
+	long i;
+	int x, y;
+
+	// 11-bit disparities: a slope with noise, and 2047 where there is no reading
+	for (y = 0; y < HEIGHT; ++y)
+		for (x = 0; x < WIDTH; ++x)
+			depth[y * WIDTH + x] = next_random() % 16 == 0 ? 2047 : 600 + x / 4 + y / 8 + next_random() % 5;
+	failures += round_trip("raw", depth, WIDTH, HEIGHT);
+
+	// millimeters: smooth surfaces, and 0 where there is no reading
+	for (y = 0; y < HEIGHT; ++y)
+		for (x = 0; x < WIDTH; ++x)
+			depth[y * WIDTH + x] = (x / 64 + y / 48) % 7 == 0 ? 0 : 800 + 3 * x + 2 * y + next_random() % 9;
+	failures += round_trip("mm", depth, WIDTH, HEIGHT);
+
+	// nothing but the invalid markers
+	for (i = 0; i < WIDTH * HEIGHT; ++i)
+		depth[i] = 2047;
+	failures += round_trip("all 2047", depth, WIDTH, HEIGHT);
+	memset(depth, 0, WIDTH * HEIGHT * sizeof(uint16_t));
+	failures += round_trip("all 0", depth, WIDTH, HEIGHT);
+
+	// deltas too large for a Rice code, escaped: the extremes alternate, then any 16-bit value
+	for (i = 0; i < WIDTH * HEIGHT; ++i)
+		depth[i] = i % 2 ? 65535 : 0;
+	failures += round_trip("0 and 65535", depth, WIDTH, HEIGHT);
+	for (i = 0; i < WIDTH * HEIGHT; ++i)
+		depth[i] = (uint16_t)next_random();
+	failures += round_trip("16-bit noise", depth, WIDTH, HEIGHT);
+
+	// flat rows hit by spikes, which are escaped
+	for (y = 0; y < HEIGHT; ++y)
+		for (x = 0; x < WIDTH; ++x)
+			depth[y * WIDTH + x] = x % 97 == 13 ? 40000 : 1000;
+	failures += round_trip("spikes", depth, WIDTH, HEIGHT);
+
+	// odd sizes, the code does not end on a word
+	failures += round_trip("17x5", depth, 17, 5);
+
+	free(depth);
+	printf("kinect_record: %d frames do not round trip\n", failures);
+	return failures ? 1 : 0;
+}